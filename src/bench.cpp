@@ -0,0 +1,734 @@
+//
+// Ray tracing benchmark. Traces primary, shadow, ambient occlusion and
+// diffuse bounce rays through the CPU tracer and reports Mrays/s.
+//
+// Rays are generated once per camera from a fixed seed before timing, so
+// each workload traces exactly the same rays on every run. Only
+// traversal is timed.
+//
+// With -o it compares pixel orders instead. For each order the primary
+// rays of a frame are traced in that order, in chunks handed to the
+// worker pool, and as tile order of the tile renderer. The addresses one
+// core reads tracing the frame in that order are fed to a model of its
+// caches to get their hit rates.
+//
+// -H puts the BVH arrays on huge pages. Data TLB misses per ray are read
+// from the performance counters where the system allows it, and the host
+// memory counters of each build are printed.
+//
+
+#include "scene.hpp"
+#include "bvhrt.hpp"
+#include "flatbvh.hpp"
+#include "hostmemory.hpp"
+#include "camera.hpp"
+#include "tilerenderer.hpp"
+#include "pixelorder.hpp"
+#include "workerpool.hpp"
+#include "random.hpp"
+#include "sampling.hpp"
+#include "stats.hpp"
+#include "timer.hpp"
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+using namespace dn;
+
+// Default suite, used when no scenes are given on command line. Missing
+// scenes are skipped.
+static const char* default_suite[][2] = {
+    { "bunny.obj", "cameras/bunny.txt" },
+    { "conference.obj", "camera.txt" },
+};
+
+#define RAYS_PER_TASK 1024
+
+// Caches of the model, lines of 64 bytes.
+#define CACHE_LINE 64
+#define L1_SIZE (32 * 1024)
+#define L1_WAYS 8
+#define L2_SIZE (1024 * 1024)
+#define L2_WAYS 16
+
+struct Options
+{
+    int width;
+    int height;
+    int threads;
+    int warmup;
+    int repetitions;
+    int ao_samples;
+    unsigned int seed;
+    const char* json;
+    bool orders;
+    HostMemory::HugePages huge_pages;
+};
+
+struct Workload
+{
+    std::string name;
+    bool any_hit;
+    std::vector<Vector3f> orig;
+    std::vector<Vector3f> dir;
+    std::vector<float> tmax;
+    std::vector<int> result;
+
+    void add(const Vector3f& o, const Vector3f& d, float t)
+    {
+        orig.push_back(o);
+        dir.push_back(d);
+        tmax.push_back(t);
+    }
+
+    int size() const { return (int)orig.size(); }
+
+    int count_hits() const
+    {
+        int n = 0;
+        for (int i = 0; i < (int)result.size(); i++)
+            n += result[i] >= 0;
+        return n;
+    }
+};
+
+struct Result
+{
+    std::string scene;
+    std::string camera;
+    int camera_index;
+    std::string workload;
+    int rays;
+    int hits;
+    Samples mrays;
+    double dtlb_misses;     // per ray, negative if not counted
+};
+
+//
+// Data TLB load misses of all threads of the process, counted in user
+// space. Threads started later aren't counted, so make this after the
+// worker pool. Counters are often not there (virtual machines, a strict
+// perf_event_paranoid), then is_available() is false.
+//
+
+class TlbCounter
+{
+public:
+    TlbCounter()
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        DIR* dir = opendir("/proc/self/task");
+        if (!dir)
+            return;
+
+        bool failed = false;
+        while (dirent* e = readdir(dir))
+        {
+            if (e->d_name[0] == '.')
+                continue;
+            int fd = (int)syscall(__NR_perf_event_open, &attr, atoi(e->d_name), -1, -1, 0);
+            if (fd < 0)
+            {
+                failed = true;
+                break;
+            }
+            fds.push_back(fd);
+        }
+        closedir(dir);
+
+        if (failed)
+            close_all();
+    }
+
+    ~TlbCounter()
+    {
+        close_all();
+    }
+
+    bool is_available() const { return !fds.empty(); }
+
+    void start()
+    {
+        for (int i = 0; i < (int)fds.size(); i++)
+        {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    uint64_t stop()
+    {
+        uint64_t sum = 0;
+        for (int i = 0; i < (int)fds.size(); i++)
+        {
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t n;
+            if (read(fds[i], &n, sizeof(n)) == sizeof(n))
+                sum += n;
+        }
+        return sum;
+    }
+
+private:
+    void close_all()
+    {
+        for (int i = 0; i < (int)fds.size(); i++)
+            close(fds[i]);
+        fds.clear();
+    }
+
+    std::vector<int> fds;
+};
+
+class TraceJob : public WorkerPool::Job
+{
+public:
+    TraceJob(const FlatBVH* bvh, Workload* w) : bvh(bvh), w(w) {}
+
+    void run(int task, int thread)
+    {
+        int end = std::min((task + 1) * RAYS_PER_TASK, w->size());
+
+        for (int i = task * RAYS_PER_TASK; i < end; i++)
+        {
+            if (w->any_hit)
+                w->result[i] = bvh->occluded(w->orig[i], w->dir[i], w->tmax[i]) ? 1 : -1;
+            else
+            {
+                float t, u, v;
+                w->result[i] = bvh->intersect(w->orig[i], w->dir[i], t, u, v);
+            }
+        }
+    }
+
+private:
+    const FlatBVH* bvh;
+    Workload* w;
+};
+
+//
+// Set associative cache with LRU replacement.
+//
+
+class Cache
+{
+public:
+    Cache(int size, int ways)
+    :   ways(ways), sets(size / CACHE_LINE / ways), tags(sets * ways, ~0ULL),
+        ages(sets * ways, 0), clock(0), accesses(0), hits(0)
+    {
+    }
+
+    bool access(uint64_t line)
+    {
+        uint64_t* t = &tags[(line % sets) * ways];
+        uint64_t* age = &ages[(line % sets) * ways];
+        int victim = 0;
+
+        accesses++;
+        for (int i = 0; i < ways; i++)
+        {
+            if (t[i] == line)
+            {
+                age[i] = ++clock;
+                hits++;
+                return true;
+            }
+            if (age[i] < age[victim])
+                victim = i;
+        }
+
+        t[victim] = line;
+        age[victim] = ++clock;
+        return false;
+    }
+
+    double get_hit_rate() const { return accesses ? hits / (double)accesses : 0.0; }
+    uint64_t get_misses() const { return accesses - hits; }
+
+private:
+    int ways;
+    int sets;
+    std::vector<uint64_t> tags;
+    std::vector<uint64_t> ages;
+    uint64_t clock;
+    uint64_t accesses;
+    uint64_t hits;
+};
+
+// Two cache levels of one core.
+class CacheModel : public FlatBVH::AccessRecorder
+{
+public:
+    CacheModel() : l1(L1_SIZE, L1_WAYS), l2(L2_SIZE, L2_WAYS) {}
+
+    void access(const void* p, int size)
+    {
+        uint64_t first = (uintptr_t)p / CACHE_LINE;
+        uint64_t last = ((uintptr_t)p + size - 1) / CACHE_LINE;
+        for (uint64_t line = first; line <= last; line++)
+            if (!l1.access(line))
+                l2.access(line);
+    }
+
+    Cache l1;
+    Cache l2;
+};
+
+static void get_primary(const Matrix4x4f& to_world, int x, int y, int width, int height,
+        Vector3f& orig, Vector3f& dir)
+{
+    float fx = (x + 0.5f) / width * 2.f - 1.f;
+    float fy = (y + 0.5f) / height * 2.f - 1.f;
+
+    orig = (to_world * Vector4f(fx, fy, -1.f, 1.f)).project();
+    dir = (to_world * Vector4f(fx, fy, 1.f, 1.f)).project() - orig;
+}
+
+// Primary rays of a frame traced in pixel order.
+class OrderJob : public WorkerPool::Job
+{
+public:
+    OrderJob(const FlatBVH* bvh, const PixelOrder* order, const Matrix4x4f& to_world, int* result)
+    :   bvh(bvh), order(order), to_world(to_world), result(result) {}
+
+    void run(int task, int thread)
+    {
+        int width = order->get_width();
+        int height = order->get_height();
+        int end = std::min((task + 1) * RAYS_PER_TASK, order->get_count());
+
+        for (int i = task * RAYS_PER_TASK; i < end; i++)
+        {
+            Vector2i c = order->get_coord(i);
+            Vector3f o, d;
+            get_primary(to_world, c.x, c.y, width, height, o, d);
+
+            float t, u, v;
+            result[c.y * width + c.x] = bvh->intersect(o, d, t, u, v);
+        }
+    }
+
+private:
+    const FlatBVH* bvh;
+    const PixelOrder* order;
+    Matrix4x4f to_world;
+    int* result;
+};
+
+static void trace(WorkerPool* pool, const FlatBVH* bvh, Workload* w)
+{
+    w->result.resize(w->size());
+    TraceJob job(bvh, w);
+    pool->run(&job, (w->size() + RAYS_PER_TASK - 1) / RAYS_PER_TASK);
+}
+
+static void make_primary(Workload& w, const Camera& cam, int width, int height)
+{
+    Matrix4x4f to_world = cam.get_to_world();
+
+    w.name = "primary";
+    w.any_hit = false;
+
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+        {
+            Vector3f o, d;
+            get_primary(to_world, x, y, width, height, o, d);
+            w.add(o, d, boost::numeric::bounds<float>::highest());
+        }
+}
+
+// Spawns secondary rays from the primary hits.
+static void make_secondary(const Scene& scene, const Workload& primary, const Options& opt,
+        Workload& shadow, Workload& ao, Workload& diffuse)
+{
+    const AABBf& bounds = scene.get_aabb();
+    Vector3f diag = bounds.get_diagonal();
+    float eps = diag.length() * 1e-5f;
+    float ao_radius = diag.length() * 0.05f;
+
+    // Point light near the top of the scene, off the center so that it
+    // doesn't end up inside a single centered object.
+    Vector3f light = bounds.min + scale(diag, Vector3f(0.75f, 0.9f, 0.75f));
+
+    shadow.name = "shadow";
+    shadow.any_hit = true;
+    ao.name = "ao";
+    ao.any_hit = true;
+    diffuse.name = "diffuse";
+    diffuse.any_hit = false;
+
+    Random rnd(opt.seed);
+
+    for (int i = 0; i < primary.size(); i++)
+    {
+        int id = primary.result[i];
+        if (id < 0)
+            continue;
+
+        const Vector3f& o = primary.orig[i];
+        const Vector3f& d = primary.dir[i];
+
+        float t, u, v;
+        if (!scene.get_primitive(id).intersect(o, d, t, u, v))
+            continue;
+
+        Vector3f n = normalize(scene.get_primitive(id).get_normal(u, v));
+        if (dot(n, d) > 0.f)
+            n = -n;
+
+        Vector3f p = o + d * t + n * eps;
+
+        shadow.add(p, light - p, 1.f);
+
+        for (int j = 0; j < opt.ao_samples; j++)
+        {
+            float u1 = rnd.next_float();
+            float u2 = rnd.next_float();
+            ao.add(p, sample_cosine_hemisphere(n, u1, u2), ao_radius);
+        }
+
+        float u1 = rnd.next_float();
+        float u2 = rnd.next_float();
+        diffuse.add(p, sample_cosine_hemisphere(n, u1, u2), boost::numeric::bounds<float>::highest());
+    }
+}
+
+static void measure(WorkerPool* pool, const FlatBVH* bvh, Workload& w, const Options& opt,
+        TlbCounter& tlb, Result& res)
+{
+    for (int i = 0; i < opt.warmup; i++)
+        trace(pool, bvh, &w);
+
+    uint64_t misses = 0;
+    for (int i = 0; i < opt.repetitions; i++)
+    {
+        tlb.start();
+        trace(pool, bvh, &w);
+        misses += tlb.stop();
+        res.mrays.add(w.size() / pool->get_run_time() * 1e-6);
+    }
+
+    res.workload = w.name;
+    res.rays = w.size();
+    res.hits = w.count_hits();
+    res.dtlb_misses = tlb.is_available() && res.rays ?
+        misses / ((double)res.rays * opt.repetitions) : -1.0;
+
+    printf("  %-10s %10d %10d %10.2f %10.2f %10.2f %10.2f %10.2f",
+            w.name.c_str(), res.rays, res.hits, res.mrays.median(),
+            res.mrays.percentile(10.0), res.mrays.percentile(90.0),
+            res.mrays.min(), res.mrays.max());
+    if (res.dtlb_misses >= 0.0)
+        printf(" %10.3f\n", res.dtlb_misses);
+    else
+        printf(" %10s\n", "-");
+}
+
+// Huge pages the process has, from the kernel's summary of its mappings.
+static double get_huge_page_mb()
+{
+    FILE* fp = fopen("/proc/self/smaps_rollup", "rt");
+    if (!fp)
+        return -1.0;
+
+    char line[256];
+    double kb = -1.0;
+    while (fgets(line, sizeof(line), fp))
+        if (!strncmp(line, "AnonHugePages:", 14))
+            kb = atof(line + 14);
+    fclose(fp);
+    return kb / 1024.0;
+}
+
+static void print_host_memory(const HostMemory::Counters& c, double time)
+{
+    printf("host memory: %llu allocations (%.0f/s), %.1f%% from pool, %llu from system (%.2f MB), "
+            "%llu huge blocks, %llu resize copies, peak %.2f MB",
+            (unsigned long long)c.allocations, time > 0.0 ? c.allocations / time : 0.0,
+            c.allocations ? c.pool_hits * 100.0 / c.allocations : 0.0,
+            (unsigned long long)c.system_allocations, c.system_bytes / 1e6,
+            (unsigned long long)c.huge_blocks, (unsigned long long)c.resize_copies,
+            c.peak_in_use / 1e6);
+
+    double huge = get_huge_page_mb();
+    if (huge >= 0.0)
+        printf(", %.1f MB on huge pages", huge);
+    printf("\n");
+}
+
+//
+// Frame times and modeled cache hit rates of the pixel orders. Trace is
+// the frame traced in the order, tiles the visibility pass of the tile
+// renderer using the order for its tiles. Mem is the lines per ray that
+// miss both cache levels.
+//
+
+static void compare_orders(WorkerPool* pool, FlatBVH* bvh, const Camera& cam, const Options& opt)
+{
+    Matrix4x4f to_world = cam.get_to_world();
+    std::vector<int> result(opt.width * opt.height);
+    TileRenderer renderer(bvh, pool, opt.width, opt.height);
+
+    printf("  %-10s %10s %10s %10s %10s %10s\n",
+            "order", "trace ms", "tiles ms", "L1 hit %", "L2 hit %", "mem/ray");
+
+    for (int type = 0; type < PixelOrder::ORDER_COUNT; type++)
+    {
+        PixelOrder order((PixelOrder::Type)type, opt.width, opt.height);
+        OrderJob job(bvh, &order, to_world, &result[0]);
+        Samples trace_ms, tiles_ms;
+
+        renderer.set_tile_order((PixelOrder::Type)type);
+
+        for (int i = 0; i < opt.warmup + opt.repetitions; i++)
+        {
+            pool->run(&job, (order.get_count() + RAYS_PER_TASK - 1) / RAYS_PER_TASK);
+            if (i >= opt.warmup)
+                trace_ms.add(pool->get_run_time() * 1000.0);
+
+            renderer.render(to_world);
+            if (i >= opt.warmup)
+                tiles_ms.add(renderer.get_trace_time() * 1000.0);
+        }
+
+        CacheModel cache;
+        for (int i = 0; i < order.get_count(); i++)
+        {
+            Vector2i c = order.get_coord(i);
+            Vector3f o, d;
+            get_primary(to_world, c.x, c.y, opt.width, opt.height, o, d);
+
+            float t, u, v;
+            bvh->intersect(o, d, t, u, v, &cache);
+        }
+
+        printf("  %-10s %10.2f %10.2f %10.2f %10.2f %10.3f\n",
+                PixelOrder::get_name((PixelOrder::Type)type), trace_ms.median(), tiles_ms.median(),
+                cache.l1.get_hit_rate() * 100.0, cache.l2.get_hit_rate() * 100.0,
+                cache.l2.get_misses() / (double)order.get_count());
+    }
+}
+
+static void run_scene(WorkerPool* pool, TlbCounter* tlb, const char* scene_file, const char* camera_file,
+        const Options& opt, std::vector<Result>& results)
+{
+    std::vector<Camera> cameras = Camera::load_all(camera_file);
+
+    Timer timer;
+    Scene scene(scene_file);
+    double load_time = timer.elapsed();
+
+    HostMemory::reset_counters();
+    timer.start();
+    BVHRT bvhrt(scene.get_mesh());
+    FlatBVH flatbvh(&bvhrt);
+    double build_time = timer.elapsed();
+
+    printf("scene %s: %d triangles, load %.2f ms, build %.2f ms\n", scene_file,
+            scene.get_primitive_count(), load_time * 1000.0, build_time * 1000.0);
+    print_host_memory(HostMemory::get_counters(), build_time);
+
+    for (int c = 0; c < (int)cameras.size(); c++)
+    {
+        printf("camera %s #%d\n", camera_file, c);
+
+        if (opt.orders)
+        {
+            compare_orders(pool, &flatbvh, cameras[c], opt);
+            continue;
+        }
+
+        printf("  %-10s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+                "workload", "rays", "hits", "median", "p10", "p90", "min", "max", "dTLB/ray");
+
+        Workload primary;
+        make_primary(primary, cameras[c], opt.width, opt.height);
+
+        Workload secondary[3];
+        trace(pool, &flatbvh, &primary);
+        make_secondary(scene, primary, opt, secondary[0], secondary[1], secondary[2]);
+
+        Workload* workloads[] = { &primary, &secondary[0], &secondary[1], &secondary[2] };
+
+        for (int i = 0; i < (int)DN_ARRAY_LENGTH(workloads); i++)
+        {
+            results.push_back(Result());
+            Result& res = results.back();
+            res.scene = scene_file;
+            res.camera = camera_file;
+            res.camera_index = c;
+            measure(pool, &flatbvh, *workloads[i], opt, *tlb, res);
+        }
+    }
+}
+
+static void write_json(const char* filename, const Options& opt, int threads,
+        const std::vector<Result>& results)
+{
+    FILE* fp = fopen(filename, "wt");
+    if (!fp)
+        throw std::runtime_error(std::string("can't open ") + filename + " for writing");
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"version\": 1,\n");
+    fprintf(fp, "  \"width\": %d,\n", opt.width);
+    fprintf(fp, "  \"height\": %d,\n", opt.height);
+    fprintf(fp, "  \"threads\": %d,\n", threads);
+    fprintf(fp, "  \"warmup\": %d,\n", opt.warmup);
+    fprintf(fp, "  \"repetitions\": %d,\n", opt.repetitions);
+    fprintf(fp, "  \"ao_samples\": %d,\n", opt.ao_samples);
+    fprintf(fp, "  \"seed\": %u,\n", opt.seed);
+    fprintf(fp, "  \"huge_pages\": \"%s\",\n", HostMemory::get_huge_pages_name(opt.huge_pages));
+    fprintf(fp, "  \"results\": [\n");
+
+    for (int i = 0; i < (int)results.size(); i++)
+    {
+        const Result& r = results[i];
+        fprintf(fp, "    {\"scene\": \"%s\", \"camera\": \"%s\", \"camera_index\": %d, "
+                "\"workload\": \"%s\", \"rays\": %d, \"hits\": %d, \"mrays_per_s\": {"
+                "\"median\": %.4f, \"mean\": %.4f, \"min\": %.4f, \"max\": %.4f, "
+                "\"p10\": %.4f, \"p90\": %.4f}",
+                r.scene.c_str(), r.camera.c_str(), r.camera_index, r.workload.c_str(),
+                r.rays, r.hits, r.mrays.median(), r.mrays.mean(), r.mrays.min(),
+                r.mrays.max(), r.mrays.percentile(10.0), r.mrays.percentile(90.0));
+        if (r.dtlb_misses >= 0.0)
+            fprintf(fp, ", \"dtlb_misses_per_ray\": %.4f", r.dtlb_misses);
+        fprintf(fp, "}%s\n", i + 1 < (int)results.size() ? "," : "");
+    }
+
+    fprintf(fp, "  ]\n}\n");
+
+    if (fclose(fp) != 0)
+        throw std::runtime_error(std::string("can't write ") + filename);
+}
+
+static bool file_exists(const char* filename)
+{
+    return access(filename, R_OK) == 0;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: gpurt-bench [options] [scene.obj camera.txt]...\n"
+        "  -w width     image width (1024)\n"
+        "  -h height    image height (768)\n"
+        "  -t threads   worker threads (one per core)\n"
+        "  -W count     warmup runs per workload (2)\n"
+        "  -n count     measured runs per workload (10)\n"
+        "  -a count     ambient occlusion rays per hit (4)\n"
+        "  -s seed      random seed for secondary rays (1)\n"
+        "  -j file      write results as JSON\n"
+        "  -o           compare pixel orders instead\n"
+        "  -H mode      huge pages for the BVH: off, transparent or explicit (off)\n"
+        "Without scenes runs the default suite.\n");
+    exit(1);
+}
+
+static int run(int argc, char** argv)
+{
+    Options opt;
+    opt.width = 1024;
+    opt.height = 768;
+    opt.threads = 0;
+    opt.warmup = 2;
+    opt.repetitions = 10;
+    opt.ao_samples = 4;
+    opt.seed = 1;
+    opt.json = 0;
+    opt.orders = false;
+    opt.huge_pages = HostMemory::HUGE_PAGES_OFF;
+
+    int c;
+    while ((c = getopt(argc, argv, "w:h:t:W:n:a:s:j:oH:")) != -1)
+    {
+        switch (c)
+        {
+        case 'w': opt.width = atoi(optarg); break;
+        case 'h': opt.height = atoi(optarg); break;
+        case 't': opt.threads = atoi(optarg); break;
+        case 'W': opt.warmup = atoi(optarg); break;
+        case 'n': opt.repetitions = atoi(optarg); break;
+        case 'a': opt.ao_samples = atoi(optarg); break;
+        case 's': opt.seed = strtoul(optarg, 0, 10); break;
+        case 'j': opt.json = optarg; break;
+        case 'o': opt.orders = true; break;
+        case 'H':
+            if (!HostMemory::parse_huge_pages(optarg, opt.huge_pages))
+                usage();
+            break;
+        default: usage();
+        }
+    }
+
+    if ((argc - optind) % 2 || opt.width <= 0 || opt.height <= 0 || opt.repetitions <= 0 ||
+            (opt.orders && opt.json))
+        usage();
+
+    std::vector<std::pair<const char*, const char*> > suite;
+    for (int i = optind; i < argc; i += 2)
+        suite.push_back(std::make_pair(argv[i], argv[i+1]));
+
+    if (suite.empty())
+    {
+        for (int i = 0; i < (int)DN_ARRAY_LENGTH(default_suite); i++)
+        {
+            if (file_exists(default_suite[i][0]) && file_exists(default_suite[i][1]))
+                suite.push_back(std::make_pair(default_suite[i][0], default_suite[i][1]));
+            else
+                fprintf(stderr, "skipping %s, not found\n", default_suite[i][0]);
+        }
+    }
+
+    HostMemory::set_huge_pages(opt.huge_pages);
+
+    WorkerPool pool(opt.threads);
+    TlbCounter tlb;
+
+    printf("%dx%d, %d threads, %d warmup, %d runs%s, huge pages %s%s\n", opt.width, opt.height,
+            pool.get_thread_count(), opt.warmup, opt.repetitions, opt.orders ? "" : ", Mrays/s",
+            HostMemory::get_huge_pages_name(opt.huge_pages),
+            tlb.is_available() ? "" : ", no TLB counters");
+
+    std::vector<Result> results;
+    for (int i = 0; i < (int)suite.size(); i++)
+        run_scene(&pool, &tlb, suite[i].first, suite[i].second, opt, results);
+
+    if (opt.json)
+        write_json(opt.json, opt, pool.get_thread_count(), results);
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        return run(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+}
@@ -1,14 +1,23 @@
 #include "bvhrt.hpp"
 #include "primitive.hpp"
+#include <stdexcept>
+#include <string>
 #include <stack>
 #include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 using namespace dn;
 
-BVHRT::BVHRT(const Primitive* prims, int n)
+BVHRT::BVHRT(const TriangleMesh& mesh)
+:   mesh(mesh)
 {
     root = 0;
-    build(prims, n);
+    build();
+    limit_depth(root, 0);
     root->check();
 }
 
@@ -17,23 +26,24 @@ BVHRT::~BVHRT()
     delete root;
 }
 
-void BVHRT::build(const Primitive* prims, int n)
+void BVHRT::build()
 {
-    primitives = prims;
-    primitive_count = n;
+    int primitive_count = mesh.get_triangle_count();
 
     aabbs = new AABBf[primitive_count];
     for (int i = 0; i < primitive_count; i++)
-        aabbs[i] = prims[i].get_aabb();
+        aabbs[i] = mesh.get_aabb(i);
+    costs = new float[2 * primitive_count];
 
-    int* indices = new int [primitive_count];
+    // Building sorts ranges of this in place and leaves keep theirs.
+    leaf_primitives.resize(primitive_count);
     for (int i = 0; i < primitive_count; i++)
-        indices[i] = i;
+        leaf_primitives[i] = i;
 
-    root = build(indices, primitive_count);
+    root = build(leaf_primitives.data(), primitive_count);
 
-    delete [] indices;
     delete [] aabbs;
+    delete [] costs;
 }
 
 struct Sorter
@@ -69,8 +79,8 @@ BVHRT::Node* BVHRT::build(int* prims, int n)
         sorter.aabbs = aabbs;
         std::sort(prims, prims+n, sorter);
 
-        float* left_cost = new float [n];
-        float* right_cost = new float [n];
+        float* left_cost = costs;
+        float* right_cost = costs + n;
 
         AABBf left_aabb;
         AABBf right_aabb;
@@ -93,9 +103,6 @@ BVHRT::Node* BVHRT::build(int* prims, int n)
                 min_cost_pos = i;
             }
         }
-
-        delete [] left_cost;
-        delete [] right_cost;
     }
 
     if (min_cost_axis < 0)
@@ -114,6 +121,60 @@ BVHRT::Node* BVHRT::build(int* prims, int n)
     return node;
 }
 
+// Range of leaf_primitives covered by the leaves of node, false if they
+// aren't one range.
+static bool get_range(const BVHRT::Node* node, int& first, int& count)
+{
+    if (node->is_leaf())
+    {
+        first = node->first;
+        count = node->count_primitives;
+        return true;
+    }
+
+    int first0, count0, first1, count1;
+    if (!get_range(node->left, first0, count0) || !get_range(node->right, first1, count1))
+        return false;
+
+    if (first0 + count0 == first1)
+        first = first0;
+    else if (first1 + count1 == first0)
+        first = first1;
+    else
+        return false;
+
+    count = count0 + count1;
+    return true;
+}
+
+// Only degenerate input, e.g. long runs of nearly coincident triangles,
+// builds this deep. Subtrees of build() have their primitives in one
+// range and become a single leaf. Top trees of the out of core build
+// join subtrees of many ranges, but they are shallow; should one reach
+// this deep the build fails rather than overflow traversal stacks.
+void BVHRT::limit_depth(Node* node, int depth)
+{
+    if (node->is_leaf())
+        return;
+
+    if (depth < BVH_MAX_DEPTH)
+    {
+        limit_depth(node->left, depth + 1);
+        limit_depth(node->right, depth + 1);
+        return;
+    }
+
+    int first, count;
+    if (!get_range(node, first, count))
+        throw std::runtime_error("BVH is too deep");
+
+    delete node->left;
+    delete node->right;
+    node->left = node->right = 0;
+    node->first = first;
+    node->count_primitives = count;
+}
+
 BVHRT::Node* BVHRT::build_leaf(int* prims, int n)
 {
     BVHRT::Node* node = new Node();
@@ -123,9 +184,404 @@ BVHRT::Node* BVHRT::build_leaf(int* prims, int n)
 
     node->left = 0;
     node->right = 0;
+    node->first = (int)(prims - leaf_primitives.data());
+    node->count_primitives = n;
+
+    return node;
+}
+
+//
+// Out of core build. Primitives go to the work file as records of id and
+// bounds, bucketed by the cell of their centroid in a grid over the
+// centroid bounds of their parent bucket. A bucket that fits in the
+// budget is read back and built in memory as above with its own bounds
+// array; a bigger one is bucketed again. The trees of the cells of a grid
+// are joined by a top tree built with the same cost over their bounds.
+//
+// Each bucket owns the range of leaf_primitives after those of the cells
+// before it, so leaves point into it as in a normal build.
+//
+
+struct BVHRT::Record
+{
+    int id;
+    AABBf aabb;
+};
+
+// Records of a bucket: primitives first to first + count - 1 of the mesh
+// or records first to first + count - 1 of the work file.
+struct BVHRT::Source
+{
+    bool in_mesh;
+    int64_t first;
+    int count;
+};
+
+struct BVHRT::Subtree
+{
+    Node* root;
+    int count;
+};
+
+// Bounds, id and cost arrays of build(), per primitive.
+#define BUILD_BYTES_PER_PRIMITIVE (sizeof(AABBf) + sizeof(int) + 2 * sizeof(float))
+
+// Cells per axis of a bucket grid.
+#define BUCKET_GRID 8
+
+#define MIN_BUCKET 64
+
+// Records read or written at once.
+#define RECORD_BLOCK 4096
+#define CELL_BUFFER 128
+
+// Append only file of records, unlinked once open.
+class BVHRT::WorkFile
+{
+public:
+    WorkFile(const char* filename)
+    :   filename(filename), size(0)
+    {
+        fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+            throw std::runtime_error(std::string("can't create ") + filename + ": " + strerror(errno));
+        ::unlink(filename);
+    }
+
+    ~WorkFile()
+    {
+        close(fd);
+    }
+
+    // Reserves room for count records, returns the index of the first.
+    int64_t allocate(int count)
+    {
+        int64_t first = size;
+        size += count;
+        return first;
+    }
+
+    void write(int64_t first, const Record* r, int count)
+    {
+        const char* p = (const char*)r;
+        size_t left = count * sizeof(Record);
+        off_t offset = first * sizeof(Record);
+
+        while (left)
+        {
+            ssize_t n = pwrite(fd, p, left, offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                throw std::runtime_error("can't write " + filename + ": " + strerror(errno));
+            p += n;
+            left -= n;
+            offset += n;
+        }
+    }
+
+    void read(int64_t first, Record* r, int count)
+    {
+        char* p = (char*)r;
+        size_t left = count * sizeof(Record);
+        off_t offset = first * sizeof(Record);
+
+        while (left)
+        {
+            ssize_t n = pread(fd, p, left, offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                throw std::runtime_error("can't read " + filename + ": " +
+                        (n < 0 ? strerror(errno) : "file is truncated"));
+            p += n;
+            left -= n;
+            offset += n;
+        }
+    }
+
+private:
+    std::string filename;
+    int fd;
+    int64_t size;   // records
+};
+
+void BVHRT::read_records(const Source& src, int first, int n, Record* out, WorkFile& file) const
+{
+    assert(first >= 0 && first + n <= src.count);
+
+    if (!src.in_mesh)
+    {
+        file.read(src.first + first, out, n);
+        return;
+    }
 
     for (int i = 0; i < n; i++)
-        node->primitives.push_back(prims[i]);
+    {
+        out[i].id = (int)src.first + first + i;
+        out[i].aabb = mesh.get_aabb(out[i].id);
+    }
+}
+
+BVHRT::BVHRT(const TriangleMesh& mesh, const char* work_file, size_t budget)
+:   mesh(mesh)
+{
+    root = 0;
+    aabbs = 0;
+    costs = 0;
+
+    WorkFile file(work_file);
+    leaf_primitives.resize(mesh.get_triangle_count());
+
+    Source src;
+    src.in_mesh = true;
+    src.first = 0;
+    src.count = mesh.get_triangle_count();
+
+    AABBf centroids;
+    for (int i = 0; i < src.count; i++)
+    {
+        AABBf aabb = mesh.get_aabb(i);
+        centroids.grow(aabb.min * .5f + aabb.max * .5f);
+    }
+
+    size_t max_prims = std::max(budget / BUILD_BYTES_PER_PRIMITIVE, (size_t)MIN_BUCKET);
+    root = build_bucket(src, centroids, 0, max_prims, file);
+    limit_depth(root, 0);
+    root->check();
+}
+
+// Cell of a centroid along one axis.
+static inline int grid_cell(float c, float min, float scale)
+{
+    return std::min(std::max((int)((c - min) * scale), 0), BUCKET_GRID - 1);
+}
+
+static inline int grid_cell(const AABBf& aabb, const AABBf& centroids, const Vector3f& scale)
+{
+    Vector3f c = aabb.min * .5f + aabb.max * .5f;
+    return
+        grid_cell(c.x, centroids.min.x, scale.x) +
+        grid_cell(c.y, centroids.min.y, scale.y) * BUCKET_GRID +
+        grid_cell(c.z, centroids.min.z, scale.z) * BUCKET_GRID * BUCKET_GRID;
+}
+
+BVHRT::Node* BVHRT::build_bucket(const Source& src, const AABBf& centroids, int leaf_offset,
+        size_t max_prims, WorkFile& file)
+{
+    int n = src.count;
+    std::vector<Record> block(std::min(n, RECORD_BLOCK));
+
+    if ((size_t)n <= max_prims)
+    {
+        std::vector<int> ids(n);
+        aabbs = new AABBf[n];
+        costs = new float[2 * n];
+        for (int first = 0; first < n; first += RECORD_BLOCK)
+        {
+            int count = std::min(n - first, RECORD_BLOCK);
+            read_records(src, first, count, block.data(), file);
+            for (int i = 0; i < count; i++)
+            {
+                ids[first + i] = block[i].id;
+                aabbs[first + i] = block[i].aabb;
+            }
+        }
+
+        // Build on local indices, then map them to primitive ids.
+        int* prims = leaf_primitives.data() + leaf_offset;
+        for (int i = 0; i < n; i++)
+            prims[i] = i;
+
+        Node* node = build(prims, n);
+
+        for (int i = 0; i < n; i++)
+            prims[i] = ids[prims[i]];
+
+        delete [] aabbs;
+        delete [] costs;
+        aabbs = 0;
+        costs = 0;
+        return node;
+    }
+
+    // Axes without extent, or too little for the scale to be finite,
+    // have a single cell.
+    const int cells = BUCKET_GRID * BUCKET_GRID * BUCKET_GRID;
+    Vector3f scale;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float extent = centroids.max[axis] - centroids.min[axis];
+        float s = extent > 0.f ? BUCKET_GRID / extent : 0.f;
+        scale[axis] = s < FLT_MAX ? s : 0.f;
+    }
+
+    // Counts and centroid bounds of the cells.
+    std::vector<int> counts(cells, 0);
+    std::vector<AABBf> cell_centroids(cells);
+
+    for (int first = 0; first < n; first += RECORD_BLOCK)
+    {
+        int count = std::min(n - first, RECORD_BLOCK);
+        read_records(src, first, count, block.data(), file);
+        for (int i = 0; i < count; i++)
+        {
+            int cell = grid_cell(block[i].aabb, centroids, scale);
+            counts[cell]++;
+            cell_centroids[cell].grow(block[i].aabb.min * .5f + block[i].aabb.max * .5f);
+        }
+    }
+
+    std::vector<Subtree> subtrees;
+
+    if (*std::max_element(counts.begin(), counts.end()) == n)
+    {
+        // All centroids are in one spot. The bucket is cut into pieces in
+        // its own order, which need no copy.
+        for (int first = 0; first < n; first += (int)max_prims)
+        {
+            Source piece = src;
+            piece.first += first;
+            piece.count = std::min(n - first, (int)max_prims);
+
+            Subtree t;
+            t.root = build_bucket(piece, centroids, leaf_offset + first, max_prims, file);
+            t.count = piece.count;
+            subtrees.push_back(t);
+        }
+
+        return build_top(subtrees.data(), (int)subtrees.size());
+    }
+
+    // Cells go to the work file one after another. Records are buffered
+    // per cell and written when a buffer fills.
+    std::vector<int64_t> cell_first(cells);
+    std::vector<int> written(cells, 0);
+    for (int i = 0; i < cells; i++)
+        cell_first[i] = counts[i] ? file.allocate(counts[i]) : 0;
+
+    std::vector<Record> buffers((size_t)cells * CELL_BUFFER);
+    std::vector<int> buffered(cells, 0);
+
+    for (int first = 0; first < n; first += RECORD_BLOCK)
+    {
+        int count = std::min(n - first, RECORD_BLOCK);
+        read_records(src, first, count, block.data(), file);
+        for (int i = 0; i < count; i++)
+        {
+            int cell = grid_cell(block[i].aabb, centroids, scale);
+            Record* buf = &buffers[(size_t)cell * CELL_BUFFER];
+            buf[buffered[cell]++] = block[i];
+            if (buffered[cell] == CELL_BUFFER)
+            {
+                file.write(cell_first[cell] + written[cell], buf, CELL_BUFFER);
+                written[cell] += CELL_BUFFER;
+                buffered[cell] = 0;
+            }
+        }
+    }
+
+    for (int i = 0; i < cells; i++)
+        if (buffered[i])
+            file.write(cell_first[i] + written[i], &buffers[(size_t)i * CELL_BUFFER], buffered[i]);
+
+    // Free what the cells don't need before building them.
+    std::vector<Record>().swap(block);
+    std::vector<Record>().swap(buffers);
+
+    for (int i = 0; i < cells; i++)
+    {
+        if (!counts[i])
+            continue;
+
+        Source cell;
+        cell.in_mesh = false;
+        cell.first = cell_first[i];
+        cell.count = counts[i];
+
+        Subtree t;
+        t.root = build_bucket(cell, cell_centroids[i], leaf_offset, max_prims, file);
+        t.count = counts[i];
+        subtrees.push_back(t);
+
+        leaf_offset += counts[i];
+    }
+
+    return build_top(subtrees.data(), (int)subtrees.size());
+}
+
+struct BVHRT::SubtreeSorter
+{
+    int axis;
+
+    bool operator()(const Subtree& a, const Subtree& b) const
+    {
+        return a.root->aabb.min[axis] * .5f + a.root->aabb.max[axis] * .5f <
+               b.root->aabb.min[axis] * .5f + b.root->aabb.max[axis] * .5f;
+    }
+};
+
+//
+// Top tree over subtrees, with the cost of build() taking each subtree as
+// a primitive as many times as it has primitives. Subtrees are never
+// merged into a leaf, so this always splits.
+//
+
+BVHRT::Node* BVHRT::build_top(Subtree* subtrees, int n)
+{
+    assert(n > 0);
+    if (n == 1)
+        return subtrees[0].root;
+
+    float min_cost = FLT_MAX;
+    int min_cost_axis = 0;
+    int min_cost_pos = 1;
+
+    std::vector<float> left_cost(n);
+    std::vector<float> right_cost(n);
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        SubtreeSorter sorter;
+        sorter.axis = axis;
+        std::sort(subtrees, subtrees + n, sorter);
+
+        AABBf left_aabb;
+        AABBf right_aabb;
+        int left_count = 0;
+        int right_count = 0;
+
+        for (int i = 0; i < n; i++)
+        {
+            left_aabb.grow(subtrees[i].root->aabb);
+            left_count += subtrees[i].count;
+            left_cost[i] = left_aabb.get_surface_area() * left_count;
+
+            right_aabb.grow(subtrees[n-i-1].root->aabb);
+            right_count += subtrees[n-i-1].count;
+            right_cost[n-i-1] = right_aabb.get_surface_area() * right_count;
+        }
+
+        for (int i = 1; i < n; i++)
+        {
+            if (left_cost[i-1] + right_cost[i] < min_cost)
+            {
+                min_cost = left_cost[i-1] + right_cost[i];
+                min_cost_axis = axis;
+                min_cost_pos = i;
+            }
+        }
+    }
+
+    SubtreeSorter sorter;
+    sorter.axis = min_cost_axis;
+    std::sort(subtrees, subtrees + n, sorter);
+
+    Node* node = new Node();
+    node->left = build_top(subtrees, min_cost_pos);
+    node->right = build_top(subtrees + min_cost_pos, n - min_cost_pos);
+    node->aabb = node->left->aabb;
+    node->aabb.grow(node->right->aabb);
 
     return node;
 }
@@ -174,16 +630,17 @@ int BVHRT::intersect(const Vector3f& o, const Vector3f& d, float& t, float& u, f
         if (node->right)
             st.push(node->right);
 
-        for (int i = 0; i < (int)node->primitives.size(); i++)
+        for (int i = 0; i < node->count_primitives; i++)
         {
-            const Primitive& prim = primitives[node->primitives[i]];
+            int id = get_node_primitive(node, i);
+            Primitive prim = mesh.get_primitive(id);
             float tt, uu, vv;
             if (prim.intersect(o, d, tt, uu, vv) && (ni == -1 || tt < t))
             {
                 t = tt;
                 u = uu;
                 v = vv;
-                ni = node->primitives[i];
+                ni = id;
             }
         }
     }
@@ -203,7 +660,7 @@ BVHRT::Intersection BVHRT::intersect(const Vector3f& o, const Vector3f& d)
 void BVHRT::Node::check() const
 {
     assert((left == 0) == (right == 0));
-    assert((!left && !right) || primitives.empty());
+    assert((!left && !right) || count_primitives == 0);
 
     if (left)
         left->check();
@@ -234,7 +691,7 @@ int BVHRT::Node::count_inners() const
 
 int BVHRT::Node::primitive_max() const
 {
-    return std::max((int)primitives.size(),
+    return std::max(count_primitives,
                std::max(left ? left->primitive_max() : 0,
                         right ? right->primitive_max() : 0));
 }
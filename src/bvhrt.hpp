@@ -4,8 +4,13 @@
 #include "dndefs.hpp"
 #include "aabb.hpp"
 #include "primitive.hpp"
+#include "trianglemesh.hpp"
 #include <vector>
 
+// Most levels of inner nodes above a leaf. Traversal stacks of the flat
+// BVH and the CUDA kernel have this many entries.
+#define BVH_MAX_DEPTH 64
+
 namespace dn
 {
     class BVHRT
@@ -14,7 +19,7 @@ namespace dn
         class Node
         {
         public:
-            Node() { left = right = 0; }
+            Node() { left = right = 0; first = count_primitives = 0; }
             ~Node() { delete left; delete right; }
             bool is_leaf() const { assert((left == 0) == (right == 0)); return left == 0; }
             void check() const;
@@ -25,7 +30,12 @@ namespace dn
             double calculate_sah_cost() const;
 
             AABBf aabb;
-            std::vector<int> primitives;
+
+            // Primitives of a leaf are get_node_primitive(node, 0) to
+            // get_node_primitive(node, count_primitives - 1).
+            int first;
+            int count_primitives;
+
             Node* left;
             Node* right;
         };
@@ -43,7 +53,16 @@ namespace dn
             float get_v() const { return v; }
         };
 
-        BVHRT(const Primitive* prims, int n);
+        // Refers to the mesh, which must outlive the tree. Subtrees below
+        // BVH_MAX_DEPTH are made leaves.
+        BVHRT(const TriangleMesh& mesh);
+
+        // Builds out of core, for meshes whose build data doesn't fit in
+        // memory. The mesh is read once and its primitives are written to
+        // work_file in spatial buckets small enough to be built in budget
+        // bytes, then the bucket trees are joined by a top tree. Only the
+        // finished tree stays in memory. The file is removed when done.
+        BVHRT(const TriangleMesh& mesh, const char* work_file, size_t budget);
         ~BVHRT();
 
         int intersect(const Vector3f& o, const Vector3f& d, float& t, float& u, float& v);
@@ -51,8 +70,15 @@ namespace dn
         Intersection intersect(const Vector3f& o, const Vector3f& d);
 
         Node* get_root() { return root; }
-        int get_primitive_count() { return primitive_count; }
-        const Primitive& get_primitive(int i) const { return primitives[i]; }
+        int get_primitive_count() const { return mesh.get_triangle_count(); }
+        Primitive get_primitive(int i) const { return mesh.get_primitive(i); }
+        const TriangleMesh& get_mesh() const { return mesh; }
+
+        int get_node_primitive(const Node* node, int i) const
+        {
+            assert(i >= 0 && i < node->count_primitives);
+            return leaf_primitives[node->first + i];
+        }
 
         int get_node_count() const { return root->count(); }
         int get_leaf_count() const { return root->count_leaves(); }
@@ -60,15 +86,35 @@ namespace dn
         int get_primitive_max() const { return root->primitive_max(); }
 
     private:
-        void build(const Primitive* prims, int n);
+        struct Record;
+        struct Source;
+        struct Subtree;
+        struct SubtreeSorter;
+        class WorkFile;
+
+        void build();
         Node* build(int* prims, int n);
         Node* build_leaf(int* prims, int n);
 
-        int primitive_count;
-        const Primitive* primitives;
+        void read_records(const Source& src, int first, int n, Record* out, WorkFile& file) const;
+        Node* build_bucket(const Source& src, const AABBf& centroids, int leaf_offset,
+                size_t max_prims, WorkFile& file);
+        Node* build_top(Subtree* subtrees, int n);
+
+        void limit_depth(Node* node, int depth);
+
+        TriangleMesh mesh;
         Node* root;
 
+        // Primitives of all leaves, each leaf is a range of it.
+        std::vector<int> leaf_primitives;
+
         AABBf* aabbs;
+
+        // Left and right split costs of build(), two per primitive. Nodes
+        // are done with them before building their children, so one array
+        // serves the whole build.
+        float* costs;
     };
 }
 
@@ -0,0 +1,121 @@
+#include "camera.hpp"
+#include <stdexcept>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+
+using namespace dn;
+
+static bool read_camera(FILE* fp, Camera& cam)
+{
+    for (int i = 0; i < 16; i++)
+        if (fscanf(fp, "%f", &cam.cam_to_view.data()[i]) != 1)
+            return false;
+    for (int i = 0; i < 16; i++)
+        if (fscanf(fp, "%f", &cam.cam_to_clip.data()[i]) != 1)
+            return false;
+    return true;
+}
+
+void Camera::load(const char* filename)
+{
+    FILE* fp = fopen(filename, "rt");
+    if (!fp)
+        throw std::runtime_error(std::string("can't open: ") + filename);
+    bool ok = read_camera(fp, *this);
+    fclose(fp);
+    if (!ok)
+        throw std::runtime_error(std::string("bad camera file: ") + filename);
+}
+
+void Camera::save(const char* filename) const
+{
+    FILE* fp = fopen(filename, "wt");
+    if (!fp)
+        throw std::runtime_error(std::string("can't open ") + filename + " for writing");
+    for (int i = 0; i < 16; i++)
+        fprintf(fp, "%f ", cam_to_view.data()[i]);
+    for (int i = 0; i < 16; i++)
+        fprintf(fp, "%f ", cam_to_clip.data()[i]);
+    fclose(fp);
+}
+
+std::vector<Camera> Camera::load_all(const char* filename)
+{
+    FILE* fp = fopen(filename, "rt");
+    if (!fp)
+        throw std::runtime_error(std::string("can't open: ") + filename);
+
+    std::vector<Camera> cams;
+    Camera cam;
+    while (read_camera(fp, cam))
+        cams.push_back(cam);
+    fclose(fp);
+
+    if (cams.empty())
+        throw std::runtime_error(std::string("bad camera file: ") + filename);
+
+    return cams;
+}
+
+#define PATH_HEADER "camera-path"
+#define PATH_VERSION 1
+
+void CameraPath::add(double time, const Camera& camera)
+{
+    Key key;
+    key.time = time;
+    key.camera = camera;
+    keys.push_back(key);
+}
+
+void CameraPath::load(const char* filename)
+{
+    FILE* fp = fopen(filename, "rt");
+    if (!fp)
+        throw std::runtime_error(std::string("can't open: ") + filename);
+
+    char header[32];
+    int version;
+    if (fscanf(fp, "%31s %d", header, &version) != 2 || strcmp(header, PATH_HEADER) ||
+            version != PATH_VERSION)
+    {
+        fclose(fp);
+        throw std::runtime_error(std::string("not a camera path: ") + filename);
+    }
+
+    keys.clear();
+    Key key;
+    while (fscanf(fp, "%lf", &key.time) == 1)
+    {
+        if (!read_camera(fp, key.camera))
+        {
+            fclose(fp);
+            throw std::runtime_error(std::string("bad camera path: ") + filename);
+        }
+        keys.push_back(key);
+    }
+    fclose(fp);
+}
+
+void CameraPath::save(const char* filename) const
+{
+    FILE* fp = fopen(filename, "wt");
+    if (!fp)
+        throw std::runtime_error(std::string("can't open ") + filename + " for writing");
+
+    fprintf(fp, "%s %d\n", PATH_HEADER, PATH_VERSION);
+    for (int i = 0; i < (int)keys.size(); i++)
+    {
+        const Camera& cam = keys[i].camera;
+        fprintf(fp, "%.6f", keys[i].time);
+        for (int j = 0; j < 16; j++)
+            fprintf(fp, " %.9g", cam.cam_to_view.data()[j]);
+        for (int j = 0; j < 16; j++)
+            fprintf(fp, " %.9g", cam.cam_to_clip.data()[j]);
+        fprintf(fp, "\n");
+    }
+
+    if (fclose(fp) != 0)
+        throw std::runtime_error(std::string("can't write ") + filename);
+}
@@ -0,0 +1,58 @@
+#ifndef _dn_camera_hpp_
+#define _dn_camera_hpp_
+
+#include "dndefs.hpp"
+#include "matrix4x4.hpp"
+#include <vector>
+
+namespace dn
+{
+    // Camera as saved in camera.txt: 16 floats of cam_to_view followed by
+    // 16 floats of cam_to_clip. A file may hold several cameras.
+    struct Camera
+    {
+        Matrix4x4f cam_to_view;
+        Matrix4x4f cam_to_clip;
+
+        Matrix4x4f get_to_world() const
+        {
+            return invert(cam_to_clip * cam_to_view);
+        }
+
+        void load(const char* filename);
+        void save(const char* filename) const;
+
+        static std::vector<Camera> load_all(const char* filename);
+    };
+
+    // Cameras of consecutive frames with the time each was shown, in
+    // seconds from the first one. Saved as text: a "camera-path 1" line,
+    // then a line per frame with the time and the 32 floats of the camera
+    // as in camera.txt, written exactly.
+    class CameraPath
+    {
+    public:
+        struct Key
+        {
+            double time;
+            Camera camera;
+        };
+
+        void clear() { keys.clear(); }
+        void add(double time, const Camera& camera);
+
+        int size() const { return (int)keys.size(); }
+        bool empty() const { return keys.empty(); }
+        const Key& operator[](int i) const { return keys[i]; }
+
+        double get_duration() const { return keys.empty() ? 0.0 : keys.back().time; }
+
+        void load(const char* filename);
+        void save(const char* filename) const;
+
+    private:
+        std::vector<Key> keys;
+    };
+}
+
+#endif
@@ -0,0 +1,157 @@
+//
+// Scene compiler. Loads an .obj file, triangulates it and writes the
+// result as a compiled scene that the other programs load without
+// parsing. Afterwards the compiled scene is loaded back, compared with
+// the original and the load times of both are reported.
+//
+// With -i it checks compiled scenes instead and prints what is in them.
+//
+
+#include "scene.hpp"
+#include "stats.hpp"
+#include "timer.hpp"
+#include <stdexcept>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace dn;
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: gpurt-convert [options] scene.obj out.scene\n"
+        "       gpurt-convert -i file.scene...\n"
+        "  -n runs      measured loads of each file (5)\n"
+        "  -i           check compiled scenes and print their contents\n");
+    exit(1);
+}
+
+// Median time to load filename, the first load is not measured so that
+// the file is in the page cache.
+static double measure(const char* filename, int runs)
+{
+    Samples times;
+    for (int i = 0; i <= runs; i++)
+    {
+        Timer timer;
+        Scene scene(filename);
+        if (i > 0)
+            times.add(timer.elapsed());
+    }
+    return times.median();
+}
+
+// Differences between two scenes, 0 if the same.
+static int compare(const Scene& a, const Scene& b)
+{
+    const TriangleMesh& ma = a.get_mesh();
+    const TriangleMesh& mb = b.get_mesh();
+
+    if (ma.get_vertex_count() != mb.get_vertex_count() ||
+            ma.get_triangle_count() != mb.get_triangle_count() ||
+            a.get_materials().size() != b.get_materials().size())
+        return 1;
+
+    int n = memcmp(ma.get_vertices(), mb.get_vertices(), ma.get_vertex_count() * sizeof(Vector3f)) != 0;
+    for (int i = 0; i < ma.get_triangle_count(); i++)
+    {
+        for (int k = 0; k < 3; k++)
+            n += ma.get_index(i, k) != mb.get_index(i, k);
+        n += a.get_primitive_material(i) != b.get_primitive_material(i);
+    }
+
+    for (size_t i = 0; i < a.get_materials().size(); i++)
+        n += a.get_materials()[i].name != b.get_materials()[i].name;
+
+    return n;
+}
+
+static void print_info(const char* filename, const Scene& scene)
+{
+    const AABBf& aabb = scene.get_aabb();
+    printf("%s: %d triangles, %d vertices, %d materials, bounds (%g %g %g) - (%g %g %g)\n", filename,
+            scene.get_primitive_count(), scene.get_mesh().get_vertex_count(), (int)scene.get_materials().size(),
+            aabb.min.x, aabb.min.y, aabb.min.z, aabb.max.x, aabb.max.y, aabb.max.z);
+}
+
+static int run(int argc, char** argv)
+{
+    int runs = 5;
+    bool info = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:i")) != -1)
+    {
+        switch (c)
+        {
+        case 'n': runs = atoi(optarg); break;
+        case 'i': info = true; break;
+        default: usage();
+        }
+    }
+
+    if (runs <= 0)
+        usage();
+
+    if (info)
+    {
+        if (optind == argc)
+            usage();
+
+        for (int i = optind; i < argc; i++)
+        {
+            if (!Scene::is_compiled(argv[i]))
+                throw std::runtime_error(std::string(argv[i]) + " is not a compiled scene");
+
+            // Checksums are checked on load.
+            Scene scene(argv[i]);
+            print_info(argv[i], scene);
+            printf("  load %.2f ms\n", measure(argv[i], runs) * 1000.0);
+        }
+        return 0;
+    }
+
+    if (argc - optind != 2)
+        usage();
+
+    const char* input = argv[optind];
+    const char* output = argv[optind + 1];
+
+    Timer timer;
+    Scene scene(input);
+    double t_load = timer.elapsed();
+    print_info(input, scene);
+
+    timer.start();
+    scene.save(output);
+    double t_save = timer.elapsed();
+
+    Scene compiled(output);
+    if (compare(scene, compiled))
+        throw std::runtime_error(std::string(output) + " differs from " + input);
+
+    double t_input = measure(input, runs);
+    double t_output = measure(output, runs);
+
+    printf("  wrote %s in %.2f ms (first load %.2f ms)\n", output, t_save * 1000.0, t_load * 1000.0);
+    printf("  load %-8s %10.2f ms\n", scene.is_compiled() ? "compiled" : "source", t_input * 1000.0);
+    printf("  load %-8s %10.2f ms  %.1fx\n", "compiled", t_output * 1000.0, t_input / t_output);
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        return run(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+}
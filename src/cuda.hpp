@@ -40,8 +40,8 @@ namespace dn
         void read(HostMemory* m);
         void write(HostMemory* m);
 
-        template<typename T>
-        void fill(const std::vector<T>& v)
+        template<typename T, class A>
+        void fill(const std::vector<T, A>& v)
         {
             assert((sizeof(T) % 4) == 0); // TODO: better assert
             resize(v.size() * sizeof(T));
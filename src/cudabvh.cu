@@ -6,7 +6,18 @@
 #  define BLOCK_HEIGHT 2
 #endif
 
+// Shading modes, same values as Shader::Mode.
+#define SHADE_NORMAL 0
+#define SHADE_DEPTH 1
+#define SHADE_BARYCENTRIC 2
+#define SHADE_ID 3
+
+#define MISS_COLOR 0xFFFF00FF
+
 __constant__ int* result;
+__constant__ float4* hits;      // primitive id bits, t, u, v per pixel
+__constant__ float4* normals;   // unit face normal per primitive
+__constant__ int shade_mode;
 __constant__ int2*   nodes;
 __constant__ float4* aabbs_x;
 __constant__ float4* aabbs_y;
@@ -18,10 +29,13 @@ __constant__ float4 matrix0;
 __constant__ float4 matrix1;
 __constant__ float4 matrix2;
 __constant__ float4 matrix3;
-__constant__ int2* zorder;
 
 __device__ int warp_counter;
 
+// Range of hit distances of the frame as float bits, for depth shading.
+__device__ int depth_min;
+__device__ int depth_max;
+
 texture<int2, 1, cudaReadModeElementType> tex_nodes;
 texture<float4, 1, cudaReadModeElementType> tex_aabbs_x;
 texture<float4, 1, cudaReadModeElementType> tex_aabbs_y;
@@ -49,6 +63,49 @@ __device__ void swap(T& a, T& b)
     b = t;
 }
 
+// Even bits of v packed to the low half.
+__device__ int compact_bits(unsigned int v)
+{
+    v &= 0x55555555;
+    v = (v | (v >> 1)) & 0x33333333;
+    v = (v | (v >> 2)) & 0x0F0F0F0F;
+    v = (v | (v >> 4)) & 0x00FF00FF;
+    v = (v | (v >> 8)) & 0x0000FFFF;
+    return v;
+}
+
+// Pixel i in Z-order, same as PixelOrder::ORDER_MORTON. Quadrants before
+// the one with the pixel are skipped by their count of pixels inside the
+// frame until the cell is entirely inside, the rest of the index is
+// decoded from its bits.
+__device__ int2 morton_pixel(int i)
+{
+    int x0 = 0, y0 = 0;
+    int s = 1;
+    while (s < width || s < height)
+        s *= 2;
+
+    while (x0 + s > width || y0 + s > height)
+    {
+        s >>= 1;
+        for (int q = 0; q < 4; q++)
+        {
+            int qx = x0 + (q & 1) * s;
+            int qy = y0 + (q >> 1) * s;
+            int n = max(0, min(s, width - qx)) * max(0, min(s, height - qy));
+            if (i < n)
+            {
+                x0 = qx;
+                y0 = qy;
+                break;
+            }
+            i -= n;
+        }
+    }
+
+    return make_int2(x0 + compact_bits(i), y0 + compact_bits(i >> 1));
+}
+
 extern "C" __global__ void bvh_trace()
 {
     //int block = (blockIdx.z * gridDim.y + blockIdx.y) * gridDim.x + blockIdx.x;
@@ -90,11 +147,9 @@ extern "C" __global__ void bvh_trace()
         if (thread_idx >= width*height)
             break;
 
-        int ix = zorder[thread_idx].x;
-        int iy = zorder[thread_idx].y;
-
-        int* resp = &result[iy * width + ix];
-        //*resp = 0x80FF80;
+        int2 pixel = morton_pixel(thread_idx);
+        int ix = pixel.x;
+        int iy = pixel.y;
 
 #if 1
         // Calculate view ray.
@@ -126,13 +181,14 @@ extern "C" __global__ void bvh_trace()
 
         // Trace.
 
-        int stack[64];
+        int stack[64];      // BVH_MAX_DEPTH of bvhrt.hpp
         int sp = 0;
         int node_idx = 0;
 
-        stack[63] = (int)resp; // spill result pointer to local stack
-
         float hit_t = 1.f; //CUDART_INF_F;
+        float hit_u = 0.f;
+        float hit_v = 0.f;
+        int hit_tri = -1;
 
         int tri_i = 0, tri_end = 0;
 
@@ -316,12 +372,9 @@ extern "C" __global__ void bvh_trace()
                             if (v >= 0.f && u + v <= 1.f)
                             {
                                 hit_t = t;
-                                //hit_u = u;
-                                //hit_v = v;
-                                int r = t * 1000.f;
-                                int g = t * 1500.f;
-                                int b = t * 200.f;
-                                *(int*)stack[63] = r | g << 8 | b << 16;
+                                hit_u = u;
+                                hit_v = v;
+                                hit_tri = tri_i;
                             }
                         }
                     }
@@ -354,25 +407,9 @@ extern "C" __global__ void bvh_trace()
                             if (t >= 0.0f && t < hit_t)
                             {
                                 hit_t = t;
-                                //hit_u = u;
-                                //hit_v = v;
-
-                                // "shading" is done for each intersection to
-                                // save registers
-
-                                // Refetch to save registers.
-                                v0 = get_vertex(tri_i);
-                                v1 = get_vertex(tri_i+1);
-                                v2 = get_vertex(tri_i+2);
-
-                                float3 n = cross(v1 - v0, v2 - v0);
-                                n = normalize(n);
-
-                                int r = (n.x * 0.5f + 0.5f) * 255.f;
-                                int g = (n.y * 0.5f + 0.5f) * 255.f;
-                                int b = (n.z * 0.5f + 0.5f) * 255.f;
-
-                                *(int*)stack[63] = r | g << 8 | b << 16;
+                                hit_u = u;
+                                hit_v = v;
+                                hit_tri = tri_i;
                             }
                         }
                     }
@@ -381,6 +418,86 @@ extern "C" __global__ void bvh_trace()
                     tri_i += 3;
                 }
         }
+
+        // Write hit, shading is done by bvh_shade. Primitive id is stored
+        // in w of the first vertex.
+
+        int hit_id = hit_tri >= 0 ? __float_as_int(vertices[hit_tri].w) : -1;
+        hits[iy * width + ix] = make_float4(__int_as_float(hit_id), hit_t, hit_u, hit_v);
+
+        if (shade_mode == SHADE_DEPTH && hit_id >= 0)
+        {
+            // Non-negative floats compare like their bit patterns.
+            atomicMin(&depth_min, __float_as_int(hit_t));
+            atomicMax(&depth_max, __float_as_int(hit_t));
+        }
 #endif
     }
 }
+
+__device__ int to_byte(float f)
+{
+    return fminf(fmaxf(f, 0.f), 1.f) * 255.f;
+}
+
+//
+// Turns hits written by bvh_trace into colors, one thread per pixel.
+//
+
+extern "C" __global__ void bvh_shade()
+{
+    int block = blockIdx.y * gridDim.x + blockIdx.x;
+    int i = block * blockDim.x * blockDim.y + threadIdx.y * blockDim.x + threadIdx.x;
+
+    if (i >= width * height)
+        return;
+
+    float4 h = hits[i];
+    int id = __float_as_int(h.x);
+
+    if (id < 0)
+    {
+        result[i] = MISS_COLOR;
+        return;
+    }
+
+    int r, g, b;
+
+    switch (shade_mode)
+    {
+    case SHADE_DEPTH:
+        {
+            float near = __int_as_float(depth_min);
+            float far = __int_as_float(depth_max);
+            r = g = b = to_byte(1.f - (h.y - near) / fmaxf(far - near, 1e-6f));
+        }
+        break;
+
+    case SHADE_BARYCENTRIC:
+        r = to_byte(h.z);
+        g = to_byte(h.w);
+        b = to_byte(1.f - h.z - h.w);
+        break;
+
+    case SHADE_ID:
+        {
+            unsigned int c = (unsigned int)id * 2654435761u;
+            c ^= c >> 15;
+            r = c & 0xFF;
+            g = (c >> 8) & 0xFF;
+            b = (c >> 16) & 0xFF;
+        }
+        break;
+
+    default:
+        {
+            float4 n = normals[id];
+            r = (n.x * 0.5f + 0.5f) * 255.f;
+            g = (n.y * 0.5f + 0.5f) * 255.f;
+            b = (n.z * 0.5f + 0.5f) * 255.f;
+        }
+        break;
+    }
+
+    result[i] = r | g << 8 | b << 16 | 0xFF << 24;
+}
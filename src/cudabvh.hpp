@@ -5,13 +5,14 @@
 #include "matrix4x4.hpp"
 #include "cuda.hpp"
 #include "bvhrt.hpp"
+#include "flatbvh.hpp"
 
 namespace dn
 {
     class CudaBVH
     {
     public:
-        CudaBVH(BVHRT* bvh);
+        CudaBVH(FlatBVH* flat);
         ~CudaBVH();
 
         CudaMemory* get_cuda_nodes() { return &cuda_nodes; }
@@ -24,28 +25,8 @@ namespace dn
     private:
         void update();
 
-        int convert(BVHRT::Node* node, int idx);
-
-        struct CudaNode
-        {
-            int left_idx;
-            int right_idx;
-        };
-
-        struct Vec4x3
-        {
-            Vector4f v[3];
-        };
-
     private:
-        BVHRT*       bvh;
-
-        std::vector<CudaNode> nodes;
-        std::vector<Vector4f> aabbs_x;
-        std::vector<Vector4f> aabbs_y;
-        std::vector<Vector4f> aabbs_z;
-        std::vector<Vector4f> vertices;
-        std::vector<Vec4x3> woop_tris;
+        FlatBVH*     flat;
 
         CudaMemory cuda_nodes;
         CudaMemory cuda_aabbs_x;
@@ -0,0 +1,868 @@
+//
+// Distributed tile renderer. The coordinator splits the frames of the
+// given cameras into tiles and hands them to worker processes over TCP or
+// Unix sockets. Each worker loads the scene and builds the BVH itself,
+// renders tiles with the CPU ray tracer and sends the pixels back. The
+// coordinator reassembles frames and writes them as PPM files.
+//
+// Every worker has a couple of tiles in flight so it never waits for the
+// next one. When no tiles are left, an idle worker takes over the oldest
+// tile another worker has had for much longer than a tile usually takes,
+// so one slow or stalled worker doesn't hold up the last frame. The
+// result that arrives first is used. A run ends when every tile is done,
+// without waiting for copies still out; results carry the run they were
+// sent in and late ones are dropped. Tiles of a worker that disconnects
+// are put back to the queue.
+//
+
+#include "net.hpp"
+#include "scene.hpp"
+#include "bvhrt.hpp"
+#include "flatbvh.hpp"
+#include "camera.hpp"
+#include "image.hpp"
+#include "workerpool.hpp"
+#include "tilerenderer.hpp"
+#include "stats.hpp"
+#include "timer.hpp"
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+using namespace dn;
+
+#define DEFAULT_ADDRESS "unix:/tmp/gpurt-farm.sock"
+
+// Tiles sent to a worker before the first one comes back.
+#define TILES_IN_FLIGHT 2
+
+// A tile is taken over when it has been out this many times longer than
+// the median tile.
+#define STEAL_FACTOR 3.0
+
+enum MessageType
+{
+    MSG_HELLO = 1,      // worker: HelloMessage
+    MSG_SCENE,          // coordinator: SceneMessage followed by scene path
+    MSG_READY,          // worker: ReadyMessage
+    MSG_TILE,           // coordinator: TileMessage
+    MSG_RESULT,         // worker: ResultMessage followed by RGBA pixels
+    MSG_QUIT            // coordinator, no payload
+};
+
+struct HelloMessage
+{
+    int32_t threads;
+    char host[64];
+};
+
+struct SceneMessage
+{
+    int32_t mode;
+    int32_t samples;
+    int32_t area_light;
+};
+
+struct ReadyMessage
+{
+    float load_time;
+    float build_time;
+};
+
+// Pixels [x0, x1) x [y0, y1) of a width x height frame.
+struct TileMessage
+{
+    int32_t run;
+    int32_t tile;
+    int32_t width;
+    int32_t height;
+    int32_t x0, y0, x1, y1;
+    float to_world[16];
+};
+
+struct ResultMessage
+{
+    int32_t run;
+    int32_t tile;
+    float render_time;
+};
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: gpurt-farm [options] scene.obj camera.txt...\n"
+        "       gpurt-farm -W address [-t threads]\n"
+        "  -a address   address to listen on, host:port or unix:path (" DEFAULT_ADDRESS ")\n"
+        "  -j workers   start this many workers on this machine (0)\n"
+        "  -n workers   workers to wait for, including local ones (-j)\n"
+        "  -t threads   threads per worker (local workers share the cores)\n"
+        "  -w width     image width (1024)\n"
+        "  -h height    image height (768)\n"
+        "  -T size      tile size (64)\n"
+        "  -s mode      shading mode: normal, barycentric, id, ao, shadow (normal)\n"
+        "  -N samples   samples per pixel for ao and shadow (4)\n"
+        "  -o prefix    output file prefix, frames are written as <prefix>NNNN.ppm (frame)\n"
+        "  -x           scaling run: render all frames with 1, 2, ... workers\n"
+        "  -W address   run as a worker connecting to the coordinator at address\n");
+    exit(1);
+}
+
+//
+// Worker
+//
+
+// Maps the pixels [x0, x1) x [y0, y1) of the full frame to a whole
+// frame of the tile's size, so a renderer of tile size traces exactly
+// the same rays as the full frame would.
+static Matrix4x4f get_tile_to_world(const Matrix4x4f& to_world, int width, int height,
+        int x0, int y0, int x1, int y1)
+{
+    float sx = (x1 - x0) / (float)width;
+    float sy = (y1 - y0) / (float)height;
+    float ox = (x0 + x1) / (float)width - 1.f;
+    float oy = (y0 + y1) / (float)height - 1.f;
+
+    float m[16] = {
+        sx,  0.f, 0.f, ox,
+        0.f, sy,  0.f, oy,
+        0.f, 0.f, 1.f, 0.f,
+        0.f, 0.f, 0.f, 1.f
+    };
+    return to_world * Matrix4x4f(m);
+}
+
+class Worker
+{
+public:
+    Worker(const char* address, int threads);
+    ~Worker();
+
+    void run();
+
+private:
+    void load(const std::vector<char>& msg);
+    void render(const std::vector<char>& msg);
+
+private:
+    Socket* socket;
+    WorkerPool pool;
+
+    Scene* scene;
+    BVHRT* bvhrt;
+    FlatBVH* flatbvh;
+    SceneMessage settings;
+
+    // Renderers by tile size, edge tiles can be smaller.
+    std::map<std::pair<int, int>, TileRenderer*> renderers;
+};
+
+Worker::Worker(const char* address, int threads)
+:   socket(Socket::connect(address)), pool(threads), scene(0), bvhrt(0), flatbvh(0)
+{
+    HelloMessage hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.threads = pool.get_thread_count();
+    gethostname(hello.host, sizeof(hello.host) - 1);
+    send_message(socket, MSG_HELLO, &hello, sizeof(hello));
+}
+
+Worker::~Worker()
+{
+    for (std::map<std::pair<int, int>, TileRenderer*>::iterator i = renderers.begin(); i != renderers.end(); ++i)
+        delete i->second;
+    delete flatbvh;
+    delete bvhrt;
+    delete scene;
+    delete socket;
+}
+
+void Worker::run()
+{
+    uint32_t type;
+    std::vector<char> msg;
+
+    while (recv_message(socket, type, msg))
+    {
+        switch (type)
+        {
+        case MSG_SCENE: load(msg); break;
+        case MSG_TILE: render(msg); break;
+        case MSG_QUIT: return;
+        default: throw std::runtime_error("unexpected message from coordinator");
+        }
+    }
+}
+
+void Worker::load(const std::vector<char>& msg)
+{
+    if (msg.size() <= sizeof(SceneMessage))
+        throw std::runtime_error("bad scene message");
+
+    memcpy(&settings, &msg[0], sizeof(settings));
+    std::string path(msg.begin() + sizeof(SceneMessage), msg.end());
+
+    Timer timer;
+    scene = new Scene(path.c_str());
+    ReadyMessage ready;
+    ready.load_time = timer.elapsed();
+
+    timer.start();
+    bvhrt = new BVHRT(scene->get_mesh());
+    flatbvh = new FlatBVH(bvhrt);
+    ready.build_time = timer.elapsed();
+
+    send_message(socket, MSG_READY, &ready, sizeof(ready));
+}
+
+void Worker::render(const std::vector<char>& msg)
+{
+    if (msg.size() != sizeof(TileMessage) || !flatbvh)
+        throw std::runtime_error("bad tile message");
+
+    TileMessage tile;
+    memcpy(&tile, &msg[0], sizeof(tile));
+
+    int w = tile.x1 - tile.x0;
+    int h = tile.y1 - tile.y0;
+
+    TileRenderer*& r = renderers[std::make_pair(w, h)];
+    if (!r)
+    {
+        r = new TileRenderer(flatbvh, &pool, w, h);
+        Shader& shader = r->get_shader();
+        shader.set_mode((Shader::Mode)settings.mode);
+        if (settings.samples > 0)
+            shader.set_samples(settings.samples);
+        shader.set_light(shader.get_default_light(settings.area_light != 0));
+    }
+
+    Timer timer;
+    r->render(get_tile_to_world(Matrix4x4f(tile.to_world), tile.width, tile.height,
+                tile.x0, tile.y0, tile.x1, tile.y1));
+
+    ResultMessage result;
+    result.run = tile.run;
+    result.tile = tile.tile;
+    result.render_time = timer.elapsed();
+    send_message(socket, MSG_RESULT, &result, sizeof(result), r->get_buffer(), w * h * 4);
+}
+
+static int run_worker(const char* address, int threads)
+{
+    Worker worker(address, threads);
+    worker.run();
+    return 0;
+}
+
+//
+// Coordinator
+//
+
+struct Options
+{
+    const char* address;
+    int local_workers;
+    int workers;
+    int threads;
+    int width;
+    int height;
+    int tile_size;
+    Shader::Mode mode;
+    int samples;
+    const char* prefix;
+    bool scaling;
+};
+
+struct Tile
+{
+    int frame;
+    int x0, y0, x1, y1;
+    bool done;
+    int issued;         // workers the tile was sent to
+    double issue_time;  // first send
+};
+
+struct Frame
+{
+    std::vector<unsigned char> pixels;
+    int tiles_left;
+};
+
+struct RemoteWorker
+{
+    Socket* socket;
+    std::string name;
+    int threads;
+    bool alive;
+    std::vector<int> in_flight;
+
+    // Counters of the current run.
+    int tiles;
+    int duplicates;
+    double busy_time;
+};
+
+struct RunStats
+{
+    int workers;
+    double time;
+    int tiles;
+    int stolen;
+    int wasted;
+};
+
+class Coordinator
+{
+public:
+    Coordinator(const Options& options, const std::vector<Camera>& cameras);
+    ~Coordinator();
+
+    void add_worker(Socket* s);
+    void load(const char* scene_file);
+    RunStats render(int workers);
+    void quit();
+
+    int get_worker_count() const { return (int)workers.size(); }
+    void print_worker_stats() const;
+
+private:
+    void make_tiles();
+    void send_tile(int worker, int tile);
+    bool steal(int worker);
+    void receive(int worker);
+    void lost(int worker, const char* why);
+    void tile_done(int tile, const unsigned char* pixels);
+
+private:
+    Options options;
+    std::vector<Camera> cameras;
+    std::vector<RemoteWorker> workers;
+
+    std::vector<Tile> tiles;
+    std::vector<Frame> frames;
+    std::deque<int> queue;
+    int tiles_left;
+    int run_id;
+    int active;
+    Samples tile_times;
+    int stolen;
+    int wasted;
+    std::vector<char> msg;
+};
+
+Coordinator::Coordinator(const Options& options, const std::vector<Camera>& cameras)
+:   options(options), cameras(cameras), tiles_left(0), run_id(0), active(0), stolen(0), wasted(0)
+{
+}
+
+Coordinator::~Coordinator()
+{
+    for (int i = 0; i < (int)workers.size(); i++)
+        delete workers[i].socket;
+}
+
+void Coordinator::add_worker(Socket* s)
+{
+    uint32_t type;
+    if (!recv_message(s, type, msg) || type != MSG_HELLO || msg.size() != sizeof(HelloMessage))
+    {
+        delete s;
+        throw std::runtime_error("bad hello from worker");
+    }
+
+    HelloMessage hello;
+    memcpy(&hello, &msg[0], sizeof(hello));
+    hello.host[sizeof(hello.host) - 1] = 0;
+
+    char name[128];
+    snprintf(name, sizeof(name), "%s/%d", hello.host, (int)workers.size());
+
+    RemoteWorker w;
+    w.socket = s;
+    w.name = name;
+    w.threads = hello.threads;
+    w.alive = true;
+    workers.push_back(w);
+
+    fprintf(stderr, "worker %s connected, %d threads\n", name, hello.threads);
+}
+
+void Coordinator::load(const char* scene_file)
+{
+    // Workers may run elsewhere, send a path that doesn't depend on our
+    // working directory.
+    char path[PATH_MAX];
+    if (!realpath(scene_file, path))
+        throw std::runtime_error(std::string("can't find ") + scene_file);
+
+    SceneMessage scene;
+    scene.mode = options.mode;
+    scene.samples = options.samples;
+    scene.area_light = 1;
+
+    for (int i = 0; i < (int)workers.size(); i++)
+        send_message(workers[i].socket, MSG_SCENE, &scene, sizeof(scene), path, strlen(path));
+
+    for (int i = 0; i < (int)workers.size(); i++)
+    {
+        uint32_t type;
+        if (!recv_message(workers[i].socket, type, msg) || type != MSG_READY)
+            throw std::runtime_error("worker " + workers[i].name + " failed to load the scene");
+
+        ReadyMessage ready;
+        memcpy(&ready, &msg[0], sizeof(ready));
+        fprintf(stderr, "worker %s ready: load %.2f ms, build %.2f ms\n", workers[i].name.c_str(),
+                ready.load_time * 1000.0, ready.build_time * 1000.0);
+    }
+}
+
+void Coordinator::make_tiles()
+{
+    int ts = options.tile_size;
+
+    tiles.clear();
+    queue.clear();
+    frames.clear();
+    frames.resize(cameras.size());
+
+    for (int f = 0; f < (int)cameras.size(); f++)
+    {
+        frames[f].tiles_left = 0;
+        for (int y = 0; y < options.height; y += ts)
+            for (int x = 0; x < options.width; x += ts)
+            {
+                Tile t;
+                t.frame = f;
+                t.x0 = x;
+                t.y0 = y;
+                t.x1 = std::min(x + ts, options.width);
+                t.y1 = std::min(y + ts, options.height);
+                t.done = false;
+                t.issued = 0;
+                t.issue_time = 0.0;
+
+                queue.push_back((int)tiles.size());
+                tiles.push_back(t);
+                frames[f].tiles_left++;
+            }
+    }
+
+    tiles_left = (int)tiles.size();
+}
+
+void Coordinator::send_tile(int worker, int tile)
+{
+    Tile& t = tiles[tile];
+    Frame& f = frames[t.frame];
+
+    if (f.pixels.empty())
+        f.pixels.resize(options.width * options.height * 4);
+
+    TileMessage m;
+    m.run = run_id;
+    m.tile = tile;
+    m.width = options.width;
+    m.height = options.height;
+    m.x0 = t.x0;
+    m.y0 = t.y0;
+    m.x1 = t.x1;
+    m.y1 = t.y1;
+    Matrix4x4f to_world = cameras[t.frame].get_to_world();
+    for (int i = 0; i < 16; i++)
+        m.to_world[i] = to_world[i];
+
+    if (!t.issued)
+        t.issue_time = get_time();
+    t.issued++;
+
+    workers[worker].in_flight.push_back(tile);
+    try
+    {
+        send_message(workers[worker].socket, MSG_TILE, &m, sizeof(m));
+    }
+    catch (const std::runtime_error& e)
+    {
+        lost(worker, e.what());
+    }
+}
+
+//
+// Gives an idle worker the unfinished tile that has been out the longest,
+// if it has been out long enough to look stuck.
+//
+
+bool Coordinator::steal(int worker)
+{
+    if (tile_times.empty())
+        return false;
+
+    double now = get_time();
+    double limit = tile_times.median() * STEAL_FACTOR;
+
+    int best = -1;
+    for (int i = 0; i < active; i++)
+    {
+        if (i == worker || !workers[i].alive)
+            continue;
+
+        for (int j = 0; j < (int)workers[i].in_flight.size(); j++)
+        {
+            int tile = workers[i].in_flight[j];
+            const Tile& t = tiles[tile];
+            if (t.done || t.issued > 1 || now - t.issue_time < limit)
+                continue;
+            if (best < 0 || t.issue_time < tiles[best].issue_time)
+                best = tile;
+        }
+    }
+
+    if (best < 0)
+        return false;
+
+    stolen++;
+    send_tile(worker, best);
+    return true;
+}
+
+void Coordinator::tile_done(int tile, const unsigned char* pixels)
+{
+    Tile& t = tiles[tile];
+    Frame& f = frames[t.frame];
+
+    t.done = true;
+    tiles_left--;
+    tile_times.add(get_time() - t.issue_time);
+
+    int w = t.x1 - t.x0;
+    for (int y = t.y0; y < t.y1; y++)
+        memcpy(&f.pixels[(y * options.width + t.x0) * 4], pixels + (y - t.y0) * w * 4, w * 4);
+
+    if (--f.tiles_left == 0)
+    {
+        char filename[1024];
+        snprintf(filename, sizeof(filename), "%s%04d.ppm", options.prefix, t.frame);
+        write_ppm(filename, options.width, options.height, &f.pixels[0]);
+
+        std::vector<unsigned char>().swap(f.pixels);
+    }
+}
+
+void Coordinator::receive(int worker)
+{
+    RemoteWorker& w = workers[worker];
+
+    uint32_t type;
+    try
+    {
+        if (!recv_message(w.socket, type, msg))
+        {
+            lost(worker, "disconnected");
+            return;
+        }
+    }
+    catch (const std::runtime_error& e)
+    {
+        lost(worker, e.what());
+        return;
+    }
+
+    if (type != MSG_RESULT || msg.size() < sizeof(ResultMessage))
+        throw std::runtime_error("unexpected message from worker " + w.name);
+
+    ResultMessage result;
+    memcpy(&result, &msg[0], sizeof(result));
+
+    // Copy of a tile an earlier run finished without it.
+    if (result.run != run_id)
+        return;
+
+    if (result.tile < 0 || result.tile >= (int)tiles.size())
+        throw std::runtime_error("bad tile from worker " + w.name);
+
+    const Tile& t = tiles[result.tile];
+    if (msg.size() != sizeof(result) + (t.x1 - t.x0) * (t.y1 - t.y0) * 4)
+        throw std::runtime_error("bad tile size from worker " + w.name);
+
+    for (int i = 0; i < (int)w.in_flight.size(); i++)
+        if (w.in_flight[i] == result.tile)
+        {
+            w.in_flight.erase(w.in_flight.begin() + i);
+            break;
+        }
+
+    w.busy_time += result.render_time;
+
+    if (t.done)
+    {
+        w.duplicates++;
+        wasted++;
+        return;
+    }
+
+    w.tiles++;
+    tile_done(result.tile, (const unsigned char*)&msg[sizeof(result)]);
+}
+
+void Coordinator::lost(int worker, const char* why)
+{
+    RemoteWorker& w = workers[worker];
+    fprintf(stderr, "worker %s lost (%s), %d tiles requeued\n", w.name.c_str(), why, (int)w.in_flight.size());
+
+    w.alive = false;
+    w.socket->close();
+
+    for (int i = (int)w.in_flight.size() - 1; i >= 0; i--)
+        if (!tiles[w.in_flight[i]].done)
+            queue.push_front(w.in_flight[i]);
+    w.in_flight.clear();
+}
+
+RunStats Coordinator::render(int n)
+{
+    active = n;
+    run_id++;
+    stolen = 0;
+    wasted = 0;
+    tile_times.clear();
+    for (int i = 0; i < (int)workers.size(); i++)
+    {
+        workers[i].tiles = 0;
+        workers[i].duplicates = 0;
+        workers[i].busy_time = 0.0;
+    }
+
+    make_tiles();
+
+    Timer timer;
+    std::vector<pollfd> fds(n);
+
+    while (tiles_left > 0)
+    {
+        int alive = 0;
+        for (int i = 0; i < n; i++)
+        {
+            RemoteWorker& w = workers[i];
+            if (!w.alive)
+                continue;
+            alive++;
+
+            while (w.alive && (int)w.in_flight.size() < TILES_IN_FLIGHT && !queue.empty())
+            {
+                int tile = queue.front();
+                queue.pop_front();
+                if (!tiles[tile].done)
+                    send_tile(i, tile);
+            }
+
+            if (w.alive && w.in_flight.empty())
+                steal(i);
+        }
+
+        if (!alive)
+            throw std::runtime_error("all workers disconnected");
+
+        for (int i = 0; i < n; i++)
+        {
+            fds[i].fd = workers[i].alive ? workers[i].socket->get_fd() : -1;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+
+        // Wake up now and then to look for tiles to steal.
+        int timeout = tile_times.empty() ? 100 : std::max(1, (int)(tile_times.median() * 1000.0));
+        if (poll(&fds[0], n, timeout) < 0 && errno != EINTR)
+            throw std::runtime_error("poll failed");
+
+        for (int i = 0; i < n; i++)
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                receive(i);
+    }
+
+    RunStats s;
+    s.workers = n;
+    s.time = timer.elapsed();
+    s.tiles = (int)tiles.size();
+
+    // Copies of stolen tiles may still be out, possibly on a stalled
+    // worker. They are dropped when they arrive.
+    for (int i = 0; i < n; i++)
+        workers[i].in_flight.clear();
+
+    s.stolen = stolen;
+    s.wasted = wasted;
+
+    return s;
+}
+
+void Coordinator::print_worker_stats() const
+{
+    fprintf(stderr, "%-24s %8s %8s %10s %8s\n", "worker", "threads", "tiles", "busy ms", "dups");
+    for (int i = 0; i < active; i++)
+    {
+        const RemoteWorker& w = workers[i];
+        fprintf(stderr, "%-24s %8d %8d %10.2f %8d\n", w.name.c_str(), w.threads, w.tiles,
+                w.busy_time * 1000.0, w.duplicates);
+    }
+}
+
+void Coordinator::quit()
+{
+    for (int i = 0; i < (int)workers.size(); i++)
+        if (workers[i].alive)
+            send_message(workers[i].socket, MSG_QUIT, 0, 0);
+}
+
+static void print_run(const RunStats& s, const RunStats& base, int pixels)
+{
+    double speedup = base.time / s.time;
+    fprintf(stderr, "%8d %10.2f %10.2f %8.2f %10.2f %8d %8d\n", s.workers, s.time * 1000.0,
+            pixels / s.time * 1e-6, speedup, speedup * base.workers / s.workers, s.stolen, s.wasted);
+}
+
+static int run(int argc, char** argv)
+{
+    Options options;
+    options.address = DEFAULT_ADDRESS;
+    options.local_workers = 0;
+    options.workers = -1;
+    options.threads = 0;
+    options.width = 1024;
+    options.height = 768;
+    options.tile_size = 64;
+    options.mode = Shader::SHADE_NORMAL;
+    options.samples = 0;
+    options.prefix = "frame";
+    options.scaling = false;
+
+    const char* worker_address = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "a:j:n:t:w:h:T:s:N:o:xW:")) != -1)
+    {
+        switch (c)
+        {
+        case 'a': options.address = optarg; break;
+        case 'j': options.local_workers = atoi(optarg); break;
+        case 'n': options.workers = atoi(optarg); break;
+        case 't': options.threads = atoi(optarg); break;
+        case 'w': options.width = atoi(optarg); break;
+        case 'h': options.height = atoi(optarg); break;
+        case 'T': options.tile_size = atoi(optarg); break;
+        case 's':
+            // Depth range is fitted to the hits of the whole frame, which
+            // no worker has.
+            if (!Shader::parse_mode(optarg, options.mode) || options.mode == Shader::SHADE_DEPTH)
+                usage();
+            break;
+        case 'N': options.samples = atoi(optarg); break;
+        case 'o': options.prefix = optarg; break;
+        case 'x': options.scaling = true; break;
+        case 'W': worker_address = optarg; break;
+        default: usage();
+        }
+    }
+
+    if (worker_address)
+        return run_worker(worker_address, options.threads);
+
+    if (options.workers < 0)
+        options.workers = options.local_workers;
+
+    if (argc - optind < 2 || options.width <= 0 || options.height <= 0 || options.tile_size <= 0 ||
+            options.workers <= 0 || options.local_workers > options.workers)
+        usage();
+
+    std::vector<Camera> cameras;
+    for (int i = optind + 1; i < argc; i++)
+    {
+        std::vector<Camera> c = Camera::load_all(argv[i]);
+        cameras.insert(cameras.end(), c.begin(), c.end());
+    }
+
+    Socket* listener = Socket::listen(options.address);
+
+    // Local workers share the cores unless told otherwise.
+    int local_threads = options.threads;
+    if (!local_threads && options.local_workers > 0)
+        local_threads = std::max(1, (int)std::thread::hardware_concurrency() / options.local_workers);
+
+    std::vector<pid_t> children;
+    for (int i = 0; i < options.local_workers; i++)
+    {
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid < 0)
+            throw std::runtime_error("fork failed");
+        if (pid == 0)
+        {
+            listener->close();
+            int status = 0;
+            try
+            {
+                run_worker(options.address, local_threads);
+            }
+            catch (const std::exception& e)
+            {
+                fprintf(stderr, "worker error: %s\n", e.what());
+                status = 1;
+            }
+            _exit(status);
+        }
+        children.push_back(pid);
+    }
+
+    Coordinator coordinator(options, cameras);
+
+    fprintf(stderr, "waiting for %d workers on %s\n", options.workers, options.address);
+    while (coordinator.get_worker_count() < options.workers)
+        coordinator.add_worker(listener->accept());
+    delete listener;
+
+    coordinator.load(argv[optind]);
+
+    int pixels = options.width * options.height * (int)cameras.size();
+
+    fprintf(stderr, "%8s %10s %10s %8s %10s %8s %8s\n",
+            "workers", "time ms", "Mpix/s", "speedup", "efficiency", "stolen", "wasted");
+
+    RunStats base = RunStats();
+    for (int n = options.scaling ? 1 : options.workers; n <= options.workers; n++)
+    {
+        RunStats s = coordinator.render(n);
+        if (n == 1 || !options.scaling)
+            base = s;
+        print_run(s, base, pixels);
+    }
+
+    coordinator.print_worker_stats();
+    coordinator.quit();
+
+    for (int i = 0; i < (int)children.size(); i++)
+        waitpid(children[i], 0, 0);
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        return run(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+}
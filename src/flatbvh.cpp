@@ -0,0 +1,635 @@
+#include "flatbvh.hpp"
+#include "bvhrt.hpp"
+#include "matrix4x4.hpp"
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+
+using namespace dn;
+
+#define STACK_SIZE BVH_MAX_DEPTH
+
+// Threads that can count at the same time. More share slots and may lose
+// counts.
+#define COUNTER_SLOTS 256
+
+static float int_as_float(int i)
+{
+    float f;
+    memcpy(&f, &i, 4);
+    return f;
+}
+
+// Counting slot of the calling thread, the same in every FlatBVH.
+static thread_local int counter_slot = -1;
+static std::atomic<int> next_counter_slot(0);
+
+//
+// Visitors of the counting and recording traversals.
+//
+
+struct FlatBVH::CountVisitor
+{
+    CountVisitor() : nodes(0), leaves(0), triangles(0) {}
+
+    void node(int) { nodes++; }
+    void leaf(int) { leaves++; }
+    void triangle(int) { triangles++; }
+
+    // Slot has a single writer, plain load and store are enough.
+    static void add(std::atomic<uint64_t>& c, uint64_t n)
+    {
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void add_to(CounterSlot& slot) const
+    {
+        add(slot.rays, 1);
+        add(slot.nodes, nodes);
+        add(slot.leaves, leaves);
+        add(slot.triangles, triangles);
+    }
+
+    int nodes;
+    int leaves;
+    int triangles;
+};
+
+struct FlatBVH::AccessVisitor
+{
+    AccessVisitor(const FlatBVH* bvh, AccessRecorder* rec) : bvh(bvh), rec(rec) {}
+
+    void node(int i)
+    {
+        rec->access(&bvh->aabbs_x[i], sizeof(Vector4f));
+        rec->access(&bvh->aabbs_y[i], sizeof(Vector4f));
+        rec->access(&bvh->aabbs_z[i], sizeof(Vector4f));
+        rec->access(&bvh->nodes[i], sizeof(Node));
+    }
+
+    void leaf(int i)
+    {
+        rec->access(&bvh->nodes[i], sizeof(Node));
+    }
+
+    void triangle(int i)
+    {
+        rec->access(&bvh->indices[i], 3 * sizeof(uint32_t));
+        for (int k = 0; k < 3; k++)
+            rec->access(&bvh->mesh.get_vertices()[bvh->indices[i + k]], sizeof(Vector3f));
+    }
+
+    const FlatBVH* bvh;
+    AccessRecorder* rec;
+};
+
+FlatBVH::FlatBVH(BVHRT* bvh)
+:   bvh(bvh), mesh(bvh->get_mesh()), paged(0), counting(false), counter_slots(COUNTER_SLOTS)
+{
+    update();
+    reset_counters();
+}
+
+FlatBVH::~FlatBVH()
+{
+    delete paged;
+}
+
+void FlatBVH::update()
+{
+    BVHRT::Node* root = bvh->get_root();
+    int count = root->count();
+
+    primitive_count = bvh->get_primitive_count();
+    bounds = root->aabb;
+    root_is_leaf = root->is_leaf();
+
+    nodes.resize(count);
+    aabbs_x.resize(count);
+    aabbs_y.resize(count);
+    aabbs_z.resize(count);
+    indices.clear();
+    woop_tris.clear();
+    prim_ids.clear();
+    indices.reserve(bvh->get_primitive_count() * 3);
+    prim_ids.reserve(bvh->get_primitive_count());
+
+    int ret = convert(root, 0);
+    assert(ret == count);
+
+    // Blocks the arrays grew out of won't be needed again.
+    HostMemory::trim();
+}
+
+int FlatBVH::convert(BVHRT::Node* node, int idx)
+{
+    assert(node);
+    assert(idx < (int)nodes.size());
+
+    int ret = idx + 1;
+
+    if (node->left)
+    {
+        // Negative index means leaf.
+        nodes[idx].left_idx = node->left->is_leaf() ? -ret : ret;
+        ret = convert(node->left, ret);
+        nodes[idx].right_idx = node->right->is_leaf() ? -ret : ret;
+        ret = convert(node->right, ret);
+
+        aabbs_x[idx].x = node->left->aabb.min.x;
+        aabbs_x[idx].y = node->left->aabb.max.x;
+        aabbs_x[idx].z = node->right->aabb.min.x;
+        aabbs_x[idx].w = node->right->aabb.max.x;
+
+        aabbs_y[idx].x = node->left->aabb.min.y;
+        aabbs_y[idx].y = node->left->aabb.max.y;
+        aabbs_y[idx].z = node->right->aabb.min.y;
+        aabbs_y[idx].w = node->right->aabb.max.y;
+
+        aabbs_z[idx].x = node->left->aabb.min.z;
+        aabbs_z[idx].y = node->left->aabb.max.z;
+        aabbs_z[idx].z = node->right->aabb.min.z;
+        aabbs_z[idx].w = node->right->aabb.max.z;
+    }
+    else
+    {
+        int n = node->count_primitives;
+
+        nodes[idx].left_idx = (int)indices.size();
+        nodes[idx].right_idx = n * 3;
+
+        for (int i = 0; i < n; i++)
+        {
+            int id = bvh->get_node_primitive(node, i);
+            indices.push_back(mesh.get_index(id, 0));
+            indices.push_back(mesh.get_index(id, 1));
+            indices.push_back(mesh.get_index(id, 2));
+            prim_ids.push_back(id);
+
+#if 0
+            Primitive prim = mesh.get_primitive(id);
+            Matrix4x4f m;
+            m.set_column(0, Vector4f(prim.v0 - prim.v2, 0.f));
+            m.set_column(1, Vector4f(prim.v1 - prim.v2, 0.f));
+            m.set_column(2, Vector4f(cross(prim.v0 - prim.v2, prim.v1 - prim.v2) - prim.v2, 0.f));
+            m.set_column(3, Vector4f(prim.v2, 0.f));
+
+            m = invert(m);
+
+            Vec4x3 v;
+            v.v[0] = Vector4f(m.get(2, 0), m.get(2, 1), m.get(2, 2), -m.get(2, 3));
+            v.v[1] = Vector4f(m.get(0, 0), m.get(0, 1), m.get(0, 2),  m.get(0, 3));
+            v.v[2] = Vector4f(m.get(1, 0), m.get(1, 1), m.get(1, 2),  m.get(1, 3));
+
+            woop_tris.push_back(v);
+#endif
+        }
+    }
+
+    return ret;
+}
+
+void FlatBVH::expand_vertices(std::vector<Vector4f>& out) const
+{
+    if (paged)
+        throw std::runtime_error("leaf geometry is paged out");
+
+    const Vector3f* v = mesh.get_vertices();
+
+    out.resize(indices.size());
+    for (size_t i = 0; i < indices.size(); i += 3)
+    {
+        out[i] = Vector4f(v[indices[i]], int_as_float(prim_ids[i / 3]));
+        out[i+1] = Vector4f(v[indices[i+1]], 1.f);
+        out[i+2] = Vector4f(v[indices[i+2]], 1.f);
+    }
+}
+
+//
+// Leaves are collected depth first, which is the order of their triangles,
+// and cut into pages between leaves. A leaf bigger than a page gets a page
+// of its own.
+//
+
+void FlatBVH::page_out(const char* filename, size_t budget, size_t page_size)
+{
+    assert(!paged);
+
+    PagedGeometry* geometry = new PagedGeometry(filename, budget);
+    const Vector3f* v = mesh.get_vertices();
+    int page_triangles = std::max(1, (int)(page_size / sizeof(PagedGeometry::Triangle)));
+
+    // Leaves in depth first order.
+    std::vector<int> leaves;
+    if (root_is_leaf)
+        leaves.push_back(0);
+    else
+    {
+        std::vector<int> stack(1, 0);
+        while (!stack.empty())
+        {
+            int idx = stack.back();
+            stack.pop_back();
+
+            if (idx < 0)
+                leaves.push_back(-idx);
+            else
+            {
+                stack.push_back(nodes[idx].right_idx);
+                stack.push_back(nodes[idx].left_idx);
+            }
+        }
+    }
+
+    std::vector<int> pages(nodes.size(), -1);
+    std::vector<PagedGeometry::Triangle> page;
+    int page_begin = 0;
+
+    try
+    {
+        for (int l = 0; l <= (int)leaves.size(); l++)
+        {
+            int n = l < (int)leaves.size() ? nodes[leaves[l]].right_idx / 3 : 0;
+
+            if (!page.empty() && (l == (int)leaves.size() || (int)page.size() + n > page_triangles))
+            {
+                int p = geometry->add_page(page.data(), (int)page.size());
+                for (; page_begin < l; page_begin++)
+                    pages[leaves[page_begin]] = p;
+                page.clear();
+            }
+
+            if (l == (int)leaves.size())
+                break;
+
+            const Node& leaf = nodes[leaves[l]];
+            for (int i = leaf.left_idx; i < leaf.left_idx + leaf.right_idx; i += 3)
+            {
+                PagedGeometry::Triangle t;
+                t.v0 = v[indices[i]];
+                t.v1 = v[indices[i+1]];
+                t.v2 = v[indices[i+2]];
+                t.id = prim_ids[i / 3];
+                page.push_back(t);
+            }
+        }
+    }
+    catch (...)
+    {
+        delete geometry;
+        throw;
+    }
+
+    geometry->finish();
+    assert(geometry->get_triangle_count() == (int)prim_ids.size());
+
+    // Triangles are in the file in the order of prim_ids.
+    std::vector<int> triangles(primitive_count);
+    for (int i = 0; i < (int)prim_ids.size(); i++)
+        triangles[prim_ids[i]] = i;
+
+    paged = geometry;
+    leaf_pages.swap(pages);
+    paged_triangles.swap(triangles);
+    HostVector<uint32_t>().swap(indices);
+    HostVector<int>().swap(prim_ids);
+    HostMemory::trim();
+
+    bvh = 0;
+    mesh = TriangleMesh();
+}
+
+void FlatBVH::hold_page(int page, PageRef& ref) const
+{
+    if (page == ref.page)
+        return;
+
+    if (ref.page >= 0)
+        paged->release(ref.page);
+    ref.page = -1;      // holds nothing if acquire throws
+    ref.triangles = paged->acquire(page);
+    ref.page = page;
+}
+
+const PagedGeometry::Triangle* FlatBVH::get_leaf_triangles(int node_idx, PageRef& ref) const
+{
+    int page = leaf_pages[node_idx];
+    hold_page(page, ref);
+    return ref.triangles + (nodes[node_idx].left_idx / 3 - paged->get_page_first(page));
+}
+
+FlatBVH::TriangleReader::~TriangleReader()
+{
+    if (ref.page >= 0)
+        bvh->paged->release(ref.page);
+}
+
+Primitive FlatBVH::TriangleReader::get(int id)
+{
+    assert(id >= 0 && id < bvh->primitive_count);
+
+    if (!bvh->paged)
+        return bvh->mesh.get_primitive(id);
+
+    // Neighbouring pixels mostly hit triangles of the page held.
+    int i = bvh->paged_triangles[id];
+    const PagedGeometry* g = bvh->paged;
+    if (ref.page < 0 || i < g->get_page_first(ref.page) ||
+            i >= g->get_page_first(ref.page) + g->get_page_triangles(ref.page))
+        bvh->hold_page(g->find_page(i), ref);
+
+    const PagedGeometry::Triangle& t = ref.triangles[i - g->get_page_first(ref.page)];
+    return Primitive(Primitive::TRIANGLE, t.v0, t.v1, t.v2);
+}
+
+//
+// Traversal. This follows the CUDA kernel: both children of a node are
+// tested against the ray using the bounds stored in the parent, the
+// nearer one is visited first and the other is pushed on the stack.
+// With any_hit the traversal stops at the first intersection found.
+//
+
+// Moller-Trumbore triangle intersection. True if the triangle is hit
+// nearer than hit_t.
+static inline bool intersect_triangle(const Vector3f& v0, const Vector3f& v1, const Vector3f& v2,
+        const Vector3f& o, const Vector3f& d, float hit_t, float& t, float& u, float& v)
+{
+    Vector3f E1(v1.x - v0.x, v1.y - v0.y, v1.z - v0.z);
+    Vector3f E2(v2.x - v0.x, v2.y - v0.y, v2.z - v0.z);
+    Vector3f T(o.x - v0.x, o.y - v0.y, o.z - v0.z);
+    Vector3f P = cross(d, E2);
+
+    float inv_det = 1.f / dot(E1, P);
+
+    u = dot(T, P) * inv_det;
+    if (u < 0.f || u > 1.f)
+        return false;
+
+    Vector3f Q = cross(T, E1);
+
+    v = dot(d, Q) * inv_det;
+    if (v < 0.f || u + v > 1.f)
+        return false;
+
+    t = dot(E2, Q) * inv_det;
+    return !(t < 0.f || t >= hit_t);
+}
+
+template<bool any_hit, class Visitor>
+bool FlatBVH::intersect_leaf(int node_idx, const Vector3f& o, const Vector3f& d,
+        float& hit_t, float& hit_u, float& hit_v, int& hit, PageRef& ref, Visitor* vis) const
+{
+    const Node& leaf = nodes[node_idx];
+    vis->leaf(node_idx);
+
+    float t, u, v;
+
+    if (paged)
+    {
+        if (!leaf.right_idx)
+            return false;
+
+        const PagedGeometry::Triangle* tris = get_leaf_triangles(node_idx, ref);
+        for (int i = 0; i < leaf.right_idx / 3; i++)
+        {
+            vis->triangle(leaf.left_idx + i * 3);
+            if (!intersect_triangle(tris[i].v0, tris[i].v1, tris[i].v2, o, d, hit_t, t, u, v))
+                continue;
+
+            hit_t = t;
+            hit_u = u;
+            hit_v = v;
+            hit = tris[i].id;
+
+            if (any_hit)
+                return true;
+        }
+
+        return false;
+    }
+
+    const Vector3f* verts = mesh.get_vertices();
+
+    for (int i = leaf.left_idx; i < leaf.left_idx + leaf.right_idx; i += 3)
+    {
+        vis->triangle(i);
+        if (!intersect_triangle(verts[indices[i]], verts[indices[i+1]], verts[indices[i+2]],
+                    o, d, hit_t, t, u, v))
+            continue;
+
+        hit_t = t;
+        hit_u = u;
+        hit_v = v;
+        hit = prim_ids[i / 3];
+
+        if (any_hit)
+            return true;
+    }
+
+    return false;
+}
+
+template<bool any_hit, class Visitor>
+int FlatBVH::trace(const Vector3f& o, const Vector3f& d,
+        float& hit_t, float& hit_u, float& hit_v, Visitor* vis) const
+{
+    int hit = -1;
+    PageRef ref;
+
+    if (root_is_leaf)
+    {
+        intersect_leaf<any_hit>(0, o, d, hit_t, hit_u, hit_v, hit, ref, vis);
+        if (ref.page >= 0)
+            paged->release(ref.page);
+        return hit;
+    }
+
+    Vector3f inv_dir;
+    inv_dir.x = d.x == 0.f ? 1e32f : 1.f / d.x;
+    inv_dir.y = d.y == 0.f ? 1e32f : 1.f / d.y;
+    inv_dir.z = d.z == 0.f ? 1e32f : 1.f / d.z;
+
+    Vector3f orig_inv_dir(-o.x * inv_dir.x, -o.y * inv_dir.y, -o.z * inv_dir.z);
+
+    int stack[STACK_SIZE];
+    int sp = 0;
+    int node_idx = 0;
+
+    for (;;)
+    {
+        if (node_idx < 0)
+        {
+            if (intersect_leaf<any_hit>(-node_idx, o, d, hit_t, hit_u, hit_v, hit, ref, vis))
+                break;
+
+            if (!sp)
+                break;
+            node_idx = stack[--sp];
+            continue;
+        }
+
+        const Vector4f& ax = aabbs_x[node_idx];
+        const Vector4f& ay = aabbs_y[node_idx];
+        const Vector4f& az = aabbs_z[node_idx];
+        vis->node(node_idx);
+
+        float a0 = ax.x * inv_dir.x + orig_inv_dir.x;
+        float a1 = ax.y * inv_dir.x + orig_inv_dir.x;
+        float b0 = ax.z * inv_dir.x + orig_inv_dir.x;
+        float b1 = ax.w * inv_dir.x + orig_inv_dir.x;
+        float tmin0 = std::max(std::min(a0, a1), 0.f);
+        float tmax0 = std::min(std::max(a0, a1), hit_t);
+        float tmin1 = std::max(std::min(b0, b1), 0.f);
+        float tmax1 = std::min(std::max(b0, b1), hit_t);
+
+        a0 = ay.x * inv_dir.y + orig_inv_dir.y;
+        a1 = ay.y * inv_dir.y + orig_inv_dir.y;
+        b0 = ay.z * inv_dir.y + orig_inv_dir.y;
+        b1 = ay.w * inv_dir.y + orig_inv_dir.y;
+        tmin0 = std::max(tmin0, std::min(a0, a1));
+        tmax0 = std::min(tmax0, std::max(a0, a1));
+        tmin1 = std::max(tmin1, std::min(b0, b1));
+        tmax1 = std::min(tmax1, std::max(b0, b1));
+
+        a0 = az.x * inv_dir.z + orig_inv_dir.z;
+        a1 = az.y * inv_dir.z + orig_inv_dir.z;
+        b0 = az.z * inv_dir.z + orig_inv_dir.z;
+        b1 = az.w * inv_dir.z + orig_inv_dir.z;
+        tmin0 = std::max(tmin0, std::min(a0, a1));
+        tmax0 = std::min(tmax0, std::max(a0, a1));
+        tmin1 = std::max(tmin1, std::min(b0, b1));
+        tmax1 = std::min(tmax1, std::max(b0, b1));
+
+        const Node& n = nodes[node_idx];
+
+        bool hit0 = tmin0 <= tmax0;
+        bool hit1 = tmin1 <= tmax1;
+
+        if (hit0 && hit1)
+        {
+            assert(sp < STACK_SIZE);
+            if (tmin1 < tmin0)
+            {
+                stack[sp++] = n.left_idx;
+                node_idx = n.right_idx;
+            }
+            else
+            {
+                stack[sp++] = n.right_idx;
+                node_idx = n.left_idx;
+            }
+        }
+        else if (hit0)
+            node_idx = n.left_idx;
+        else if (hit1)
+            node_idx = n.right_idx;
+        else if (sp)
+            node_idx = stack[--sp];
+        else
+            break;
+    }
+
+    if (ref.page >= 0)
+        paged->release(ref.page);
+
+    return hit;
+}
+
+template<class Visitor>
+int FlatBVH::trace_nearest(const Vector3f& o, const Vector3f& d, float& t, float& u, float& v,
+        Visitor* vis) const
+{
+    float hit_t = boost::numeric::bounds<float>::highest();
+    float hit_u = 0.f, hit_v = 0.f;
+
+    int hit = trace<false>(o, d, hit_t, hit_u, hit_v, vis);
+
+    if (hit >= 0)
+    {
+        t = hit_t;
+        u = hit_u;
+        v = hit_v;
+    }
+
+    return hit;
+}
+
+int FlatBVH::intersect(const Vector3f& o, const Vector3f& d, float& t, float& u, float& v) const
+{
+    if (!counting)
+    {
+        NoVisitor vis;
+        return trace_nearest(o, d, t, u, v, &vis);
+    }
+
+    CountVisitor vis;
+    int hit = trace_nearest(o, d, t, u, v, &vis);
+    vis.add_to(get_counter_slot());
+    return hit;
+}
+
+bool FlatBVH::occluded(const Vector3f& o, const Vector3f& d, float tmax) const
+{
+    float hit_u, hit_v;
+
+    if (!counting)
+    {
+        NoVisitor vis;
+        return trace<true>(o, d, tmax, hit_u, hit_v, &vis) >= 0;
+    }
+
+    CountVisitor vis;
+    bool hit = trace<true>(o, d, tmax, hit_u, hit_v, &vis) >= 0;
+    vis.add_to(get_counter_slot());
+    return hit;
+}
+
+BVHRT::Intersection FlatBVH::intersect(const Vector3f& o, const Vector3f& d) const
+{
+    BVHRT::Intersection is;
+    is.id = intersect(o, d, is.t, is.u, is.v);
+    return is;
+}
+
+int FlatBVH::intersect(const Vector3f& o, const Vector3f& d, float& t, float& u, float& v,
+        AccessRecorder* rec) const
+{
+    // Recording reads the leaf arrays, which paging frees.
+    assert(!paged);
+
+    AccessVisitor vis(this, rec);
+    return trace_nearest(o, d, t, u, v, &vis);
+}
+
+FlatBVH::CounterSlot& FlatBVH::get_counter_slot() const
+{
+    if (counter_slot < 0)
+        counter_slot = next_counter_slot++ % COUNTER_SLOTS;
+    return counter_slots[counter_slot];
+}
+
+FlatBVH::Counters FlatBVH::get_counters() const
+{
+    Counters c;
+    for (int i = 0; i < COUNTER_SLOTS; i++)
+    {
+        const CounterSlot& s = counter_slots[i];
+        c.rays += s.rays.load(std::memory_order_relaxed);
+        c.nodes += s.nodes.load(std::memory_order_relaxed);
+        c.leaves += s.leaves.load(std::memory_order_relaxed);
+        c.triangles += s.triangles.load(std::memory_order_relaxed);
+    }
+    return c;
+}
+
+void FlatBVH::reset_counters()
+{
+    for (int i = 0; i < COUNTER_SLOTS; i++)
+    {
+        CounterSlot& s = counter_slots[i];
+        s.rays.store(0, std::memory_order_relaxed);
+        s.nodes.store(0, std::memory_order_relaxed);
+        s.leaves.store(0, std::memory_order_relaxed);
+        s.triangles.store(0, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,228 @@
+#ifndef _dn_flatbvh_hpp_
+#define _dn_flatbvh_hpp_
+
+#include "dndefs.hpp"
+#include "vector4.hpp"
+#include "bvhrt.hpp"
+#include "pagedgeometry.hpp"
+#include "hostmemory.hpp"
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+
+namespace dn
+{
+    // Pointer-free version of BVHRT tree. Same arrays are traversed on CPU
+    // and uploaded as is for the CUDA kernel.
+    //
+    // Inner node stores child indices and the bounds of both children, so
+    // a single node fetch is enough to decide which children to visit.
+    // Negative child index refers to a leaf. Leaf node stores first vertex
+    // index and number of vertices (three per triangle). Leaf vertices are
+    // indices to the vertices of the mesh, so triangles take 12 bytes and
+    // vertices are shared. For the CUDA kernel they are expanded to float4
+    // with the bits of the primitive id in the w component of the first
+    // vertex of a triangle, so it can report hits without a separate array.
+    // Arrays are HostMemory blocks, on huge pages if those are enabled.
+    //
+    // After page_out() leaf triangles live in a PagedGeometry file.
+    // Traversal acquires the page of each leaf it reaches and
+    // TriangleReader reads triangles of hits. The BVHRT and mesh are no
+    // longer read and can be freed. This is for the CPU traversal only.
+    //
+    // The nodes stay in memory: 60 bytes each with their bounds and page,
+    // plus 4 bytes per triangle to find it in the file by primitive id.
+    // With about one node per triangle this is more than the 40 bytes per
+    // triangle in the file, so the saving is the mesh and the BVHRT.
+    class FlatBVH
+    {
+    public:
+        struct Node
+        {
+            int left_idx;
+            int right_idx;
+        };
+
+        struct Vec4x3
+        {
+            Vector4f v[3];
+        };
+
+        // Work done by traversals.
+        struct Counters
+        {
+            Counters() : rays(0), nodes(0), leaves(0), triangles(0) {}
+
+            uint64_t rays;
+            uint64_t nodes;         // inner nodes visited
+            uint64_t leaves;        // leaves visited
+            uint64_t triangles;     // ray-triangle tests
+        };
+
+        // Receives the memory read by a traversal, e.g. to model caches.
+        class AccessRecorder
+        {
+        public:
+            virtual ~AccessRecorder() {}
+            virtual void access(const void* p, int size) = 0;
+        };
+
+        // Page held by a traversal or reader of paged geometry. It is kept
+        // from one leaf or triangle to the next while they share it.
+        struct PageRef
+        {
+            PageRef() : page(-1), triangles(0) {}
+
+            int page;
+            const PagedGeometry::Triangle* triangles;
+        };
+
+        // Triangles by primitive id, from the mesh or from their pages.
+        // The page of the last one stays acquired until one on another
+        // page is read or the reader goes away. One per thread.
+        class TriangleReader
+        {
+        public:
+            TriangleReader(const FlatBVH* bvh) : bvh(bvh) {}
+            ~TriangleReader();
+
+            Primitive get(int id);
+
+        private:
+            TriangleReader(const TriangleReader&);
+            TriangleReader& operator=(const TriangleReader&);
+
+        private:
+            const FlatBVH* bvh;
+            PageRef ref;
+        };
+
+        FlatBVH(BVHRT* bvh);
+        ~FlatBVH();
+
+        int intersect(const Vector3f& o, const Vector3f& d, float& t, float& u, float& v) const;
+
+        BVHRT::Intersection intersect(const Vector3f& o, const Vector3f& d) const;
+
+        // As above, reporting every node and triangle read to rec.
+        int intersect(const Vector3f& o, const Vector3f& d, float& t, float& u, float& v,
+                AccessRecorder* rec) const;
+
+        // True if anything is hit between o and o + d * tmax.
+        bool occluded(const Vector3f& o, const Vector3f& d, float tmax) const;
+
+        // While counting is on, every traversal from any thread adds to
+        // the counters. Each thread counts in its own slot, so this costs
+        // little, but get_counters() only sees a traversal once it has
+        // finished.
+        void set_counting(bool enable) { counting = enable; }
+        bool get_counting() const { return counting; }
+        Counters get_counters() const;
+        void reset_counters();
+
+        // 0 after page_out().
+        BVHRT* get_bvh() { return bvh; }
+
+        int get_primitive_count() const { return primitive_count; }
+
+        // Bounds of all primitives.
+        const AABBf& get_bounds() const { return bounds; }
+
+        const HostVector<Node>& get_nodes() const { return nodes; }
+        const HostVector<Vector4f>& get_aabbs_x() const { return aabbs_x; }
+        const HostVector<Vector4f>& get_aabbs_y() const { return aabbs_y; }
+        const HostVector<Vector4f>& get_aabbs_z() const { return aabbs_z; }
+        const TriangleMesh& get_mesh() const { return mesh; }
+        const HostVector<uint32_t>& get_indices() const { return indices; }
+        const HostVector<Vec4x3>& get_woop_tris() const { return woop_tris; }
+        const HostVector<int>& get_primitive_ids() const { return prim_ids; }
+
+        // Leaf vertices with primitive ids as described above.
+        void expand_vertices(std::vector<Vector4f>& out) const;
+
+        // Moves leaf triangles to filename in pages of about page_size
+        // bytes, keeping at most budget bytes of them in memory, and frees
+        // the in-memory leaf arrays. Neither the BVHRT nor the mesh are
+        // read after this, get_mesh() is empty.
+        void page_out(const char* filename, size_t budget, size_t page_size = 64 << 10);
+
+        // 0 unless paged out.
+        PagedGeometry* get_paged_geometry() const { return paged; }
+
+    private:
+        void update();
+
+        int convert(BVHRT::Node* node, int idx);
+
+        // Traversal tells its visitor about every inner node, leaf and
+        // triangle it reads. Visitor of the plain traversal compiles to
+        // nothing.
+        struct NoVisitor
+        {
+            void node(int) {}
+            void leaf(int) {}
+            void triangle(int) {}
+        };
+
+        struct CountVisitor;
+        struct AccessVisitor;
+
+        // Makes page the one held by ref.
+        void hold_page(int page, PageRef& ref) const;
+
+        const PagedGeometry::Triangle* get_leaf_triangles(int node_idx, PageRef& ref) const;
+
+        // Counters of one thread, padded so that no two slots share a
+        // cache line.
+        struct CounterSlot
+        {
+            std::atomic<uint64_t> rays;
+            std::atomic<uint64_t> nodes;
+            std::atomic<uint64_t> leaves;
+            std::atomic<uint64_t> triangles;
+            char pad[96];
+        };
+
+        CounterSlot& get_counter_slot() const;
+
+        template<bool any_hit, class Visitor>
+        int trace(const Vector3f& o, const Vector3f& d,
+                float& hit_t, float& hit_u, float& hit_v, Visitor* vis) const;
+
+        template<class Visitor>
+        int trace_nearest(const Vector3f& o, const Vector3f& d, float& t, float& u, float& v,
+                Visitor* vis) const;
+
+        template<bool any_hit, class Visitor>
+        bool intersect_leaf(int node_idx, const Vector3f& o, const Vector3f& d,
+                float& hit_t, float& hit_u, float& hit_v, int& hit, PageRef& ref, Visitor* vis) const;
+
+    private:
+        BVHRT* bvh;
+        TriangleMesh mesh;
+        int primitive_count;
+        AABBf bounds;
+        bool root_is_leaf;
+
+        HostVector<Node> nodes;
+        HostVector<Vector4f> aabbs_x;
+        HostVector<Vector4f> aabbs_y;
+        HostVector<Vector4f> aabbs_z;
+        HostVector<uint32_t> indices;
+        HostVector<Vec4x3> woop_tris;
+
+        // Original primitive index of each triangle in indices.
+        HostVector<int> prim_ids;
+
+        // Page of each leaf, by node index, and index in the file of each
+        // primitive's triangle.
+        PagedGeometry* paged;
+        std::vector<int> leaf_pages;
+        std::vector<int> paged_triangles;
+
+        bool counting;
+        mutable std::vector<CounterSlot> counter_slots;
+    };
+}
+
+#endif
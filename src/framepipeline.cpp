@@ -0,0 +1,351 @@
+#include "framepipeline.hpp"
+#include "timer.hpp"
+#include <string.h>
+#include <stdio.h>
+
+using namespace dn;
+
+FramePipeline::FramePipeline(TileRenderer* renderer, int buffers)
+:   renderer(renderer), ring(0), displayed(-1), running(false), pending(false), pending_time(0.0),
+    has_submitted(false), has_hits(false), reprojection(renderer->get_reprojection()), reprojection_changed(false),
+    shading(renderer->get_shading()), samples(renderer->get_shader().get_samples()),
+    area_light(!renderer->get_shader().get_light().is_point()), shading_changed(false),
+    new_frame(false), pickup_time(0.0), rendered(0), dropped(0), skipped(0), displayed_count(0)
+{
+    buffers = std::max(buffers, 2);
+    frames.resize(buffers);
+
+    for (int i = 0; i < buffers; i++)
+    {
+        frames[i].pixels = new HostMemory(renderer->get_width() * renderer->get_height() * 4);
+        frames[i].state = FREE;
+    }
+
+    max_queued = 1;
+}
+
+FramePipeline::~FramePipeline()
+{
+    stop();
+
+    for (int i = 0; i < (int)frames.size(); i++)
+        delete frames[i].pixels;
+}
+
+void FramePipeline::start()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (running)
+        return;
+    running = true;
+    thread = std::thread(&FramePipeline::thread_main, this);
+}
+
+void FramePipeline::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running)
+            return;
+        running = false;
+    }
+    cond.notify_all();
+    thread.join();
+}
+
+void FramePipeline::submit(const Matrix4x4f& to_world)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (has_submitted && submitted_to_world == to_world)
+            return;
+
+        if (pending)
+            skipped++;
+
+        has_submitted = true;
+        submitted_to_world = to_world;
+        pending = true;
+        pending_to_world = to_world;
+        pending_time = get_time();
+    }
+    cond.notify_all();
+}
+
+void FramePipeline::set_reprojection(bool enable)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        reprojection = enable;
+        reprojection_changed = true;
+
+        // Render current camera again.
+        if (has_submitted && !pending)
+        {
+            pending = true;
+            pending_to_world = submitted_to_world;
+            pending_time = get_time();
+        }
+    }
+    cond.notify_all();
+}
+
+bool FramePipeline::get_reprojection()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return reprojection;
+}
+
+void FramePipeline::set_shading(Shader::Mode mode)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shading = mode;
+        shading_changed = true;
+    }
+    cond.notify_all();
+}
+
+Shader::Mode FramePipeline::get_shading()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return shading;
+}
+
+void FramePipeline::set_samples(int n)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        samples = std::max(n, 1);
+        shading_changed = true;
+    }
+    cond.notify_all();
+}
+
+int FramePipeline::get_samples()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return samples;
+}
+
+void FramePipeline::set_area_light(bool area)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        area_light = area;
+        shading_changed = true;
+    }
+    cond.notify_all();
+}
+
+bool FramePipeline::get_area_light()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return area_light;
+}
+
+const unsigned char* FramePipeline::present()
+{
+    int frame;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (!ready.empty())
+        {
+            if (displayed >= 0)
+                frames[displayed].state = FREE;
+
+            displayed = ready.front();
+            ready.pop_front();
+            frames[displayed].state = DISPLAYED;
+
+            new_frame = true;
+            shown = frames[displayed].times;
+            pickup_time = get_time();
+        }
+
+        frame = displayed;
+    }
+    cond.notify_all();
+
+    if (frame < 0)
+        return 0;
+    return (const unsigned char*)frames[frame].pixels->get_ptr();
+}
+
+void FramePipeline::presented()
+{
+    if (!new_frame)
+        return;
+    new_frame = false;
+
+    double now = get_time();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    queue_latency.add(shown.start - shown.submit);
+    render_latency.add(shown.render - shown.start);
+    copy_latency.add(shown.ready - shown.render);
+    wait_latency.add(pickup_time - shown.ready);
+    display_latency.add(now - pickup_time);
+    total_latency.add(now - shown.submit);
+    displayed_count++;
+}
+
+void FramePipeline::set_max_queued(int n)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    max_queued = std::min(std::max(n, 1), (int)frames.size() - 1);
+}
+
+int FramePipeline::get_max_queued()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return max_queued;
+}
+
+int FramePipeline::get_queue_depth()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return (int)ready.size();
+}
+
+void FramePipeline::print_stats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (total_latency.empty())
+        return;
+
+    fprintf(stderr, "pipeline: %d buffers, max queued %d, depth %d, %d rendered, %d displayed, %d dropped, %d skipped\n",
+        (int)frames.size(), max_queued, (int)ready.size(), rendered, displayed_count, dropped, skipped);
+
+    const char* names[] = { "queue", "render", "copy", "wait", "display", "total" };
+    Samples* samples[] = { &queue_latency, &render_latency, &copy_latency, &wait_latency, &display_latency, &total_latency };
+
+    for (int i = 0; i < 6; i++)
+    {
+        fprintf(stderr, "  %-8s median %7.2f ms  p90 %7.2f ms  max %7.2f ms\n", names[i],
+            samples[i]->median() * 1000.0, samples[i]->percentile(90.0) * 1000.0, samples[i]->max() * 1000.0);
+        samples[i]->clear();
+    }
+
+    rendered = dropped = skipped = displayed_count = 0;
+}
+
+int FramePipeline::find_free()
+{
+    for (int i = 0; i < (int)frames.size(); i++)
+        if (frames[i].state == FREE)
+            return i;
+    return -1;
+}
+
+void FramePipeline::thread_main()
+{
+    for (;;)
+    {
+        int frame = -1;
+        Matrix4x4f to_world;
+        double submit_time;
+        bool trace;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (running && !((pending || (shading_changed && has_submitted)) && (frame = find_free()) >= 0))
+                cond.wait(lock);
+            if (!running)
+                return;
+
+            // Shading change alone is done from the hits of the last frame.
+            trace = pending || !has_hits;
+            submit_time = pending ? pending_time : get_time();
+            to_world = pending ? pending_to_world : submitted_to_world;
+            pending = false;
+            frames[frame].state = RENDERING;
+
+            if (reprojection_changed)
+            {
+                renderer->set_reprojection(reprojection);
+                reprojection_changed = false;
+            }
+
+            if (shading_changed)
+            {
+                Shader& shader = renderer->get_shader();
+                shader.set_mode(shading);
+                shader.set_samples(samples);
+                shader.set_light(shader.get_default_light(area_light));
+                shading_changed = false;
+            }
+        }
+
+        Frame& f = frames[frame];
+        f.times.submit = submit_time;
+        f.times.start = get_time();
+
+        if (ring)
+            renderer->set_output(ring->begin_write());
+
+        bool changed = true;
+        if (trace)
+        {
+            changed = renderer->render(to_world);
+            has_hits = true;
+        }
+        else
+            renderer->shade();
+        f.times.render = get_time();
+
+        if (ring)
+        {
+            if (changed)
+                ring->end_write(to_world);
+            else
+                ring->cancel_write();
+        }
+
+        if (changed)
+            memcpy(f.pixels->get_ptr(), renderer->get_buffer(), f.pixels->get_size());
+        f.times.ready = get_time();
+
+        if (changed)
+        {
+            fprintf(stderr, "cpu render: trace %.2f ms (utilization %.0f%%), shade %.2f ms\n",
+                trace ? renderer->get_trace_time() * 1000.0 : 0.0,
+                renderer->get_trace_utilization() * 100.0,
+                renderer->get_shade_time() * 1000.0);
+            if (trace)
+                fprintf(stderr, "primary rays: %.2f Mrays/s\n",
+                    renderer->get_primary_rays() / renderer->get_trace_time() * 1e-6);
+            if (renderer->get_secondary_rays())
+                fprintf(stderr, "secondary rays: %d, %.2f Mrays/s\n", renderer->get_secondary_rays(),
+                    renderer->get_secondary_rays() / renderer->get_shade_time() * 1e-6);
+            if (trace && renderer->get_reprojection())
+                fprintf(stderr, "reprojection reused %.1f%% of pixels\n", renderer->get_reuse_ratio() * 100.0);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (!changed)
+            {
+                f.state = FREE;
+                continue;
+            }
+
+            // Keep only the newest max_queued frames.
+            while ((int)ready.size() >= max_queued)
+            {
+                frames[ready.front()].state = FREE;
+                ready.pop_front();
+                dropped++;
+            }
+
+            f.state = READY;
+            ready.push_back(frame);
+            rendered++;
+        }
+    }
+}
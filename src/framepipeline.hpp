@@ -0,0 +1,159 @@
+#ifndef _dn_framepipeline_hpp_
+#define _dn_framepipeline_hpp_
+
+#include "dndefs.hpp"
+#include "matrix4x4.hpp"
+#include "tilerenderer.hpp"
+#include "hostmemory.hpp"
+#include "stats.hpp"
+#include "shmring.hpp"
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace dn
+{
+    // Runs a TileRenderer on its own thread so that frame N+1 is traced
+    // while frame N is displayed. Finished frames go to a small ring of
+    // buffers (2 for double, 3 for triple buffering): one is on display,
+    // the others are being rendered or wait in the ready queue.
+    //
+    // Submitting a camera never waits for rendering. If a newer camera is
+    // submitted before the previous one was picked up, the older one is
+    // skipped. At most max_queued finished frames wait for display, older
+    // ones are dropped when a new one finishes. 1 gives the lowest input
+    // latency, buffers - 1 never drops a frame.
+    class FramePipeline
+    {
+    public:
+        FramePipeline(TileRenderer* renderer, int buffers = 3);
+        ~FramePipeline();
+
+        // Starts and stops the render thread. The worker pool of the
+        // renderer must not be used by anyone else while started.
+        void start();
+        void stop();
+
+        // Queues a frame for the camera unless it equals the latest one.
+        void submit(const Matrix4x4f& to_world);
+
+        // Applied by the render thread before the next frame.
+        void set_reprojection(bool enable);
+        bool get_reprojection();
+
+        // Shades the latest frame again in the new mode without tracing.
+        void set_shading(Shader::Mode mode);
+        Shader::Mode get_shading();
+
+        // Samples per pixel and light of the shading modes that trace
+        // secondary rays. Applied like shading mode.
+        void set_samples(int n);
+        int get_samples();
+        void set_area_light(bool area);
+        bool get_area_light();
+
+        // Takes the oldest finished frame for display, RGBA with rows from
+        // bottom to top. If none is ready the frame on display is returned
+        // again, or 0 if nothing has been rendered yet. The buffer stays
+        // valid until the next call.
+        const unsigned char* present();
+
+        // Called when the frame taken by present() is on screen.
+        void presented();
+
+        int get_buffer_count() const { return (int)frames.size(); }
+
+        // Frames are also published to ring, the renderer shades them
+        // straight into its slots. Set before start().
+        void set_export(ShmRing* ring) { this->ring = ring; }
+
+        void set_max_queued(int n);
+        int get_max_queued();
+
+        // Finished frames waiting for display.
+        int get_queue_depth();
+
+        // Prints latencies of each stage since previous call.
+        void print_stats();
+
+    private:
+        enum State
+        {
+            FREE,
+            RENDERING,
+            READY,
+            DISPLAYED
+        };
+
+        // Seconds, from get_time().
+        struct Times
+        {
+            double submit;
+            double start;
+            double render;
+            double ready;
+        };
+
+        struct Frame
+        {
+            HostMemory* pixels;
+            State state;
+            Times times;
+        };
+
+        void thread_main();
+        int find_free();
+
+    private:
+        TileRenderer* renderer;
+        ShmRing* ring;
+        std::vector<Frame> frames;
+        std::deque<int> ready;
+        int displayed;
+        int max_queued;
+
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool running;
+
+        // Latest submitted camera.
+        bool pending;
+        Matrix4x4f pending_to_world;
+        double pending_time;
+        bool has_submitted;
+        Matrix4x4f submitted_to_world;
+
+        // Renderer holds hits of a frame, render thread only.
+        bool has_hits;
+
+        bool reprojection;
+        bool reprojection_changed;
+
+        Shader::Mode shading;
+        int samples;
+        bool area_light;
+        bool shading_changed;
+
+        // Timestamps of the frame taken by present(), main thread only.
+        bool new_frame;
+        Times shown;
+        double pickup_time;
+
+        // Protected by mutex.
+        Samples queue_latency;      // submit to start of rendering
+        Samples render_latency;     // trace and shade
+        Samples copy_latency;       // copy to pipeline buffer
+        Samples wait_latency;       // finished to taken for display
+        Samples display_latency;    // upload and swap
+        Samples total_latency;      // submit to on screen
+        int rendered;
+        int dropped;
+        int skipped;
+        int displayed_count;
+    };
+}
+
+#endif
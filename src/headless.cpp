@@ -0,0 +1,485 @@
+//
+// Headless batch renderer. Loads scene, builds BVH and renders cameras
+// with the CPU ray tracer into PPM files. Needs no display and no GPU.
+//
+// With -R it replays a camera path recorded in the viewer instead,
+// rendering every frame, and reports frame time percentiles and the
+// worst frames with their traversal counts.
+//
+// With -g the leaf geometry is paged out to a file after the build and
+// read back on demand into a cache of -m megabytes, for scenes whose
+// geometry doesn't fit in memory. The scene and the pointer tree are freed
+// then, except for the path tracer, which needs the materials. -B also
+// builds the BVH out of core in that many megabytes, using the same file
+// for its buckets first.
+//
+
+#include "scene.hpp"
+#include "bvhrt.hpp"
+#include "flatbvh.hpp"
+#include "camera.hpp"
+#include "image.hpp"
+#include "workerpool.hpp"
+#include "tilerenderer.hpp"
+#include "pathtracer.hpp"
+#include "shmring.hpp"
+#include "stats.hpp"
+#include "timer.hpp"
+#include <stdexcept>
+#include <string>
+#include <algorithm>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <string.h>
+#include <vector>
+
+using namespace dn;
+
+// Slowest frames listed after a replay.
+#define WORST_FRAMES 5
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: gpurt-headless [options] scene.obj camera.txt...\n"
+        "       gpurt-headless [options] -R camera_path.txt scene.obj\n"
+        "  -w width     image width (1024)\n"
+        "  -h height    image height (768)\n"
+        "  -t threads   worker threads (one per core)\n"
+        "  -o prefix    output file prefix, frames are written as <prefix>NNNN.ppm (frame)\n"
+        "  -s modes     comma separated shading modes: normal, depth, barycentric, id, ao,\n"
+        "               shadow (normal), with several modes frames are written as\n"
+        "               <prefix>NNNN-<mode>.ppm\n"
+        "  -n samples   samples per pixel for ao and shadow (4)\n"
+        "  -l light     light for shadow: point or area (area)\n"
+        "  -p samples   render with the path tracer using this many samples per pixel\n"
+        "  -b bounces   path tracer bounces (4)\n"
+        "  -S name      also publish frames to a shared memory ring, e.g. /gpurt\n"
+        "  -r           reproject hits of the previous frame\n"
+        "  -R path      replay a recorded camera path, frames are only written with -o\n"
+        "  -c file      write time and traversal counts of each replayed frame as CSV\n"
+        "  -g file      page leaf geometry out to this file\n"
+        "  -m MB        memory for paged geometry (256)\n"
+        "  -B MB        build the BVH out of core in this much memory, needs -g\n");
+    exit(1);
+}
+
+static void print_paging(const FlatBVH& flatbvh)
+{
+    const PagedGeometry* g = flatbvh.get_paged_geometry();
+    if (!g)
+        return;
+
+    PagedGeometry::Stats s = g->get_stats();
+    uint64_t acquired = s.hits + s.faults;
+    fprintf(stderr, "pages: %.2f%% hits, %llu faults, %llu evictions, %.2f MB read, "
+            "peak %.2f of %.2f MB\n", acquired ? s.hits * 100.0 / acquired : 0.0,
+            (unsigned long long)s.faults, (unsigned long long)s.evictions, s.bytes_read / 1e6,
+            s.peak_resident / 1e6, g->get_budget() / 1e6);
+}
+
+static int run_path_tracer(const Scene& scene, FlatBVH& flatbvh, WorkerPool& pool,
+        const std::vector<Camera>& cameras, int width, int height, int samples, int bounces,
+        const char* prefix)
+{
+    PathTracer tracer(&scene, &flatbvh, &pool, width, height);
+    tracer.set_max_bounces(bounces);
+
+    fprintf(stderr, "path tracer: %d lights\n", tracer.get_light_count());
+
+    for (int i = 0; i < (int)cameras.size(); i++)
+    {
+        Timer timer;
+        tracer.reset();
+        for (int s = 0; s < samples; s++)
+            tracer.render(cameras[i].get_to_world());
+        double time = timer.elapsed();
+
+        char filename[1024];
+        snprintf(filename, sizeof(filename), "%s%04d.ppm", prefix, i);
+        write_ppm(filename, width, height, tracer.get_buffer());
+
+        fprintf(stderr, "path:  %10.2f ms, %d samples -> %s\n", time * 1000.0, samples, filename);
+    }
+
+    tracer.print_stats();
+
+    return 0;
+}
+
+struct FrameStats
+{
+    int frame;
+    double time;        // seconds from the start of the path
+    double frame_ms;
+    double trace_ms;
+    double shade_ms;
+    double reuse;
+    FlatBVH::Counters counters;
+
+    bool operator<(const FrameStats& s) const { return frame_ms > s.frame_ms; }
+};
+
+static double per_ray(uint64_t n, const FlatBVH::Counters& c)
+{
+    return c.rays ? n / (double)c.rays : 0.0;
+}
+
+//
+// Renders every frame of a camera path as the viewer would and collects
+// frame times and traversal counts. Frame time is the whole render,
+// visibility and shading.
+//
+
+static int run_replay(FlatBVH& flatbvh, TileRenderer& renderer, const CameraPath& path,
+        const char* prefix, const char* csv, ShmRing* ring)
+{
+    FILE* fp = 0;
+    if (csv)
+    {
+        fp = fopen(csv, "wt");
+        if (!fp)
+            throw std::runtime_error(std::string("can't open ") + csv + " for writing");
+        fprintf(fp, "frame,time,frame_ms,trace_ms,shade_ms,reuse,rays,nodes,leaves,triangles\n");
+    }
+
+    std::vector<FrameStats> frames(path.size());
+    Samples frame_ms;
+    Samples nodes_per_ray;
+
+    // Last rendered frame, for frames of an unchanged camera, which aren't
+    // rendered again.
+    std::vector<unsigned char> image(renderer.get_width() * renderer.get_height() * 4);
+
+    flatbvh.set_counting(true);
+
+    for (int i = 0; i < path.size(); i++)
+    {
+        Matrix4x4f to_world = path[i].camera.get_to_world();
+        flatbvh.reset_counters();
+
+        if (ring)
+            renderer.set_output(ring->begin_write());
+
+        Timer timer;
+        bool traced = renderer.render(to_world);
+        double time = timer.elapsed();
+
+        if (ring)
+        {
+            if (traced)
+                ring->end_write(to_world);
+            else
+                ring->cancel_write();
+        }
+
+        if (traced)
+            memcpy(&image[0], renderer.get_buffer(), image.size());
+
+        FrameStats& s = frames[i];
+        s.frame = i;
+        s.time = path[i].time;
+        s.frame_ms = time * 1000.0;
+        s.trace_ms = traced ? renderer.get_trace_time() * 1000.0 : 0.0;
+        s.shade_ms = traced ? renderer.get_shade_time() * 1000.0 : 0.0;
+        s.reuse = renderer.get_reuse_ratio();
+        s.counters = flatbvh.get_counters();
+
+        frame_ms.add(s.frame_ms);
+        nodes_per_ray.add(per_ray(s.counters.nodes, s.counters));
+
+        if (fp)
+            fprintf(fp, "%d,%.6f,%.4f,%.4f,%.4f,%.4f,%llu,%llu,%llu,%llu\n", i, s.time, s.frame_ms,
+                    s.trace_ms, s.shade_ms, s.reuse, (unsigned long long)s.counters.rays,
+                    (unsigned long long)s.counters.nodes, (unsigned long long)s.counters.leaves,
+                    (unsigned long long)s.counters.triangles);
+
+        if (prefix)
+        {
+            char filename[1024];
+            snprintf(filename, sizeof(filename), "%s%04d.ppm", prefix, i);
+            write_ppm(filename, renderer.get_width(), renderer.get_height(), &image[0]);
+        }
+    }
+
+    flatbvh.set_counting(false);
+
+    if (fp && fclose(fp) != 0)
+        throw std::runtime_error(std::string("can't write ") + csv);
+
+    fprintf(stderr, "replay: %d frames, %.2f s recorded, %.2f s rendered\n", path.size(),
+            path.get_duration(), frame_ms.mean() * frame_ms.count() / 1000.0);
+    fprintf(stderr, "frame ms: mean %.2f  p50 %.2f  p95 %.2f  p99 %.2f  max %.2f\n",
+            frame_ms.mean(), frame_ms.median(), frame_ms.percentile(95.0),
+            frame_ms.percentile(99.0), frame_ms.max());
+    fprintf(stderr, "nodes/ray: p50 %.1f  p99 %.1f\n", nodes_per_ray.median(),
+            nodes_per_ray.percentile(99.0));
+
+    int worst = std::min((int)frames.size(), WORST_FRAMES);
+    std::partial_sort(frames.begin(), frames.begin() + worst, frames.end());
+
+    fprintf(stderr, "worst frames:\n");
+    for (int i = 0; i < worst; i++)
+    {
+        const FrameStats& s = frames[i];
+        const FlatBVH::Counters& c = s.counters;
+        fprintf(stderr, "  %5d at %7.2f s: %8.2f ms (trace %.2f, shade %.2f), reuse %.2f, "
+                "%llu rays, %.1f nodes, %.1f leaves, %.1f triangles per ray\n",
+                s.frame, s.time, s.frame_ms, s.trace_ms, s.shade_ms, s.reuse,
+                (unsigned long long)c.rays, per_ray(c.nodes, c), per_ray(c.leaves, c),
+                per_ray(c.triangles, c));
+    }
+
+    return 0;
+}
+
+static int run(int argc, char** argv)
+{
+    int width = 1024;
+    int height = 768;
+    int threads = 0;
+    const char* prefix = "frame";
+    std::vector<Shader::Mode> modes;
+    int samples = 0;
+    bool area_light = true;
+    int path_samples = 0;
+    int bounces = 4;
+    const char* shm_name = 0;
+    bool reprojection = false;
+    const char* replay = 0;
+    const char* csv = 0;
+    bool prefix_set = false;
+    const char* page_file = 0;
+    double page_budget = 256.0;
+    double build_budget = 0.0;
+
+    int c;
+    while ((c = getopt(argc, argv, "w:h:t:o:s:n:l:p:b:S:rR:c:g:m:B:")) != -1)
+    {
+        switch (c)
+        {
+        case 'w': width = atoi(optarg); break;
+        case 'h': height = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'o': prefix = optarg; prefix_set = true; break;
+        case 's':
+            for (char* name = strtok(optarg, ","); name; name = strtok(0, ","))
+            {
+                Shader::Mode mode;
+                if (!Shader::parse_mode(name, mode))
+                    usage();
+                modes.push_back(mode);
+            }
+            break;
+        case 'n': samples = atoi(optarg); break;
+        case 'p': path_samples = atoi(optarg); break;
+        case 'b': bounces = atoi(optarg); break;
+        case 'S': shm_name = optarg; break;
+        case 'r': reprojection = true; break;
+        case 'R': replay = optarg; break;
+        case 'c': csv = optarg; break;
+        case 'g': page_file = optarg; break;
+        case 'm': page_budget = atof(optarg); break;
+        case 'B': build_budget = atof(optarg); break;
+        case 'l':
+            if (!strcmp(optarg, "point"))
+                area_light = false;
+            else if (!strcmp(optarg, "area"))
+                area_light = true;
+            else
+                usage();
+            break;
+        default: usage();
+        }
+    }
+
+    if (modes.empty())
+        modes.push_back(Shader::SHADE_NORMAL);
+
+    if (argc - optind < (replay ? 1 : 2) || (replay && argc - optind > 1) ||
+            (replay && path_samples > 0) || width <= 0 || height <= 0 || page_budget <= 0.0 ||
+            build_budget < 0.0 || (build_budget > 0.0 && !page_file))
+        usage();
+
+    const char* scene_file = argv[optind];
+
+    std::vector<Camera> cameras;
+    for (int i = optind + 1; i < argc; i++)
+    {
+        std::vector<Camera> c = Camera::load_all(argv[i]);
+        cameras.insert(cameras.end(), c.begin(), c.end());
+    }
+
+    CameraPath path;
+    if (replay)
+    {
+        path.load(replay);
+        if (path.empty())
+            throw std::runtime_error(std::string("empty camera path: ") + replay);
+    }
+
+    Timer timer;
+    std::unique_ptr<Scene> scene(new Scene(scene_file));
+    double load_time = timer.elapsed();
+    fprintf(stderr, "load:  %10.2f ms, %d triangles\n", load_time * 1000.0, scene->get_primitive_count());
+
+    timer.start();
+    std::unique_ptr<BVHRT> tree(build_budget > 0.0 ?
+            new BVHRT(scene->get_mesh(), page_file, (size_t)(build_budget * 1e6)) :
+            new BVHRT(scene->get_mesh()));
+    FlatBVH flatbvh(tree.get());
+    double build_time = timer.elapsed();
+    fprintf(stderr, "build: %10.2f ms, %d nodes\n", build_time * 1000.0, tree->get_node_count());
+
+    if (page_file)
+    {
+        timer.start();
+        flatbvh.page_out(page_file, (size_t)(page_budget * 1e6));
+        const PagedGeometry* g = flatbvh.get_paged_geometry();
+        fprintf(stderr, "page:  %10.2f ms, %d pages, %.2f MB\n", timer.elapsed() * 1000.0,
+                g->get_page_count(), g->get_file_size() / 1e6);
+
+        // Nothing reads them from now on. The tree's nodes are small
+        // allocations, trimming gives the heap they were in back.
+        tree.reset();
+        if (path_samples <= 0)
+            scene.reset();
+        malloc_trim(0);
+    }
+
+    WorkerPool pool(threads);
+
+    if (path_samples > 0)
+    {
+        int ret = run_path_tracer(*scene, flatbvh, pool, cameras, width, height, path_samples, bounces, prefix);
+        print_paging(flatbvh);
+        return ret;
+    }
+
+    TileRenderer renderer(&flatbvh, &pool, width, height);
+    renderer.set_reprojection(reprojection);
+
+    Shader& shader = renderer.get_shader();
+    if (samples > 0)
+        shader.set_samples(samples);
+    shader.set_light(shader.get_default_light(area_light));
+
+    ShmRing* ring = shm_name ? ShmRing::create(shm_name, width, height) : 0;
+
+    if (replay)
+    {
+        renderer.set_shading(modes[0]);
+        int ret = run_replay(flatbvh, renderer, path, prefix_set ? prefix : 0, csv, ring);
+        print_paging(flatbvh);
+        delete ring;
+        return ret;
+    }
+
+    double trace_time = 0.0;
+    double shade_time = 0.0;
+    double secondary_rays = 0.0;
+    double secondary_time = 0.0;
+    int traced_frames = 0;
+
+    // Last image of each mode, for cameras that didn't change and aren't
+    // traced again.
+    std::vector<std::vector<unsigned char> > images(modes.size());
+
+    for (int i = 0; i < (int)cameras.size(); i++)
+    {
+        // Trace once, other modes only shade the same hits.
+        for (int m = 0; m < (int)modes.size(); m++)
+        {
+            renderer.set_shading(modes[m]);
+
+            // Frame is shaded straight into the ring.
+            if (ring)
+                renderer.set_output(ring->begin_write());
+
+            bool traced = true;
+            if (m == 0)
+            {
+                traced = renderer.render(cameras[i].get_to_world());
+                if (traced)
+                {
+                    trace_time += renderer.get_trace_time();
+                    traced_frames++;
+                }
+            }
+            else
+                renderer.shade();
+
+            if (ring)
+            {
+                if (traced)
+                    ring->end_write(cameras[i].get_to_world());
+                else
+                    ring->cancel_write();
+            }
+
+            std::vector<unsigned char>& image = images[m];
+            if (traced)
+                image.assign(renderer.get_buffer(), renderer.get_buffer() + width * height * 4);
+
+            char filename[1024];
+            if (modes.size() == 1)
+                snprintf(filename, sizeof(filename), "%s%04d.ppm", prefix, i);
+            else
+                snprintf(filename, sizeof(filename), "%s%04d-%s.ppm", prefix, i, Shader::get_mode_name(modes[m]));
+            write_ppm(filename, width, height, &image[0]);
+
+            if (!traced)
+            {
+                fprintf(stderr, "trace: unchanged -> %s\n", filename);
+                continue;
+            }
+
+            shade_time += renderer.get_shade_time();
+            if (renderer.get_secondary_rays())
+            {
+                secondary_rays += renderer.get_secondary_rays();
+                secondary_time += renderer.get_shade_time();
+            }
+
+            if (m == 0)
+                fprintf(stderr, "trace: %10.2f ms, %.2f Mrays/s, shade %.2f ms -> %s\n",
+                        renderer.get_trace_time() * 1000.0,
+                        width * height / renderer.get_trace_time() * 1e-6,
+                        renderer.get_shade_time() * 1000.0, filename);
+            else
+                fprintf(stderr, "shade: %10.2f ms -> %s\n", renderer.get_shade_time() * 1000.0, filename);
+
+            if (renderer.get_secondary_rays())
+                fprintf(stderr, "       %d secondary rays, %.2f Mrays/s\n", renderer.get_secondary_rays(),
+                        renderer.get_secondary_rays() / renderer.get_shade_time() * 1e-6);
+        }
+    }
+
+    fprintf(stderr, "total: load %.2f ms, build %.2f ms, trace %.2f ms, shade %.2f ms (%d frames, %d threads)\n",
+            load_time * 1000.0, build_time * 1000.0, trace_time * 1000.0, shade_time * 1000.0,
+            (int)cameras.size(), pool.get_thread_count());
+    fprintf(stderr, "rays:  primary %.2f Mrays/s", traced_frames * (double)width * height / trace_time * 1e-6);
+    if (secondary_rays > 0.0)
+        fprintf(stderr, ", secondary %.2f Mrays/s", secondary_rays / secondary_time * 1e-6);
+    fprintf(stderr, "\n");
+    print_paging(flatbvh);
+
+    delete ring;
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        return run(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+}
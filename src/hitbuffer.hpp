@@ -0,0 +1,49 @@
+#ifndef _dn_hitbuffer_hpp_
+#define _dn_hitbuffer_hpp_
+
+#include "dndefs.hpp"
+#include "bvhrt.hpp"
+#include <vector>
+
+namespace dn
+{
+    // Per-pixel primary hits: primitive id (-1 for miss), ray distance and
+    // barycentric coordinates.
+    struct HitBuffer
+    {
+        std::vector<int> id;
+        std::vector<float> t;
+        std::vector<float> u;
+        std::vector<float> v;
+
+        void resize(int n)
+        {
+            id.resize(n, -1);
+            t.resize(n);
+            u.resize(n);
+            v.resize(n);
+        }
+
+        int size() const { return (int)id.size(); }
+
+        void set(int i, const BVHRT::Intersection& is)
+        {
+            id[i] = is.id;
+            t[i] = is.t;
+            u[i] = is.u;
+            v[i] = is.v;
+        }
+
+        BVHRT::Intersection get(int i) const
+        {
+            BVHRT::Intersection is;
+            is.id = id[i];
+            is.t = t[i];
+            is.u = u[i];
+            is.v = v[i];
+            return is;
+        }
+    };
+}
+
+#endif
@@ -1,9 +1,257 @@
 #include "hostmemory.hpp"
 #include <stdexcept>
+#include <algorithm>
+#include <mutex>
+#include <map>
+#include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace dn;
 
+/*
+ * Allocator
+ */
+
+#define ALIGNMENT 64
+
+// Blocks from this size up are mapped, in whole huge pages, and go back
+// to the system when released. Their sizes rarely repeat exactly.
+#define LARGE_BLOCK (2 << 20)
+
+// Most the pool keeps of one size class and in all; blocks released
+// beyond that go back to the system.
+#define POOL_CLASS_BLOCKS 4
+#define POOL_LIMIT ((size_t)32 << 20)
+
+typedef std::map<size_t, std::vector<void*> > Pool;    // by block size
+
+static std::mutex pool_mutex;
+static HostMemory::HugePages huge_pages = HostMemory::HUGE_PAGES_OFF;
+static HostMemory::Counters counters;
+
+// Never destroyed, blocks may be released by destructors of other
+// statics after this file's have run.
+static Pool& get_pool()
+{
+    static Pool* pool = new Pool;
+    return *pool;
+}
+static const char* huge_page_names[] = { "off", "transparent", "explicit" };
+
+static size_t round_up(size_t n, size_t a)
+{
+    return (n + a - 1) / a * a;
+}
+
+static void* map_block(size_t size, HostMemory::HugePages mode, bool& huge, bool& fallback)
+{
+    huge = false;
+    fallback = false;
+
+    if (mode == HostMemory::HUGE_PAGES_EXPLICIT)
+    {
+        void* p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+        {
+            huge = true;
+            return p;
+        }
+        fallback = true;
+        mode = HostMemory::HUGE_PAGES_TRANSPARENT;
+    }
+
+    // Transparent huge pages need the block aligned to them. Map one
+    // more and cut off the ends.
+    size_t extra = mode == HostMemory::HUGE_PAGES_TRANSPARENT ? LARGE_BLOCK : 0;
+    char* p = (char*)mmap(0, size + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        throw std::runtime_error("can't allocate host memory");
+
+    if (!extra)
+    {
+        madvise(p, size, MADV_NOHUGEPAGE);
+        return p;
+    }
+
+    char* a = (char*)round_up((uintptr_t)p, LARGE_BLOCK);
+    if (a > p)
+        munmap(p, a - p);
+    if (p + size + extra > a + size)
+        munmap(a + size, p + size + extra - (a + size));
+
+    madvise(a, size, MADV_HUGEPAGE);
+    huge = true;
+    return a;
+}
+
+size_t HostMemory::get_block_size(size_t size)
+{
+    if (size >= LARGE_BLOCK)
+        return round_up(size, LARGE_BLOCK);
+    if (size <= ALIGNMENT)
+        return ALIGNMENT;
+
+    // Four classes per power of two, so at most a quarter is wasted.
+    int e = 63 - __builtin_clzll(size - 1);
+    return round_up(size, (size_t)1 << (e - 2));
+}
+
+void* HostMemory::allocate(size_t size)
+{
+    if (!size)
+        return 0;
+
+    size_t block = get_block_size(size);
+    HugePages mode;
+
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        counters.allocations++;
+        counters.in_use += block;
+        counters.peak_in_use = std::max(counters.peak_in_use, counters.in_use);
+
+        Pool::iterator it = get_pool().find(block);
+        if (it != get_pool().end() && !it->second.empty())
+        {
+            void* p = it->second.back();
+            it->second.pop_back();
+            counters.pool_hits++;
+            counters.pooled -= block;
+            return p;
+        }
+
+        mode = huge_pages;
+    }
+
+    // Not under the lock, mapping and faulting in can take a while.
+    void* p = 0;
+    bool huge = false, fallback = false;
+    try
+    {
+        if (block >= LARGE_BLOCK)
+            p = map_block(block, mode, huge, fallback);
+        else if (posix_memalign(&p, ALIGNMENT, block))
+            throw std::runtime_error("can't allocate host memory");
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        counters.in_use -= block;
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    counters.system_allocations++;
+    counters.system_bytes += block;
+    counters.huge_blocks += huge;
+    counters.huge_fallbacks += fallback;
+    return p;
+}
+
+static void free_block(void* p, size_t block)
+{
+    if (block >= LARGE_BLOCK)
+        munmap(p, block);
+    else
+        free(p);
+}
+
+void HostMemory::release(void* p, size_t size)
+{
+    if (!p)
+        return;
+
+    size_t block = get_block_size(size);
+
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        counters.releases++;
+        counters.in_use -= block;
+
+        if (block < LARGE_BLOCK && counters.pooled + block <= POOL_LIMIT)
+        {
+            std::vector<void*>& blocks = get_pool()[block];
+            if (blocks.size() < POOL_CLASS_BLOCKS)
+            {
+                blocks.push_back(p);
+                counters.pooled += block;
+                return;
+            }
+        }
+    }
+
+    free_block(p, block);
+}
+
+void HostMemory::trim()
+{
+    Pool blocks;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        blocks.swap(get_pool());
+        counters.pooled = 0;
+    }
+
+    for (Pool::iterator it = blocks.begin(); it != blocks.end(); ++it)
+        for (size_t i = 0; i < it->second.size(); i++)
+            free_block(it->second[i], it->first);
+}
+
+void HostMemory::set_huge_pages(HugePages mode)
+{
+    assert((unsigned)mode < DN_ARRAY_LENGTH(huge_page_names));
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        huge_pages = mode;
+    }
+    trim();
+}
+
+HostMemory::HugePages HostMemory::get_huge_pages()
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    return huge_pages;
+}
+
+const char* HostMemory::get_huge_pages_name(HugePages mode)
+{
+    assert((unsigned)mode < DN_ARRAY_LENGTH(huge_page_names));
+    return huge_page_names[mode];
+}
+
+bool HostMemory::parse_huge_pages(const char* name, HugePages& mode)
+{
+    for (int i = 0; i < (int)DN_ARRAY_LENGTH(huge_page_names); i++)
+        if (!strcmp(name, huge_page_names[i]))
+        {
+            mode = (HugePages)i;
+            return true;
+        }
+    return false;
+}
+
+HostMemory::Counters HostMemory::get_counters()
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    return counters;
+}
+
+void HostMemory::reset_counters()
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    Counters c;
+    c.in_use = c.peak_in_use = counters.in_use;
+    c.pooled = counters.pooled;
+    counters = c;
+}
+
 /*
  * HostMemory
  */
@@ -21,14 +269,29 @@ HostMemory::HostMemory(unsigned int s)
 
 HostMemory::~HostMemory()
 {
-    free(ptr);
+    release(ptr, size);
 }
 
 void HostMemory::resize(unsigned int size)
 {
-    void* nptr = realloc(ptr, size);
-    if (!nptr)
-        throw std::runtime_error("can't allocate host memory");
+    if (get_block_size(size) == get_block_size(this->size) && (ptr || !size))
+    {
+        this->size = size;
+        return;
+    }
+
+    void* nptr = allocate(size);
+    if (ptr && nptr)
+    {
+        unsigned int n = std::min(size, this->size);
+        memcpy(nptr, ptr, n);
+
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        counters.resize_copies++;
+        counters.copied_bytes += n;
+    }
+
+    release(ptr, this->size);
     this->ptr = nptr;
     this->size = size;
 }
@@ -58,8 +321,10 @@ DiskMemory::DiskMemory(const std::string& name, HostMemory* m)
     FILE* fp = fopen(get_filename().c_str(), "wb");
     if (!fp)
         throw std::runtime_error("can't open " + get_filename() + " for writing");
-    fwrite(m->get_ptr(), 1, m->get_size(), fp);
-    fclose(fp);
+
+    size_t n = fwrite(m->get_ptr(), 1, m->get_size(), fp);
+    if (fclose(fp) != 0 || n != m->get_size())
+        throw std::runtime_error("can't write " + get_filename() + ": " + strerror(errno));
 }
 
 DiskMemory::~DiskMemory()
@@ -71,29 +336,63 @@ std::string DiskMemory::get_filename() const
     return "cache-" + name + ".bin";
 }
 
+// HostMemory sizes are unsigned ints.
+#define TOO_BIG "too big for host memory"
+
 unsigned int DiskMemory::get_size()
 {
-    FILE* fp = fopen(get_filename().c_str(), "rb");
-    if (!fp)
+    struct stat st;
+    if (stat(get_filename().c_str(), &st) < 0)
         return 0;
-    fseek(fp, 0, SEEK_END);
-    int l = ftell(fp);
-    assert(l >= 0);
-    fclose(fp);
-    return l;
+    if ((uint64_t)st.st_size > UINT_MAX)
+        throw std::runtime_error("can't read " + get_filename() + ": " TOO_BIG);
+    return st.st_size;
 }
 
 HostMemory* DiskMemory::get_host_memory()
 {
-    unsigned int s = get_size();
-    HostMemory* m = new HostMemory(s);
-    if (s == 0)
-        return m;
+    int fd = open(get_filename().c_str(), O_RDONLY);
+    if (fd < 0)
+        return new HostMemory(0);
 
-    FILE* fp = fopen(get_filename().c_str(), "rb");
-    if (!fp)
-        throw std::runtime_error("can't open " + get_filename() + " for reading");
-    fread(m->get_ptr(), 1, s, fp);
-    fclose(fp);
+    struct stat st;
+    const char* error = 0;
+    if (fstat(fd, &st) < 0)
+        error = strerror(errno);
+    else if ((uint64_t)st.st_size > UINT_MAX)
+        error = TOO_BIG;
+    if (error)
+    {
+        close(fd);
+        throw std::runtime_error("can't read " + get_filename() + ": " + error);
+    }
+
+    unsigned int size = st.st_size;
+    HostMemory* m = new HostMemory(size);
+    char* p = (char*)m->get_ptr();
+    size_t left = size;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (left)
+    {
+        ssize_t n = read(fd, p, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            error = n < 0 ? strerror(errno) : "file is truncated";
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+
+    close(fd);
+    if (error)
+    {
+        delete m;
+        throw std::runtime_error("can't read " + get_filename() + ": " + error);
+    }
     return m;
 }
@@ -2,38 +2,136 @@
 #define _dn_hostmemory_hpp_
 
 #include "dndefs.hpp"
-#include "cuda.hpp"
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <vector>
 #include <string>
 
 namespace dn
 {
+    // Host memory block. All blocks come from allocate() below: they are
+    // 64-byte aligned, so SIMD loads of their contents never split a
+    // cache line. A few freed blocks of each size class under 2 MB are
+    // kept in a pool for the next allocation of that class instead of
+    // going back to the system.
+    //
+    // Blocks of 2 MB and more are mapped directly, go back to the system
+    // when freed and can be backed by huge pages, which cuts TLB misses
+    // when traversal jumps around a big BVH or geometry array. With
+    // explicit huge pages they come from the reserved hugetlb pages, or
+    // transparent ones if none are left.
     class HostMemory
     {
     public:
+        enum HugePages
+        {
+            HUGE_PAGES_OFF,
+            HUGE_PAGES_TRANSPARENT,
+            HUGE_PAGES_EXPLICIT
+        };
+
+        struct Counters
+        {
+            Counters()
+            :   allocations(0), releases(0), pool_hits(0), system_allocations(0), system_bytes(0),
+                huge_blocks(0), huge_fallbacks(0), resize_copies(0), copied_bytes(0),
+                in_use(0), peak_in_use(0), pooled(0)
+            {
+            }
+
+            uint64_t allocations;
+            uint64_t releases;
+            uint64_t pool_hits;             // allocations served from the pool
+            uint64_t system_allocations;    // blocks from malloc or mmap
+            uint64_t system_bytes;
+            uint64_t huge_blocks;           // blocks mapped for huge pages
+            uint64_t huge_fallbacks;        // explicit huge pages that weren't there
+            uint64_t resize_copies;         // resizes that moved the contents
+            uint64_t copied_bytes;
+            size_t in_use;                  // bytes in allocated blocks
+            size_t peak_in_use;
+            size_t pooled;                  // bytes in the pool
+        };
+
         HostMemory();
         HostMemory(unsigned int s);
         ~HostMemory();
 
+        // Keeps the contents up to the smaller size. They only move if the
+        // new size doesn't fit in the block.
         void resize(unsigned int size);
 
         unsigned int get_size();
         void* get_ptr();
 
-        template<typename T>
-        void fill(const std::vector<T>& v)
+        template<typename T, class A>
+        void fill(const std::vector<T, A>& v)
         {
             assert((sizeof(T) % 4) == 0); // TODO: assert sizeof(T)*v.size() == end() - begin() or something
             resize(v.size() * sizeof(T));
             memcpy(ptr, &v[0], sizeof(T) * v.size());
         }
 
+        // Block of at least size bytes, 0 for 0 bytes. Throws if there is
+        // no memory. Safe to call from any thread.
+        static void* allocate(size_t size);
+
+        // Gives back a block, size as given to allocate().
+        static void release(void* p, size_t size);
+
+        // Bytes really in the block of an allocation of size bytes.
+        static size_t get_block_size(size_t size);
+
+        // Applies to blocks mapped from now on; the pool is emptied so
+        // that blocks of the old kind aren't handed out again.
+        static void set_huge_pages(HugePages mode);
+        static HugePages get_huge_pages();
+
+        static const char* get_huge_pages_name(HugePages mode);
+
+        // Mode from its name: off, transparent or explicit.
+        static bool parse_huge_pages(const char* name, HugePages& mode);
+
+        // Returns the blocks in the pool to the system, e.g. after a build
+        // that won't be done again soon.
+        static void trim();
+
+        static Counters get_counters();
+
+        // Zeroes the event counts, the byte totals stay.
+        static void reset_counters();
+
     private:
         unsigned int size;
         void* ptr;
     };
 
+    // Standard allocator on HostMemory blocks, for vectors that should be
+    // aligned, pooled or on huge pages.
+    template<class T>
+    class HostAllocator
+    {
+    public:
+        typedef T value_type;
+
+        HostAllocator() {}
+        template<class U> HostAllocator(const HostAllocator<U>&) {}
+
+        T* allocate(size_t n) { return (T*)HostMemory::allocate(n * sizeof(T)); }
+        void deallocate(T* p, size_t n) { HostMemory::release(p, n * sizeof(T)); }
+    };
+
+    template<class T, class U>
+    bool operator==(const HostAllocator<T>&, const HostAllocator<U>&) { return true; }
+
+    template<class T, class U>
+    bool operator!=(const HostAllocator<T>&, const HostAllocator<U>&) { return false; }
+
+    template<class T>
+    using HostVector = std::vector<T, HostAllocator<T> >;
+
+    // Block cached in a file by name. Throws if writing or reading fails.
     class DiskMemory
     {
     public:
@@ -42,8 +140,12 @@ namespace dn
         ~DiskMemory();
 
         std::string get_filename() const;
+
+        // 0 if the file isn't there. Files of more than UINT_MAX bytes
+        // throw here and in get_host_memory().
         unsigned int get_size();
 
+        // Copy of the contents.
         HostMemory* get_host_memory();
 
     private:
@@ -0,0 +1,35 @@
+#include "image.hpp"
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdio.h>
+
+using namespace dn;
+
+void dn::write_ppm(const char* filename, int width, int height, const unsigned char* rgba)
+{
+    FILE* fp = fopen(filename, "wb");
+    if (!fp)
+        throw std::runtime_error(std::string("can't open ") + filename + " for writing");
+
+    fprintf(fp, "P6\n%d %d\n255\n", width, height);
+
+    std::vector<unsigned char> row(width * 3);
+    bool ok = true;
+
+    for (int y = height - 1; y >= 0; y--)
+    {
+        const unsigned char* p = rgba + y * width * 4;
+        for (int x = 0; x < width; x++)
+        {
+            row[x*3+0] = p[x*4+0];
+            row[x*3+1] = p[x*4+1];
+            row[x*3+2] = p[x*4+2];
+        }
+        if (fwrite(&row[0], 1, row.size(), fp) != row.size())
+            ok = false;
+    }
+
+    if (fclose(fp) != 0 || !ok)
+        throw std::runtime_error(std::string("can't write ") + filename);
+}
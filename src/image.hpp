@@ -0,0 +1,13 @@
+#ifndef _dn_image_hpp_
+#define _dn_image_hpp_
+
+#include "dndefs.hpp"
+
+namespace dn
+{
+    // Writes RGBA buffer (rows from bottom to top, as for glDrawPixels)
+    // as binary PPM. Alpha is dropped.
+    void write_ppm(const char* filename, int width, int height, const unsigned char* rgba);
+}
+
+#endif
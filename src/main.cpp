@@ -1,81 +1,94 @@
 #include "SDL.h"
 #include <SDL_opengl.h>
-#include "objloader.hpp"
+#include "scene.hpp"
+#include "camera.hpp"
 #include "bvhrt.hpp"
+#include "flatbvh.hpp"
 #include "cudabvh.hpp"
-#include "zorder.hpp"
+#include "workerpool.hpp"
+#include "tilerenderer.hpp"
+#include "progressive.hpp"
+#include "framepipeline.hpp"
+#include "shmring.hpp"
 #include "cuda.hpp"
+#include <stdexcept>
+#include <unistd.h>
 
 #define WINDOW_WIDTH 1024
 #define WINDOW_HEIGHT 1024
 #define RENDER_WIDTH 1024
 #define RENDER_HEIGHT 768
 
+// Pipeline latencies are printed this often in CPU mode.
+#define PIPELINE_STATS_MS 2000
+
+// Recorded camera paths are saved here, for gpurt-headless -R.
+#define CAMERA_PATH_FILE "camera_path.txt"
+
 using namespace dn;
 
 static enum {
     RENDER_GL,
     RENDER_RT_CPU,
     RENDER_RT_CUDA,
+    RENDER_RT_PROGRESSIVE,
 } mode = RENDER_GL;
 
-static Matrix4x4f cam_to_clip;
-static Matrix4x4f cam_to_view;
+static Camera camera;
+
+static CameraPath camera_path;
+static bool recording = false;
+static int record_ticks;
 
 static const float move_speed = 5.f;
 
-static std::vector<Primitive> primitives;
+static Scene* scene;
 static BVHRT* bvhrt;
+static FlatBVH* flatbvh;
 static CudaBVH* cudabvh;
-static ZOrder* zorder;
+static WorkerPool* pool;
+static TileRenderer* tile_renderer;
+static ProgressiveRenderer* progressive;
+static FramePipeline* pipeline;
+static ShmRing* shm_ring;
 static CudaModule* module;
 static CudaMemory* cuda_result;
+static CudaMemory* cuda_hits;
+static CudaMemory* cuda_normals;
+static Shader::Mode shading = Shader::SHADE_NORMAL;
 
-static void init()
+static void init(const char* scene_file, const char* shm_name)
 {
     cuda_init();
     cuda_print_info();
 
     fprintf(stderr, "loading model\n");
 
-    ObjLoader obj("conference.obj");
-
-    for (int i = 0; i < (int)obj.polygons.size(); i++)
-    {
-        for (int j = 2; j < (int)obj.polygons[i].vertices.size(); j++)
-        {
-            Vector3i t;
-            t.x = obj.polygons[i].vertices[0].v;
-            t.y = obj.polygons[i].vertices[j-1].v;
-            t.z = obj.polygons[i].vertices[j].v;
+    scene = new Scene(scene_file);
 
-            Vector3d v0 = obj.vertices[t.x];
-            Vector3d v1 = obj.vertices[t.y];
-            Vector3d v2 = obj.vertices[t.z];
-
-            // Remove degenerate triangles.
-            if (cross(v1 - v0, v2 - v0).length() < 0.00001)
-                continue;
+    fprintf(stderr, "building bvh tree\n");
 
-            Primitive prim = Primitive(Primitive::TRIANGLE,
-                    convert_to<float>(v0),
-                    convert_to<float>(v1),
-                    convert_to<float>(v2));
+    bvhrt = new BVHRT(scene->get_mesh());
+    flatbvh = new FlatBVH(bvhrt);
 
-            primitives.push_back(prim);
-        }
+    pool = new WorkerPool();
+    tile_renderer = new TileRenderer(flatbvh, pool, RENDER_WIDTH, RENDER_HEIGHT);
+    tile_renderer->set_reprojection(true);
+    pipeline = new FramePipeline(tile_renderer);
+    if (shm_name)
+    {
+        shm_ring = ShmRing::create(shm_name, RENDER_WIDTH, RENDER_HEIGHT);
+        pipeline->set_export(shm_ring);
+        fprintf(stderr, "cpu frames are published to %s\n", shm_name);
     }
-
-    fprintf(stderr, "building bvh tree\n");
-
-    bvhrt = new BVHRT(&*primitives.begin(), primitives.size());
+    progressive = new ProgressiveRenderer(flatbvh, pool, RENDER_WIDTH, RENDER_HEIGHT);
+    fprintf(stderr, "cpu ray tracer uses %d threads\n", pool->get_thread_count());
 
     fprintf(stderr, "preparing cuda\n");
 
     module = new CudaModule("cudabvh.cubin");
     module->set_block_dim(32, 2);
-    cudabvh = new CudaBVH(bvhrt);
-    zorder = new ZOrder(RENDER_WIDTH, RENDER_HEIGHT);
+    cudabvh = new CudaBVH(flatbvh);
 
     // Set pointers to data.
 
@@ -95,8 +108,14 @@ static void init()
     module->get_texture("tex_aabbs_z")->set(cudabvh->get_cuda_aabbs_z(), CudaTexture::FLOAT, 4);
     module->get_texture("tex_vertices")->set(cudabvh->get_cuda_vertices(), CudaTexture::FLOAT, 4);
 
-    CudaMemory* mem = new CudaMemory(zorder->get_to_coord());
-    module->set_ptr("zorder", mem);
+    // Set hit buffer written by bvh_trace and read by bvh_shade.
+
+    cuda_hits = new CudaMemory(RENDER_WIDTH * RENDER_HEIGHT * 16);
+    module->set_ptr("hits", cuda_hits);
+
+    cuda_normals = new CudaMemory();
+    cuda_normals->fill(tile_renderer->get_shader().get_normals());
+    module->set_ptr("normals", cuda_normals);
 
     // Set destination buffer.
 
@@ -119,71 +138,61 @@ static void draw_gl()
     glEnable(GL_DEPTH_TEST);
 
     glMatrixMode(GL_PROJECTION);
-    glLoadMatrixf(transpose(cam_to_clip).data());
+    glLoadMatrixf(transpose(camera.cam_to_clip).data());
 
     glMatrixMode(GL_MODELVIEW);
-    glLoadMatrixf(transpose(cam_to_view).data());
+    glLoadMatrixf(transpose(camera.cam_to_view).data());
 
     glColor3f(1.f, 1.f, 1.f);
     glBegin(GL_TRIANGLES);
-    for (int i = 0; i < (int)primitives.size(); i++)
+    for (int i = 0; i < scene->get_primitive_count(); i++)
     {
-        Vector3f n = normalize(primitives[i].get_normal(0.f, 0.f));
+        const Primitive& prim = scene->get_primitive(i);
+        Vector3f n = normalize(prim.get_normal(0.f, 0.f));
         n = n * 0.5f + Vector3f(0.5f, 0.5f, 0.5f);
         glColor3fv(&n.x);
-        glVertex3fv(&primitives[i].v0.x);
-        glVertex3fv(&primitives[i].v1.x);
-        glVertex3fv(&primitives[i].v2.x);
+        glVertex3fv(&prim.v0.x);
+        glVertex3fv(&prim.v1.x);
+        glVertex3fv(&prim.v2.x);
     }
     glEnd();
 }
 
 //
-// Draws scene using CPU ray tracing.
+// Draws scene using CPU ray tracing. Tracing runs on the pipeline thread,
+// this only submits the camera and draws the latest finished frame.
 //
 
 static void draw_rt_cpu()
 {
-    Matrix4x4f to_world = invert(cam_to_clip * cam_to_view);
-
-    unsigned char* buf = (unsigned char*)malloc(RENDER_WIDTH * RENDER_HEIGHT * 4);
-    unsigned char* p = buf;
+    pipeline->submit(camera.get_to_world());
 
-    for (int y = 0; y < RENDER_HEIGHT; y++)
-        for (int x = 0; x < RENDER_WIDTH; x++)
-        {
-            float fx = (x + 0.5f) / RENDER_WIDTH * 2.f - 1.f;
-            float fy = (y + 0.5f) / RENDER_HEIGHT * 2.f - 1.f;
-
-            Vector3f p0 = (to_world * Vector4f(fx, fy, -1.f, 1.f)).project();
-            Vector3f p1 = (to_world * Vector4f(fx, fy, 1.f, 1.f)).project();
-
-            float t, u, v;
-            int ret = bvhrt->intersect(p0, p1 - p0, t, u, v);
+    const unsigned char* pixels = pipeline->present();
+    if (!pixels)
+    {
+        glClearColor(0.f, 0.f, 0.f, 1.f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        return;
+    }
 
-            if (ret < 0)
-            {
-                *p++ = 0xFF;
-                *p++ = 0x00;
-                *p++ = 0xFF;
-                *p++ = 0xFF;
-                continue;
-            }
+    glDisable(GL_DEPTH_TEST);
+    glPixelZoom(WINDOW_WIDTH / (float)RENDER_WIDTH, WINDOW_HEIGHT / (float)RENDER_HEIGHT);
+    glDrawPixels(RENDER_WIDTH, RENDER_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+}
 
-            Vector3f n = normalize(primitives[ret].get_normal(0.f, 0.f));
-            n = n * 0.5f + Vector3f(0.5f, 0.5f, 0.5f);
+//
+// Draws latest pass of progressive CPU ray tracing. Rendering itself runs
+// in the background.
+//
 
-            *p++ = 0x00 + n.x * 255.f;
-            *p++ = 0x00 + n.y * 255.f;
-            *p++ = 0x00 + n.z * 255.f;
-            *p++ = 0xFF;
-        }
+static void draw_rt_progressive()
+{
+    progressive->set_camera(camera.get_to_world());
 
     glDisable(GL_DEPTH_TEST);
     glPixelZoom(WINDOW_WIDTH / (float)RENDER_WIDTH, WINDOW_HEIGHT / (float)RENDER_HEIGHT);
-    glDrawPixels(RENDER_WIDTH, RENDER_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, buf);
-
-    free(buf);
+    glDrawPixels(RENDER_WIDTH, RENDER_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, progressive->lock());
+    progressive->unlock();
 }
 
 //
@@ -192,13 +201,16 @@ static void draw_rt_cpu()
 
 static void draw_rt_cuda()
 {
-    Matrix4x4f to_world = invert(cam_to_clip * cam_to_view);
+    Matrix4x4f to_world = camera.get_to_world();
 
     module->set_float4("matrix0", to_world.row(0));
     module->set_float4("matrix1", to_world.row(1));
     module->set_float4("matrix2", to_world.row(2));
     module->set_float4("matrix3", to_world.row(3));
     module->set_int("warp_counter", 0);
+    module->set_int("shade_mode", shading);
+    module->set_int("depth_min", 0x7F7FFFFF);
+    module->set_int("depth_max", 0);
 
     module->prepare_launch("bvh_trace");
 
@@ -206,7 +218,13 @@ static void draw_rt_cuda()
     CudaMeasureTime mt;
     module->launch(strm, 16, 16);
     float t = mt.measure(strm);
-    fprintf(stderr, "render took %f ms\n", t);
+
+    // One thread per pixel.
+    module->prepare_launch("bvh_shade");
+    CudaMeasureTime ms;
+    module->launch(strm, (RENDER_WIDTH * RENDER_HEIGHT + 63) / 64, 1);
+    float s = ms.measure(strm);
+    fprintf(stderr, "trace took %f ms, shade took %f ms\n", t, s);
 
     glDisable(GL_DEPTH_TEST);
     glPixelZoom(WINDOW_WIDTH / (float)RENDER_WIDTH, WINDOW_HEIGHT / (float)RENDER_HEIGHT);
@@ -215,25 +233,69 @@ static void draw_rt_cuda()
 
 static void move(const Vector3f& m)
 {
-    cam_to_view = translate(m) * cam_to_view;
+    camera.cam_to_view = translate(m) * camera.cam_to_view;
 }
 
 static void load_camera()
 {
-    FILE* fp = fopen("camera.txt", "rt");
-    assert(fp);
-    for (int i = 0; i < 16; i++)
-        fscanf(fp, "%f", &cam_to_view.data()[i]);
-    for (int i = 0; i < 16; i++)
-        fscanf(fp, "%f", &cam_to_clip.data()[i]);
-    fclose(fp);
+    camera.load("camera.txt");
 
     fprintf(stderr, "camera loaded from camera.txt\n");
 }
 
-int main()
+//
+// Camera path recording. Camera of every frame is recorded with its
+// time until recording is stopped, then the path is saved.
+//
+
+static void start_recording()
+{
+    camera_path.clear();
+    recording = true;
+    record_ticks = SDL_GetTicks();
+    fprintf(stderr, "recording camera path\n");
+}
+
+static void stop_recording()
 {
-    init();
+    if (!recording)
+        return;
+    recording = false;
+
+    try
+    {
+        camera_path.save(CAMERA_PATH_FILE);
+        fprintf(stderr, "saved %d frames (%.2f s) of camera path to %s\n", camera_path.size(),
+                camera_path.get_duration(), CAMERA_PATH_FILE);
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "error: %s\n", e.what());
+    }
+}
+
+int main(int argc, char** argv)
+{
+    // -S name publishes CPU frames to a shared memory ring. The scene is
+    // an .obj file or a compiled scene.
+    const char* shm_name = 0;
+    bool bad_args = false;
+    int c;
+    while ((c = getopt(argc, argv, "S:")) != -1)
+    {
+        if (c == 'S')
+            shm_name = optarg;
+        else
+            bad_args = true;
+    }
+
+    if (bad_args || argc - optind > 1)
+    {
+        fprintf(stderr, "usage: gpurt [-S shm-name] [scene]\n");
+        return 1;
+    }
+
+    init(optind < argc ? argv[optind] : "conference.obj", shm_name);
 
     if (SDL_Init(SDL_INIT_VIDEO) < 0)
     {
@@ -248,12 +310,12 @@ int main()
         return 1;
     }
 
-    cam_to_clip = perspective<float>(45.f / 180.f * 3.14159265f, 1.f, 0.1f, 100.f);
+    camera.cam_to_clip = perspective<float>(45.f / 180.f * 3.14159265f, 1.f, 0.1f, 100.f);
 
     Vector3f eye = Vector3f(4.f, 1.f, 4.f);
     Vector3f center = Vector3f(0.f, 0.f, 0.f);
     Vector3f up = Vector3f(0.f, 1.f, 0.f);
-    cam_to_view = look_at<float>(eye, center, up);
+    camera.cam_to_view = look_at<float>(eye, center, up);
 
     load_camera();
 
@@ -261,6 +323,7 @@ int main()
 
     int last_ticks = prev_ticks;
     int frames = 0;
+    int stats_ticks = prev_ticks;
 
     while (1)
     {
@@ -279,9 +342,15 @@ int main()
                 switch (ev.key.keysym.sym)
                 {
                 case SDLK_ESCAPE:
+                    stop_recording();
+                    progressive->stop();
+                    pipeline->stop();
+                    delete shm_ring;
                     return 0;
 
                 case SDLK_1:
+                    progressive->stop();
+                    pipeline->stop();
                     fprintf(stderr, "rendering using OpenGL\n");
                     mode = RENDER_GL;
                     last_ticks = SDL_GetTicks();
@@ -289,36 +358,87 @@ int main()
                     break;
 
                 case SDLK_2:
+                    progressive->stop();
                     fprintf(stderr, "rendering using cpu ray tracing\n");
                     mode = RENDER_RT_CPU;
+                    pipeline->start();
+                    stats_ticks = SDL_GetTicks();
                     last_ticks = SDL_GetTicks();
                     frames = 0;
                     break;
 
                 case SDLK_3:
+                    progressive->stop();
+                    pipeline->stop();
                     fprintf(stderr, "rendering using cuda ray tracing\n");
                     mode = RENDER_RT_CUDA;
                     last_ticks = SDL_GetTicks();
                     frames = 0;
                     break;
 
+                case SDLK_4:
+                    pipeline->stop();
+                    fprintf(stderr, "rendering using progressive cpu ray tracing\n");
+                    mode = RENDER_RT_PROGRESSIVE;
+                    progressive->set_camera(camera.get_to_world());
+                    progressive->start();
+                    last_ticks = SDL_GetTicks();
+                    frames = 0;
+                    break;
+
                 case SDLK_u:
-                    {
-                        FILE* fp = fopen("camera.txt", "wt");
-                        for (int i = 0; i < 16; i++)
-                            fprintf(fp, "%f ", cam_to_view.data()[i]);
-                        for (int i = 0; i < 16; i++)
-                            fprintf(fp, "%f ", cam_to_clip.data()[i]);
-                        fclose(fp);
-
-                        fprintf(stderr, "saved camera to camera.txt\n");
-                    }
+                    camera.save("camera.txt");
+                    fprintf(stderr, "saved camera to camera.txt\n");
                     break;
 
                 case SDLK_p:
                     load_camera();
                     break;
 
+                case SDLK_r:
+                    if (recording)
+                        stop_recording();
+                    else
+                        start_recording();
+                    break;
+
+                case SDLK_t:
+                    pipeline->set_reprojection(!pipeline->get_reprojection());
+                    fprintf(stderr, "reprojection %s\n", pipeline->get_reprojection() ? "on" : "off");
+                    break;
+
+                case SDLK_m:
+                    shading = (Shader::Mode)((shading + 1) % Shader::SHADE_MODE_COUNT);
+                    pipeline->set_shading(shading);
+                    progressive->set_shading(shading);
+                    fprintf(stderr, "shading mode %s\n", Shader::get_mode_name(shading));
+                    break;
+
+                case SDLK_EQUALS:
+                case SDLK_MINUS:
+                    {
+                        int n = pipeline->get_samples();
+                        n = ev.key.keysym.sym == SDLK_EQUALS ? n * 2 : std::max(n / 2, 1);
+                        pipeline->set_samples(n);
+                        progressive->set_samples(n);
+                        fprintf(stderr, "%d samples per pixel\n", n);
+                    }
+                    break;
+
+                case SDLK_l:
+                    {
+                        bool area = !pipeline->get_area_light();
+                        pipeline->set_area_light(area);
+                        progressive->set_area_light(area);
+                        fprintf(stderr, "using %s light\n", area ? "area" : "point");
+                    }
+                    break;
+
+                case SDLK_q:
+                    pipeline->set_max_queued(pipeline->get_max_queued() % (pipeline->get_buffer_count() - 1) + 1);
+                    fprintf(stderr, "pipeline queues at most %d frames\n", pipeline->get_max_queued());
+                    break;
+
                 default:
                     break;
                 }
@@ -330,14 +450,18 @@ int main()
                     float fdx = ev.motion.xrel / 400.;
                     float fdy = ev.motion.yrel / 400.;
 
-                    cam_to_view =
+                    camera.cam_to_view =
                         rotate(Vector3f(1.0f, 0.0, 0.0), fdy) *
                         rotate(Vector3f(0.0, 1.0f, 0.0), fdx) *
-                        cam_to_view;
+                        camera.cam_to_view;
                 }
                 break;
 
             case SDL_QUIT:
+                stop_recording();
+                progressive->stop();
+                pipeline->stop();
+                delete shm_ring;
                 return 0;
             }
         }
@@ -357,6 +481,9 @@ int main()
         if (keys[SDLK_RIGHT] || keys[SDLK_d])
             move(Vector3f(-move_speed, 0.f, 0.f) * dtf);
 
+        if (recording)
+            camera_path.add((SDL_GetTicks() - record_ticks) / 1000.0, camera);
+
         // Draw things.
 
         switch (mode)
@@ -370,10 +497,24 @@ int main()
         case RENDER_RT_CUDA:
             draw_rt_cuda();
             break;
+        case RENDER_RT_PROGRESSIVE:
+            draw_rt_progressive();
+            break;
         };
 
         SDL_GL_SwapBuffers();
 
+        if (mode == RENDER_RT_CPU)
+        {
+            pipeline->presented();
+
+            if ((int)SDL_GetTicks() - stats_ticks >= PIPELINE_STATS_MS)
+            {
+                pipeline->print_stats();
+                stats_ticks = SDL_GetTicks();
+            }
+        }
+
 //        frames++;
 //        fprintf(stderr, "average %.2f\n", (SDL_GetTicks() - last_ticks) / (double)frames);
     }
@@ -0,0 +1,106 @@
+#include "mappedfile.hpp"
+#include <stdexcept>
+#include <string>
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace dn;
+
+// Read in by prefetch() at a time, between checks for stopping.
+#define PREFETCH_CHUNK (4 << 20)
+
+static const int access_advice[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM };
+
+MappedFile::MappedFile(const char* filename, Access access)
+:   data(0), size(0), stop_prefetch(false), prefetched(0)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error(std::string("can't open: ") + filename);
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        throw std::runtime_error(std::string("can't stat ") + filename + ": " + strerror(errno));
+    }
+
+    size = st.st_size;
+    if (size)
+    {
+        void* p = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error(std::string("can't map ") + filename + ": " + strerror(errno));
+        }
+
+        data = (const char*)p;
+        advise(access);
+    }
+
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (prefetch_thread.joinable())
+    {
+        stop_prefetch = true;
+        prefetch_thread.join();
+    }
+
+    if (data)
+        munmap((void*)data, size);
+}
+
+void MappedFile::release(const char* begin, const char* end)
+{
+    assert(begin >= data && end <= data + size);
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t first = (begin - data + page - 1) / page * page;
+    size_t last = (end == data + size ? size + page - 1 : end - data) / page * page;
+
+    if (first < last)
+        madvise((void*)(data + first), last - first, MADV_DONTNEED);
+}
+
+void MappedFile::advise(Access access)
+{
+    assert((unsigned)access < sizeof(access_advice) / sizeof(access_advice[0]));
+
+    if (data)
+        madvise((void*)data, size, access_advice[access]);
+}
+
+void MappedFile::prefetch()
+{
+    if (data && !prefetch_thread.joinable())
+        prefetch_thread = std::thread(&MappedFile::prefetch_main, this);
+}
+
+void MappedFile::prefetch_main()
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    for (size_t offset = 0; offset < size && !stop_prefetch; offset += PREFETCH_CHUNK)
+    {
+        size_t n = std::min(size - offset, (size_t)PREFETCH_CHUNK);
+
+        // Start the reads of the whole chunk, then touch its pages so
+        // that they are mapped too and first reads don't even fault.
+        madvise((void*)(data + offset), n, MADV_WILLNEED);
+
+        volatile const char* p = data + offset;
+        for (size_t i = 0; i < n; i += page)
+            p[i];
+
+        prefetched += n;
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef _dn_mappedfile_hpp_
+#define _dn_mappedfile_hpp_
+
+#include "dndefs.hpp"
+#include <thread>
+#include <atomic>
+#include <stddef.h>
+
+namespace dn
+{
+    // Whole file mapped read only. Pages are read in on first touch, so
+    // opening is cheap and parsing reads straight from the page cache
+    // without copying into a buffer. The mapping is shared with the page
+    // cache, so processes mapping the same file share its memory.
+    class MappedFile
+    {
+    public:
+        // How the contents will be read, for the kernel's read-ahead.
+        enum Access
+        {
+            ACCESS_NORMAL,
+            ACCESS_SEQUENTIAL,  // front to back, read far ahead
+            ACCESS_RANDOM       // no read-ahead
+        };
+
+        // Throws if the file can't be opened or mapped.
+        MappedFile(const char* filename, Access access = ACCESS_SEQUENTIAL);
+        ~MappedFile();
+
+        // 0 for an empty file.
+        const char* get_data() const { return data; }
+        size_t get_size() const { return size; }
+
+        // Tells that the whole pages between begin and end won't be read
+        // again. They are dropped from this process, the page cache still
+        // has them. Don't use with prefetch(), it would read them again.
+        void release(const char* begin, const char* end);
+
+        void advise(Access access);
+
+        // Starts reading the whole file in on a thread of its own, front
+        // to back, so that the first reads of the contents don't wait for
+        // the disk. Reads can start at once, pages not in yet are read on
+        // the spot as usual. Stops when the file is destroyed.
+        void prefetch();
+
+        // Bytes read in by prefetch() so far.
+        size_t get_prefetched() const { return prefetched; }
+
+    private:
+        MappedFile(const MappedFile&);
+        MappedFile& operator=(const MappedFile&);
+
+        void prefetch_main();
+
+    private:
+        const char* data;
+        size_t size;
+
+        std::thread prefetch_thread;
+        std::atomic<bool> stop_prefetch;
+        std::atomic<size_t> prefetched;
+    };
+}
+
+#endif
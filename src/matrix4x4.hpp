@@ -255,6 +255,21 @@ namespace dn
         T m[16];
     };
 
+    template<typename T>
+    inline bool operator==(const Matrix4x4<T>& a, const Matrix4x4<T>& b)
+    {
+        for (int i = 0; i < 16; i++)
+            if (a[i] != b[i])
+                return false;
+        return true;
+    }
+
+    template<typename T>
+    inline bool operator!=(const Matrix4x4<T>& a, const Matrix4x4<T>& b)
+    {
+        return !(a == b);
+    }
+
     template<typename T>
     Vector4<T> operator*(const Matrix4x4<T>& m, const Vector4<T>& v)
     {
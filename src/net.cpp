@@ -0,0 +1,296 @@
+#include "net.hpp"
+#include <stdexcept>
+#include <string>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+using namespace dn;
+
+// Messages larger than this are a protocol error rather than a frame.
+#define MAX_MESSAGE_SIZE (1u << 30)
+
+static void fail(const std::string& what)
+{
+    throw std::runtime_error(what + ": " + strerror(errno));
+}
+
+static bool is_unix(const char* address)
+{
+    return !strncmp(address, "unix:", 5);
+}
+
+static void make_unix_address(const char* address, sockaddr_un& sa)
+{
+    const char* path = address + 5;
+    if (strlen(path) >= sizeof(sa.sun_path))
+        throw std::runtime_error(std::string("socket path too long: ") + path);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+}
+
+// Splits "host:port", an empty host means any address.
+static addrinfo* resolve(const char* address, bool passive)
+{
+    std::string s(address);
+    size_t colon = s.rfind(':');
+    if (colon == std::string::npos)
+        throw std::runtime_error("address must be host:port or unix:path: " + s);
+
+    std::string host = s.substr(0, colon);
+    std::string port = s.substr(colon + 1);
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive)
+        hints.ai_flags = AI_PASSIVE;
+
+    addrinfo* result;
+    int err = getaddrinfo(host.empty() ? 0 : host.c_str(), port.c_str(), &hints, &result);
+    if (err)
+        throw std::runtime_error("can't resolve " + s + ": " + gai_strerror(err));
+    return result;
+}
+
+// Tiles and requests are small, don't let them wait for more data.
+static void set_nodelay(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+Socket::~Socket()
+{
+    close();
+}
+
+void Socket::close()
+{
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+}
+
+Socket* Socket::connect(const char* address)
+{
+    if (is_unix(address))
+    {
+        sockaddr_un sa;
+        make_unix_address(address, sa);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            fail("socket");
+        if (::connect(fd, (sockaddr*)&sa, sizeof(sa)) < 0)
+        {
+            ::close(fd);
+            fail(std::string("can't connect to ") + address);
+        }
+        return new Socket(fd);
+    }
+
+    addrinfo* ai = resolve(address, false);
+
+    int fd = -1;
+    for (addrinfo* p = ai; p; p = p->ai_next)
+    {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (::connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        ::close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+
+    if (fd < 0)
+        fail(std::string("can't connect to ") + address);
+
+    set_nodelay(fd);
+    return new Socket(fd);
+}
+
+Socket* Socket::listen(const char* address, int backlog)
+{
+    int fd = -1;
+
+    if (is_unix(address))
+    {
+        sockaddr_un sa;
+        make_unix_address(address, sa);
+        unlink(sa.sun_path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            fail("socket");
+        if (bind(fd, (sockaddr*)&sa, sizeof(sa)) < 0)
+        {
+            ::close(fd);
+            fail(std::string("can't bind ") + address);
+        }
+    }
+    else
+    {
+        addrinfo* ai = resolve(address, true);
+
+        for (addrinfo* p = ai; p; p = p->ai_next)
+        {
+            fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+            if (fd < 0)
+                continue;
+
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+            if (bind(fd, p->ai_addr, p->ai_addrlen) == 0)
+                break;
+            ::close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(ai);
+
+        if (fd < 0)
+            fail(std::string("can't bind ") + address);
+    }
+
+    if (::listen(fd, backlog) < 0)
+    {
+        ::close(fd);
+        fail("listen");
+    }
+
+    return new Socket(fd);
+}
+
+Socket* Socket::accept()
+{
+    sockaddr_storage sa;
+    socklen_t len = sizeof(sa);
+
+    int c;
+    do
+        c = ::accept(fd, (sockaddr*)&sa, &len);
+    while (c < 0 && errno == EINTR);
+
+    if (c < 0)
+        fail("accept");
+
+    if (sa.ss_family != AF_UNIX)
+        set_nodelay(c);
+    return new Socket(c);
+}
+
+void Socket::send(const void* data, size_t size)
+{
+    const char* p = (const char*)data;
+    while (size > 0)
+    {
+        ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fail("send");
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+bool Socket::recv(void* data, size_t size)
+{
+    char* p = (char*)data;
+    size_t got = 0;
+    while (got < size)
+    {
+        ssize_t n = ::recv(fd, p + got, size - got, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fail("recv");
+        }
+        if (n == 0)
+        {
+            if (got == 0)
+                return false;
+            throw std::runtime_error("connection closed in the middle of a message");
+        }
+        got += n;
+    }
+    return true;
+}
+
+void dn::send_message(Socket* s, uint32_t type, const void* data, uint32_t size)
+{
+    send_message(s, type, data, size, 0, 0);
+}
+
+void dn::send_message(Socket* s, uint32_t type, const void* head, uint32_t head_size,
+        const void* data, uint32_t size)
+{
+    MessageHeader h;
+    h.type = type;
+    h.size = head_size + size;
+
+    iovec iov[3];
+    iov[0].iov_base = &h;
+    iov[0].iov_len = sizeof(h);
+    iov[1].iov_base = (void*)head;
+    iov[1].iov_len = head_size;
+    iov[2].iov_base = (void*)data;
+    iov[2].iov_len = size;
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+
+    // One call for the usual case, the rest piecewise.
+    ssize_t n;
+    do
+        n = sendmsg(s->get_fd(), &msg, MSG_NOSIGNAL);
+    while (n < 0 && errno == EINTR);
+    if (n < 0)
+        fail("send");
+
+    size_t left = n;
+    for (int i = 0; i < 3; i++)
+    {
+        if (left >= iov[i].iov_len)
+        {
+            left -= iov[i].iov_len;
+            continue;
+        }
+        s->send((const char*)iov[i].iov_base + left, iov[i].iov_len - left);
+        left = 0;
+    }
+}
+
+bool dn::recv_message(Socket* s, uint32_t& type, std::vector<char>& data)
+{
+    MessageHeader h;
+    if (!s->recv(&h, sizeof(h)))
+        return false;
+
+    if (h.size > MAX_MESSAGE_SIZE)
+        throw std::runtime_error("message too large");
+
+    type = h.type;
+    data.resize(h.size);
+    if (h.size > 0 && !s->recv(&data[0], h.size))
+        throw std::runtime_error("connection closed in the middle of a message");
+    return true;
+}
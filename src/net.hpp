@@ -0,0 +1,63 @@
+#ifndef _dn_net_hpp_
+#define _dn_net_hpp_
+
+#include "dndefs.hpp"
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace dn
+{
+    // Blocking stream socket. Addresses are "host:port" for TCP or
+    // "unix:path" for a Unix domain socket. Errors throw
+    // std::runtime_error.
+    class Socket
+    {
+    public:
+        explicit Socket(int fd = -1) : fd(fd) {}
+        ~Socket();
+
+        static Socket* connect(const char* address);
+
+        // Listening socket. An existing Unix socket file is replaced.
+        static Socket* listen(const char* address, int backlog = 64);
+        Socket* accept();
+
+        void send(const void* data, size_t size);
+
+        // Returns false if the connection was closed before any data.
+        bool recv(void* data, size_t size);
+
+        void close();
+        int get_fd() const { return fd; }
+
+    private:
+        Socket(const Socket&);
+        Socket& operator=(const Socket&);
+
+        int fd;
+    };
+
+    //
+    // Messages are a header followed by size bytes of payload. Fields are
+    // sent in host byte order, both ends are expected to run on the same
+    // kind of machine.
+    //
+
+    struct MessageHeader
+    {
+        uint32_t type;
+        uint32_t size;
+    };
+
+    void send_message(Socket* s, uint32_t type, const void* data, uint32_t size);
+
+    // Header and payload sent with a single write.
+    void send_message(Socket* s, uint32_t type, const void* head, uint32_t head_size,
+            const void* data, uint32_t size);
+
+    // Returns false if the connection was closed between messages.
+    bool recv_message(Socket* s, uint32_t& type, std::vector<char>& data);
+}
+
+#endif
@@ -0,0 +1,138 @@
+#include "numparse.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+using namespace dn;
+
+// Longest number handed to strtod.
+#define MAX_NUMBER_LENGTH 64
+
+// Exactly representable powers of ten.
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool is_digit(char c)
+{
+    return (unsigned)(c - '0') < 10;
+}
+
+bool dn::parse_int(const char*& p, const char* end, int& value)
+{
+    const char* s = skip_blanks(p, end);
+
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+'))
+        negative = *s++ == '-';
+
+    if (s == end || !is_digit(*s))
+        return false;
+
+    int64_t v = 0;
+    while (s < end && is_digit(*s))
+    {
+        v = v * 10 + (*s++ - '0');
+        if (v > 0x7FFFFFFF)
+            return false;
+    }
+
+    value = (int)(negative ? -v : v);
+    p = s;
+    return true;
+}
+
+bool dn::parse_double(const char*& p, const char* end, double& value)
+{
+    const char* start = skip_blanks(p, end);
+    const char* s = start;
+
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+'))
+        negative = *s++ == '-';
+
+    // Significant digits go to mantissa, the ones that don't fit only
+    // move the decimal point.
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool any = false;
+
+    for (; s < end && is_digit(*s); s++)
+    {
+        any = true;
+        if (digits < 19)
+        {
+            mantissa = mantissa * 10 + (*s - '0');
+            digits += mantissa != 0;
+        }
+        else
+            exponent++;
+    }
+
+    if (s < end && *s == '.')
+    {
+        for (s++; s < end && is_digit(*s); s++)
+        {
+            any = true;
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + (*s - '0');
+                digits += mantissa != 0;
+                exponent--;
+            }
+        }
+    }
+
+    if (!any)
+        return false;
+
+    if (s < end && (*s == 'e' || *s == 'E'))
+    {
+        const char* e = s + 1;
+        bool negative_exp = false;
+        if (e < end && (*e == '-' || *e == '+'))
+            negative_exp = *e++ == '-';
+
+        // An 'e' without digits isn't part of the number.
+        if (e < end && is_digit(*e))
+        {
+            int x = 0;
+            for (; e < end && is_digit(*e); e++)
+                if (x < 100000)
+                    x = x * 10 + (*e - '0');
+            exponent += negative_exp ? -x : x;
+            s = e;
+        }
+    }
+
+    if (mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22)
+    {
+        double v = (double)mantissa;
+        v = exponent < 0 ? v / powers_of_ten[-exponent] : v * powers_of_ten[exponent];
+        value = negative ? -v : v;
+    }
+    else
+    {
+        char buf[MAX_NUMBER_LENGTH];
+        size_t n = s - start;
+        if (n >= sizeof(buf))
+            return false;
+        memcpy(buf, start, n);
+        buf[n] = '\0';
+        value = strtod(buf, 0);
+    }
+
+    p = s;
+    return true;
+}
+
+bool dn::parse_float(const char*& p, const char* end, float& value)
+{
+    double v;
+    if (!parse_double(p, end, v))
+        return false;
+    value = (float)v;
+    return true;
+}
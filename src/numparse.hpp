@@ -0,0 +1,32 @@
+#ifndef _dn_numparse_hpp_
+#define _dn_numparse_hpp_
+
+#include "dndefs.hpp"
+
+namespace dn
+{
+    // Number parsing for text formats. Unlike scanf and strtod these
+    // don't depend on the locale, don't need a terminating NUL and don't
+    // read past end. Leading spaces and tabs are skipped. On success p is
+    // moved past the number, on failure it is left alone and false is
+    // returned.
+    //
+    // Decimals with at most 15 significant digits and a power of ten of
+    // at most 22 either way, which covers what mesh exporters write, are
+    // converted with a single rounding and give the same result as
+    // strtod. Others fall back to strtod.
+
+    bool parse_int(const char*& p, const char* end, int& value);
+    bool parse_double(const char*& p, const char* end, double& value);
+    bool parse_float(const char*& p, const char* end, float& value);
+
+    // Moves p past spaces and tabs.
+    inline const char* skip_blanks(const char* p, const char* end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        return p;
+    }
+}
+
+#endif
@@ -0,0 +1,146 @@
+//
+// OBJ loading benchmark. Loads each file with the memory mapped parser
+// on one and on all threads and with the original stdio parser, reports
+// the median load time and throughput of each and checks that they all
+// give the same mesh.
+//
+// The first run of each file is not measured, so both parsers read from
+// the page cache.
+//
+
+#include "objloader.hpp"
+#include "stats.hpp"
+#include "timer.hpp"
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace dn;
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: gpurt-objbench [options] file.obj...\n"
+        "  -n runs      measured runs per parser (5)\n"
+        "  -t threads   threads of the parallel mapped parser (one per hardware thread)\n");
+    exit(1);
+}
+
+template<typename T>
+static int count_different(const std::vector<T>& a, const std::vector<T>& b)
+{
+    if (a.size() != b.size())
+        return (int)std::max(a.size(), b.size());
+
+    int n = 0;
+    for (size_t i = 0; i < a.size(); i++)
+        n += memcmp(&a[i], &b[i], sizeof(T)) != 0;
+    return n;
+}
+
+// Differences between two loaded meshes, 0 if the same.
+static int compare(const ObjLoader& a, const ObjLoader& b)
+{
+    int vertices = count_different(a.vertices, b.vertices);
+    int normals = count_different(a.normals, b.normals);
+    int coords = count_different(a.textureCoords, b.textureCoords);
+    int polygons = count_different(a.polygons, b.polygons);
+    int indices = count_different(a.indices, b.indices);
+    int materials = a.materials.size() != b.materials.size();
+
+    if (vertices || normals || coords || polygons || indices || materials)
+        fprintf(stderr, "  different: %d vertices, %d normals, %d texture coordinates, "
+                "%d polygons, %d indices, %d materials\n",
+                vertices, normals, coords, polygons, indices, materials);
+
+    return vertices + normals + coords + polygons + indices + materials;
+}
+
+static double measure(const char* filename, ObjLoader::Parser parser, int threads, int runs)
+{
+    Samples times;
+    for (int i = 0; i <= runs; i++)
+    {
+        Timer timer;
+        ObjLoader obj(filename, parser, threads);
+        if (i > 0)
+            times.add(timer.elapsed());
+    }
+    return times.median();
+}
+
+static int run(int argc, char** argv)
+{
+    int runs = 5;
+    int threads = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:t:")) != -1)
+    {
+        switch (c)
+        {
+        case 'n': runs = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        default: usage();
+        }
+    }
+
+    if (optind == argc || runs <= 0)
+        usage();
+
+    if (threads <= 0)
+        threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+    int failed = 0;
+
+    for (int i = optind; i < argc; i++)
+    {
+        const char* filename = argv[i];
+
+        struct stat st;
+        if (stat(filename, &st) < 0)
+            throw std::runtime_error(std::string("can't open: ") + filename);
+        double mb = st.st_size / 1e6;
+
+        ObjLoader parallel(filename, ObjLoader::PARSER_MAPPED, threads);
+        ObjLoader mapped(filename, ObjLoader::PARSER_MAPPED, 1);
+        ObjLoader stdio(filename, ObjLoader::PARSER_STDIO);
+
+        printf("%s: %.1f MB, %d vertices, %d normals, %d polygons\n", filename, mb,
+                (int)mapped.vertices.size(), (int)mapped.normals.size(), (int)mapped.polygons.size());
+
+        if (compare(mapped, stdio) || compare(parallel, mapped))
+            failed++;
+
+        double t_stdio = measure(filename, ObjLoader::PARSER_STDIO, 0, runs);
+        double t_mapped = measure(filename, ObjLoader::PARSER_MAPPED, 1, runs);
+        double t_parallel = measure(filename, ObjLoader::PARSER_MAPPED, threads, runs);
+
+        printf("  stdio      %10.2f ms %10.1f MB/s\n", t_stdio * 1000.0, mb / t_stdio);
+        printf("  mapped     %10.2f ms %10.1f MB/s  %.2fx\n", t_mapped * 1000.0, mb / t_mapped,
+                t_stdio / t_mapped);
+        printf("  mapped %-3d %10.2f ms %10.1f MB/s  %.2fx, %.2fx of one thread\n", threads,
+                t_parallel * 1000.0, mb / t_parallel, t_stdio / t_parallel, t_mapped / t_parallel);
+    }
+
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        return run(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+}
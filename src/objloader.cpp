@@ -1,4 +1,10 @@
 #include "objloader.hpp"
+#include "mappedfile.hpp"
+#include "numparse.hpp"
+#include "workerpool.hpp"
+#include <stdexcept>
+#include <thread>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -35,16 +41,29 @@ namespace
 
 ObjLoader::ObjLoader(const char* filename, double s)
 {
-	load(filename);
+	load_mapped(filename, 0, 0);
 	scale(Vector3d(s, s, s));
 }
 
 ObjLoader::ObjLoader(const char* filename, const Vector3d& s)
 {
-	load(filename);
+	load_mapped(filename, 0, 0);
 	scale(s);
 }
 
+ObjLoader::ObjLoader(const char* filename, Parser parser, int threads)
+{
+	if (parser == PARSER_STDIO)
+		load(filename);
+	else
+		load_mapped(filename, threads, 0);
+}
+
+ObjLoader::ObjLoader(const char* filename, Consumer* consumer, int threads)
+{
+	load_mapped(filename, threads, consumer);
+}
+
 ObjLoader::~ObjLoader()
 {
 }
@@ -108,6 +127,7 @@ void ObjLoader::load(const char* filename)
 		else if (strncmp(p, "f ", 2) == 0)
 		{
 			Polygon poly;
+			poly.first = (int)indices.size();
 			char buf2[256] = "";
 			int n;
 
@@ -134,12 +154,13 @@ void ObjLoader::load(const char* filename)
 				vi.t = (vi.t <= 0) ? (cnt % 4): (vi.t - 1);	// [samuli] hack for maze
 				vi.n = (vi.n <= 0) ? -1 : (vi.n - 1);
 
-				poly.vertices.push_back(vi);
+				indices.push_back(vi);
 
 				p += n;
 				cnt++;
 			}
 
+			poly.count = cnt;
 			poly.material = material;
 			polygons.push_back(poly);
 		}
@@ -149,47 +170,538 @@ void ObjLoader::load(const char* filename)
 		}
 		else if (strncmp(p, "usemtl ", 7) == 0)
 		{
-			std::string s = p+7;
+			use_material(p+7, material);
+		}
+		else
+		{
+			if (unknowns < 10)
+				printf("%s: Unknown line %d: '%s'\n", filename, lineno, p);
+			unknowns++;
+		}
+	}
+
+	fclose(fp);
+
+	finish();
+}
+
+//
+// Memory mapped loader. Lines are found with memchr and parsed in place.
+// Unlike the stdio loader it takes lines of any length and resolves
+// negative (relative) indices. Otherwise the result is the same, also
+// with any number of threads.
+//
+
+static inline bool is_blank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+// True if the line at p starts with keyword of length n and a blank.
+static inline bool is_keyword(const char* p, const char* end, const char* keyword, int n)
+{
+	return end - p > n && memcmp(p, keyword, n) == 0 && is_blank(p[n]);
+}
+
+//
+// The file is split into chunks at line boundaries which are parsed in
+// parallel, each into its own arrays. Everything in a chunk that depends
+// on what came before it is left unresolved: relative indices count from
+// the start of the chunk and are listed for a fixup, and polygons refer
+// to the chunk's own mtllib and usemtl lines. Merging then goes over the
+// chunks in file order to load materials and number the arrays, and
+// copies the chunks into place in parallel.
+//
+
+// Chunks are at least this large, smaller files are parsed in one piece.
+#define CHUNK_MIN_SIZE (4 << 20)
+
+// More chunks than threads, so that threads finishing early can steal.
+#define CHUNKS_PER_THREAD 4
+
+// Unknown lines reported per file.
+#define MAX_UNKNOWNS 10
+
+// Material of polygons before the first usemtl of their chunk.
+#define MATERIAL_INHERITED -2
+
+namespace
+{
+	// mtllib or usemtl line.
+	struct Directive
+	{
+		bool mtllib;
+		std::string name;
+	};
+
+	struct Unknown
+	{
+		int line;
+		std::string text;
+	};
+
+	struct Chunk
+	{
+		const char* begin;
+		const char* end;
+
+		std::vector<Vector3d> vertices;
+		std::vector<Vector3f> normals;
+		std::vector<Vector3f> textureCoords;
+		std::vector<ObjLoader::Polygon> polygons;	// material is a directive or MATERIAL_INHERITED
+		std::vector<ObjLoader::VertexIndices> indices;
+
+		// Entries of indices with a relative v, t or n.
+		std::vector<int> relative_v;
+		std::vector<int> relative_t;
+		std::vector<int> relative_n;
+
+		std::vector<Directive> directives;
+		std::vector<Unknown> unknowns;
+		int unknown_count;
+		int lines;
+
+		// Set by the merge.
+		int vertex_base, normal_base, coord_base;
+		int polygon_base, index_base;
+		int line_base;
+		int inherited;
+		std::vector<int> materials;	// of each directive
+	};
+}
+
+// One based index to zero based, -1 if missing. Relative indices are
+// made relative to the start of the chunk and listed.
+static inline int chunk_index(int i, int count, int entry, std::vector<int>& relative)
+{
+	if (i > 0)
+		return i - 1;
+	if (i == 0)
+		return -1;
+
+	relative.push_back(entry);
+	return count + i;
+}
+
+static void parse_chunk(Chunk& c)
+{
+	const char* p = c.begin;
+	int material = MATERIAL_INHERITED;
+
+	c.unknown_count = 0;
+	c.lines = 0;
+
+	while (p < c.end)
+	{
+		const char* eol = (const char*)memchr(p, '\n', c.end - p);
+		if (!eol)
+			eol = c.end;
+		const char* next = eol + 1;
+
+		c.lines++;
+
+		// Content ends at a comment or carriage return.
+		const char* end = (const char*)memchr(p, '#', eol - p);
+		if (!end)
+			end = eol;
+		const char* cr = (const char*)memchr(p, '\r', end - p);
+		if (cr)
+			end = cr;
+
+		p = skip_blanks(p, end);
+
+		if (p == end)
+		{
+			p = next;
+			continue;
+		}
+
+		if (is_keyword(p, end, "v", 1))
+		{
+			Vector3d v;
+			p += 2;
+			parse_double(p, end, v.x);
+			parse_double(p, end, v.y);
+			parse_double(p, end, v.z);
+			c.vertices.push_back(v);
+		}
+		else if (is_keyword(p, end, "vn", 2))
+		{
+			Vector3f n;
+			p += 3;
+			parse_float(p, end, n.x);
+			parse_float(p, end, n.y);
+			parse_float(p, end, n.z);
+			c.normals.push_back(n);
+		}
+		else if (is_keyword(p, end, "vt", 2))
+		{
+			Vector3f t;
+			p += 3;
+			parse_float(p, end, t.x);
+			parse_float(p, end, t.y);
+			parse_float(p, end, t.z);
+			c.textureCoords.push_back(t);
+		}
+		else if (is_keyword(p, end, "f", 1))
+		{
+			ObjLoader::Polygon poly;
+			poly.first = (int)c.indices.size();
+			poly.material = material;
 
-			unsigned int i;
-			for (i = 0; i < materials.size(); i++)
+			int cnt = 0;
+			p = skip_blanks(p + 2, end);
+
+			while (p < end)
 			{
-				if (materials[i].name == s)
+				// v, v/t, v//n or v/t/n
+				int v = 0, t = 0, n = 0;
+				if (!parse_int(p, end, v))
 					break;
+				if (p < end && *p == '/')
+				{
+					p++;
+					if (p < end && *p != '/')
+						parse_int(p, end, t);
+					if (p < end && *p == '/')
+					{
+						p++;
+						parse_int(p, end, n);
+					}
+				}
+
+				int entry = (int)c.indices.size();
+				ObjLoader::VertexIndices vi;
+				vi.v = chunk_index(v, (int)c.vertices.size(), entry, c.relative_v);
+				vi.t = t ? chunk_index(t, (int)c.textureCoords.size(), entry, c.relative_t) : cnt % 4;	// [samuli] hack for maze
+				vi.n = chunk_index(n, (int)c.normals.size(), entry, c.relative_n);
+				c.indices.push_back(vi);
+				cnt++;
+
+				while (p < end && !is_blank(*p))
+					p++;
+				p = skip_blanks(p, end);
 			}
 
-			material = (i == materials.size()) ? -1 : (int)i;
+			poly.count = cnt;
+			c.polygons.push_back(poly);
+		}
+		else if (is_keyword(p, end, "mtllib", 6) || is_keyword(p, end, "usemtl", 6))
+		{
+			Directive d;
+			d.mtllib = *p == 'm';
+			d.name.assign(p + 7, end);
+			if (!d.mtllib)
+				material = (int)c.directives.size();
+			c.directives.push_back(d);
 		}
 		else
 		{
-			if (unknowns < 10)
-				printf("%s: Unknown line %d: '%s'\n", filename, lineno, p);
-			unknowns++;
+			if (c.unknown_count < MAX_UNKNOWNS)
+			{
+				Unknown u;
+				u.line = c.lines;
+				u.text.assign(p, end);
+				c.unknowns.push_back(u);
+			}
+			c.unknown_count++;
 		}
+
+		p = next;
 	}
+}
 
-	if (textureCoords.empty())
+// Splits size bytes at data into about n chunks, each ending with a
+// newline except the last one.
+static void split_chunks(const char* data, size_t size, int n, std::vector<Chunk>& chunks)
+{
+	const char* end = data + size;
+	const char* p = data;
+
+	chunks.resize(n);
+	for (int i = 0; i < n; i++)
 	{
-		textureCoords.push_back(Vector3f(0, 0, 0));
-		textureCoords.push_back(Vector3f(1, 0, 0));
-		textureCoords.push_back(Vector3f(1, 1, 0));
-		textureCoords.push_back(Vector3f(0, 1, 0));
+		const char* e = i == n - 1 ? end : std::max(p, data + size / n * (i + 1));
+		if (e < end && e > data && e[-1] != '\n')
+		{
+			e = (const char*)memchr(e, '\n', end - e);
+			e = e ? e + 1 : end;
+		}
+
+		chunks[i].begin = p;
+		chunks[i].end = e;
+		p = e;
 	}
+}
 
-	fclose(fp);
+// Makes the indices and materials of chunk c global. Its polygons are at
+// poly and their indices at vi, which may be where the chunk was copied
+// to; index_base is added to where their indices start.
+static void resolve_chunk(const Chunk& c, ObjLoader::Polygon* poly, int polygon_count,
+		ObjLoader::VertexIndices* vi, int index_base)
+{
+	for (int i = 0; i < polygon_count; i++)
+	{
+		poly[i].first += index_base;
+		poly[i].material = poly[i].material == MATERIAL_INHERITED ?
+				c.inherited : c.materials[poly[i].material];
+	}
 
-	/* Check. */
+	for (size_t i = 0; i < c.relative_v.size(); i++)
+		vi[c.relative_v[i]].v += c.vertex_base;
+	for (size_t i = 0; i < c.relative_t.size(); i++)
+		vi[c.relative_t[i]].t += c.coord_base;
+	for (size_t i = 0; i < c.relative_n.size(); i++)
+		vi[c.relative_n[i]].n += c.normal_base;
+}
 
-	for (unsigned int i = 0; i < polygons.size(); i++)
+namespace
+{
+	class ParseJob : public WorkerPool::Job
 	{
-		const Polygon& p = polygons[i];
+	public:
+		ParseJob(std::vector<Chunk>& chunks, int first) : chunks(chunks), first(first) {}
+
+		void run(int task, int thread)
+		{
+			parse_chunk(chunks[first + task]);
+		}
+
+	private:
+		std::vector<Chunk>& chunks;
+		int first;
+	};
+
+	// Copies chunks to their place in the loader, unless in_place, and
+	// resolves what depends on the chunks before them.
+	class MergeJob : public WorkerPool::Job
+	{
+	public:
+		MergeJob(ObjLoader& obj, std::vector<Chunk>& chunks, bool in_place)
+		:   obj(obj), chunks(chunks), in_place(in_place) {}
+
+		void run(int task, int thread)
+		{
+			Chunk& c = chunks[task];
+			int polygon_count = (int)(in_place ? obj.polygons.size() : c.polygons.size());
+
+			if (!in_place)
+			{
+				std::copy(c.vertices.begin(), c.vertices.end(), obj.vertices.begin() + c.vertex_base);
+				std::copy(c.normals.begin(), c.normals.end(), obj.normals.begin() + c.normal_base);
+				std::copy(c.textureCoords.begin(), c.textureCoords.end(), obj.textureCoords.begin() + c.coord_base);
+				std::copy(c.polygons.begin(), c.polygons.end(), obj.polygons.begin() + c.polygon_base);
+				std::copy(c.indices.begin(), c.indices.end(), obj.indices.begin() + c.index_base);
+			}
+
+			resolve_chunk(c, obj.polygons.data() + c.polygon_base, polygon_count,
+					obj.indices.data() + c.index_base, c.index_base);
+
+			// Done with it, free the memory early.
+			Chunk empty;
+			std::swap(c, empty);
+		}
+
+	private:
+		ObjLoader& obj;
+		std::vector<Chunk>& chunks;
+		bool in_place;
+	};
+}
+
+// Passes a resolved chunk to consumer in file order.
+static void emit_chunk(const Chunk& c, ObjLoader::Consumer* consumer)
+{
+	for (size_t i = 0; i < c.vertices.size(); i++)
+		consumer->vertex(c.vertices[i]);
+	for (size_t i = 0; i < c.normals.size(); i++)
+		consumer->normal(c.normals[i]);
+	for (size_t i = 0; i < c.textureCoords.size(); i++)
+		consumer->texture_coord(c.textureCoords[i]);
+	for (size_t i = 0; i < c.polygons.size(); i++)
+	{
+		const ObjLoader::Polygon& poly = c.polygons[i];
+		consumer->polygon(c.indices.data() + poly.first, poly.count, poly.material);
+	}
+}
+
+//
+// Without a consumer all chunks are parsed at once and merged into the
+// arrays of the loader. With one, chunks are at most CHUNK_MIN_SIZE and
+// parsed a wave of CHUNKS_PER_THREAD per thread at a time, then resolved,
+// handed to the consumer and freed before the next wave, so only the
+// text of one wave is held in parsed form. Pages of the file are dropped
+// once their wave is done.
+//
+
+void ObjLoader::load_mapped(const char* filename, int threads, Consumer* consumer)
+{
+	MappedFile file(filename);
+	size_t size = file.get_size();
+
+	if (threads <= 0)
+		threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+	int n = 1;
+	if (consumer)
+		n = (int)std::max<size_t>(1, (size + CHUNK_MIN_SIZE - 1) / CHUNK_MIN_SIZE);
+	else if (threads > 1)
+		n = std::max(1, (int)std::min<size_t>(threads * CHUNKS_PER_THREAD, size / CHUNK_MIN_SIZE));
+
+	int wave = !consumer ? n : threads > 1 ? threads * CHUNKS_PER_THREAD : 1;
+	threads = std::min(threads, std::min(n, wave));
+
+	std::vector<Chunk> chunks;
+	split_chunks(file.get_data(), size, n, chunks);
+
+	WorkerPool* pool = threads > 1 ? new WorkerPool(threads) : 0;
+
+	int material = -1;
+	int unknowns = 0;
+	size_t vertex_count = 0, normal_count = 0, coord_count = 0;
+	size_t polygon_count = 0, index_count = 0;
+	int lineno = 0;
+
+	for (int first = 0; first < n; first += wave)
+	{
+		int count = std::min(wave, n - first);
+		const char* wave_begin = chunks[first].begin;
+		const char* wave_end = chunks[first + count - 1].end;
+
+		ParseJob parse(chunks, first);
+		if (pool)
+			pool->run(&parse, count);
+		else
+			for (int i = 0; i < count; i++)
+				parse.run(i, 0);
+
+		//
+		// Numbering and materials depend on everything before, go through
+		// the chunks in order.
+		//
 
-		for (unsigned int j = 0; j < p.vertices.size(); j++)
+		for (int i = first; i < first + count; i++)
 		{
-			assert(p.vertices[j].v >= 0 && p.vertices[j].v < (int)vertices.size());
-			assert(p.vertices[j].n < (int)normals.size());
-			assert(p.vertices[j].t < (int)textureCoords.size());
+			Chunk& c = chunks[i];
+
+			c.vertex_base = (int)vertex_count;
+			c.normal_base = (int)normal_count;
+			c.coord_base = (int)coord_count;
+			c.polygon_base = (int)polygon_count;
+			c.index_base = (int)index_count;
+			c.line_base = lineno;
+			c.inherited = material;
+
+			vertex_count += c.vertices.size();
+			normal_count += c.normals.size();
+			coord_count += c.textureCoords.size();
+			polygon_count += c.polygons.size();
+			index_count += c.indices.size();
+			lineno += c.lines;
+
+			if (index_count > INT_MAX || polygon_count > INT_MAX || vertex_count > INT_MAX)
+			{
+				delete pool;
+				throw std::runtime_error(std::string("too many vertices in ") + filename);
+			}
+
+			c.materials.resize(c.directives.size(), -1);
+			for (size_t j = 0; j < c.directives.size(); j++)
+			{
+				const Directive& d = c.directives[j];
+				if (d.mtllib)
+					loadMtl(path_concat(filename, d.name.c_str()).c_str());
+				else
+				{
+					use_material(d.name, material);
+					c.materials[j] = material;
+				}
+			}
+
+			for (size_t j = 0; j < c.unknowns.size() && unknowns < MAX_UNKNOWNS; j++, unknowns++)
+				printf("%s: Unknown line %d: '%s'\n", filename, c.line_base + c.unknowns[j].line,
+						c.unknowns[j].text.c_str());
+			unknowns += c.unknown_count - (int)c.unknowns.size();
+
+			if (consumer)
+			{
+				resolve_chunk(c, c.polygons.data(), (int)c.polygons.size(), c.indices.data(), 0);
+				emit_chunk(c, consumer);
+
+				Chunk empty;
+				std::swap(c, empty);
+			}
 		}
+
+		if (consumer)
+			file.release(wave_begin, wave_end);
+	}
+
+	if (consumer)
+	{
+		delete pool;
+		return;
+	}
+
+	// A single chunk is used as it is.
+	bool in_place = n == 1;
+	if (in_place)
+	{
+		vertices.swap(chunks[0].vertices);
+		normals.swap(chunks[0].normals);
+		textureCoords.swap(chunks[0].textureCoords);
+		polygons.swap(chunks[0].polygons);
+		indices.swap(chunks[0].indices);
+	}
+	else
+	{
+		vertices.resize(vertex_count);
+		normals.resize(normal_count);
+		textureCoords.resize(coord_count);
+		polygons.resize(polygon_count);
+		indices.resize(index_count);
+	}
+
+	MergeJob merge(*this, chunks, in_place);
+	if (pool)
+		pool->run(&merge, n);
+	else
+		for (int i = 0; i < n; i++)
+			merge.run(i, 0);
+
+	delete pool;
+
+	finish();
+}
+
+void ObjLoader::use_material(const std::string& name, int& material)
+{
+	unsigned int i;
+	for (i = 0; i < materials.size(); i++)
+	{
+		if (materials[i].name == name)
+			break;
+	}
+
+	material = (i == materials.size()) ? -1 : (int)i;
+}
+
+// Adds default texture coordinates if there are none and checks indices.
+void ObjLoader::finish()
+{
+	if (textureCoords.empty())
+	{
+		textureCoords.push_back(Vector3f(0, 0, 0));
+		textureCoords.push_back(Vector3f(1, 0, 0));
+		textureCoords.push_back(Vector3f(1, 1, 0));
+		textureCoords.push_back(Vector3f(0, 1, 0));
+	}
+
+	for (unsigned int i = 0; i < indices.size(); i++)
+	{
+		assert(indices[i].v >= 0 && indices[i].v < (int)vertices.size());
+		assert(indices[i].n < (int)normals.size());
+		assert(indices[i].t < (int)textureCoords.size());
 	}
 }
 
@@ -3,6 +3,8 @@
 
 #include "vector3.hpp"
 #include <vector>
+#include <string>
+#include <algorithm>
 
 namespace dn
 {
@@ -16,8 +18,22 @@ namespace dn
             int n;
         };
 
+        // Fields missing from the .mtl file keep these defaults: grey
+        // diffuse, no specular or emission, opaque.
         struct Material
         {
+            Material()
+            :   illum(0), shininess(0.f), d(1.f)
+            {
+                for (int i = 0; i < 3; i++)
+                {
+                    ambient[i] = 0.f;
+                    diffuse[i] = 0.8f;
+                    specular[i] = 0.f;
+                    emission[i] = 0.f;
+                }
+            }
+
             std::string name;
             int illum;
             float ambient[3];
@@ -33,17 +49,58 @@ namespace dn
             float d; // What's this? Opacity?
         };
 
-        class Polygon
+        // Vertices of polygon are indices[first] to indices[first+count-1].
+        struct Polygon
+        {
+            int material;
+            int first;
+            int count;
+        };
+
+        // Mapped reads the memory mapped file with hand written number
+        // parsing and no allocations per line, large files in parallel
+        // chunks. Stdio is the original fgets and sscanf loader, kept for
+        // comparison.
+        enum Parser
         {
-            public:
-                int material;
-                std::vector<VertexIndices> vertices;
+            PARSER_MAPPED,
+            PARSER_STDIO
+        };
+
+        // Receives the contents of the file in file order while it is
+        // parsed, with indices resolved as in the loaded arrays. Indices
+        // point to memory that is only valid during the call.
+        class Consumer
+        {
+        public:
+            virtual ~Consumer() {}
+
+            // Counts to come, if the format tells them up front.
+            virtual void reserve(int vertices, int polygons) {}
+
+            virtual void vertex(const Vector3d& v) = 0;
+            virtual void normal(const Vector3f& n) {}
+            virtual void texture_coord(const Vector3f& t) {}
+            virtual void polygon(const VertexIndices* v, int count, int material) = 0;
         };
 
         ObjLoader(const char* filename, double scale = 1.0);
         ObjLoader(const char* filename, const Vector3d& s);
+        // Threads only apply to the mapped parser, zero means one per
+        // hardware thread.
+        ObjLoader(const char* filename, Parser parser, int threads = 0);
+
+        // Streams the file to consumer with the mapped parser, keeping
+        // only a bounded part of it in memory. Only materials are loaded.
+        // Default texture coordinates are not added.
+        ObjLoader(const char* filename, Consumer* consumer, int threads = 0);
         ~ObjLoader();
 
+        const VertexIndices& get_index(const Polygon& poly, int i) const
+        {
+            return indices[poly.first + i];
+        }
+
         void translate(double x, double y, double z)
         {
             for (unsigned int i = 0; i < vertices.size(); i++)
@@ -59,7 +116,8 @@ namespace dn
                 std::swap(normals[i].y, normals[i].z);
 
             for (unsigned int i = 0; i < polygons.size(); i++)
-                polygons[i].vertices = std::vector<VertexIndices>(polygons[i].vertices.rbegin(), polygons[i].vertices.rend());
+                std::reverse(indices.begin() + polygons[i].first,
+                        indices.begin() + polygons[i].first + polygons[i].count);
         }
 
         void negateXZ()
@@ -82,11 +140,15 @@ namespace dn
         std::vector<Vector3f> normals;
         std::vector<Vector3f> textureCoords;
         std::vector<Polygon> polygons;
+        std::vector<VertexIndices> indices;
         std::vector<Material> materials;
 
     private:
         void load(const char* filename);
+        void load_mapped(const char* filename, int threads, Consumer* consumer);
+        void finish();
         void loadMtl(const char* filename);
+        void use_material(const std::string& name, int& material);
         void scale(const Vector3d& s);
     };
 }
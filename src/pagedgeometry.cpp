@@ -0,0 +1,236 @@
+#include "pagedgeometry.hpp"
+#include <stdexcept>
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+using namespace dn;
+
+static_assert(sizeof(PagedGeometry::Triangle) == 40, "paged triangles must be packed");
+
+PagedGeometry::PagedGeometry(const char* filename, size_t budget)
+:   filename(filename), fd(-1), budget(budget), writing(true), triangle_count(0),
+    lru_head(-1), lru_tail(-1)
+{
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        throw std::runtime_error(std::string("can't create ") + filename + ": " + strerror(errno));
+
+    ::unlink(filename);
+}
+
+PagedGeometry::~PagedGeometry()
+{
+    for (int i = 0; i < (int)pages.size(); i++)
+        delete [] pages[i].data;
+    close(fd);
+}
+
+int PagedGeometry::add_page(const Triangle* triangles, int count)
+{
+    assert(writing && count > 0);
+
+    const char* p = (const char*)triangles;
+    size_t size = count * sizeof(Triangle);
+    off_t offset = (off_t)triangle_count * sizeof(Triangle);
+
+    while (size)
+    {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            throw std::runtime_error("can't write " + filename + ": " + strerror(errno));
+        p += n;
+        size -= n;
+        offset += n;
+    }
+
+    Page page;
+    page.first = triangle_count;
+    page.count = count;
+    page.data = 0;
+    page.pins = 0;
+    page.loading = false;
+    page.prev = page.next = -1;
+    pages.push_back(page);
+
+    triangle_count += count;
+    return (int)pages.size() - 1;
+}
+
+int PagedGeometry::find_page(int i) const
+{
+    assert(i >= 0 && i < triangle_count);
+
+    // Last page starting at or before i.
+    int lo = 0, hi = (int)pages.size() - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if (pages[mid].first <= i)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+void PagedGeometry::finish()
+{
+    assert(writing);
+    writing = false;
+
+    // Pages are read in random order from now on.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+}
+
+//
+// LRU list. Only resident pages that aren't loading are on it, acquired
+// ones included; eviction skips those from the tail.
+//
+
+void PagedGeometry::unlink(int i)
+{
+    Page& p = pages[i];
+    if (p.prev >= 0)
+        pages[p.prev].next = p.next;
+    else
+        lru_head = p.next;
+    if (p.next >= 0)
+        pages[p.next].prev = p.prev;
+    else
+        lru_tail = p.prev;
+    p.prev = p.next = -1;
+}
+
+void PagedGeometry::push_front(int i)
+{
+    Page& p = pages[i];
+    p.prev = -1;
+    p.next = lru_head;
+    if (lru_head >= 0)
+        pages[lru_head].prev = i;
+    else
+        lru_tail = i;
+    lru_head = i;
+}
+
+void PagedGeometry::shrink_to(size_t limit)
+{
+    int i = lru_tail;
+    while (i >= 0 && stats.resident > limit)
+    {
+        int prev = pages[i].prev;
+        if (!pages[i].pins)
+        {
+            unlink(i);
+            delete [] pages[i].data;
+            pages[i].data = 0;
+            stats.resident -= get_page_size(i);
+            stats.evictions++;
+        }
+        i = prev;
+    }
+}
+
+const PagedGeometry::Triangle* PagedGeometry::acquire(int i)
+{
+    assert(!writing && i >= 0 && i < (int)pages.size());
+
+    std::unique_lock<std::mutex> lock(mutex);
+    Page& p = pages[i];
+
+    while (p.loading)
+        loaded.wait(lock);
+
+    if (p.data)
+    {
+        stats.hits++;
+        p.pins++;
+        if (lru_head != i)
+        {
+            unlink(i);
+            push_front(i);
+        }
+        return p.data;
+    }
+
+    // Claim the page and its room, then read without the lock so that
+    // traversals of resident pages go on meanwhile. The buffer is made
+    // first, nothing between claiming and reading throws.
+    Triangle* data = new Triangle[p.count];
+    size_t size = get_page_size(i);
+    p.loading = true;
+    shrink_to(budget > size ? budget - size : 0);
+    stats.faults++;
+    stats.bytes_read += size;
+    stats.resident += size;
+    stats.peak_resident = std::max(stats.peak_resident, stats.resident);
+    lock.unlock();
+
+    char* dst = (char*)data;
+    off_t offset = (off_t)p.first * sizeof(Triangle);
+    size_t left = size;
+    const char* error = 0;
+
+    while (left)
+    {
+        ssize_t n = pread(fd, dst, left, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            error = n < 0 ? strerror(errno) : "file is truncated";
+            break;
+        }
+        dst += n;
+        left -= n;
+        offset += n;
+    }
+
+    lock.lock();
+    p.loading = false;
+    loaded.notify_all();
+
+    if (error)
+    {
+        delete [] data;
+        stats.resident -= size;
+        throw std::runtime_error("can't read " + filename + ": " + error);
+    }
+
+    p.data = data;
+    p.pins = 1;
+    push_front(i);
+    return data;
+}
+
+void PagedGeometry::release(int i)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    assert(pages[i].pins > 0);
+    pages[i].pins--;
+}
+
+void PagedGeometry::evict_all()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    shrink_to(0);
+}
+
+PagedGeometry::Stats PagedGeometry::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void PagedGeometry::reset_stats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t resident = stats.resident;
+    stats = Stats();
+    stats.resident = stats.peak_resident = resident;
+}
@@ -0,0 +1,123 @@
+#ifndef _dn_pagedgeometry_hpp_
+#define _dn_pagedgeometry_hpp_
+
+#include "dndefs.hpp"
+#include "vector3.hpp"
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace dn
+{
+    // Leaf triangles kept in a file instead of memory, for scenes whose
+    // geometry doesn't fit. The file is a sequence of pages, each a run
+    // of whole leaves; FlatBVH writes leaves in depth first order, so a
+    // page holds a subtree and rays that reach one of its leaves tend to
+    // reach the others.
+    //
+    // Traversals acquire a page while they read its triangles. Resident
+    // pages are kept in an LRU cache of at most budget bytes and a page
+    // that isn't resident is read with pread on the calling thread,
+    // others wanting it wait. Acquired pages are never evicted, so the
+    // budget is exceeded if more are acquired at once than fit in it.
+    class PagedGeometry
+    {
+    public:
+        // Self-contained triangle, vertices are not shared between pages.
+        struct Triangle
+        {
+            Vector3f v0, v1, v2;
+            int id;     // primitive id
+        };
+
+        struct Stats
+        {
+            Stats() : hits(0), faults(0), evictions(0), bytes_read(0), resident(0), peak_resident(0) {}
+
+            uint64_t hits;          // acquired pages that were resident
+            uint64_t faults;        // pages read from the file
+            uint64_t evictions;
+            uint64_t bytes_read;
+            size_t resident;        // bytes in resident pages
+            size_t peak_resident;
+        };
+
+        // Creates the file, replacing an existing one. It is unlinked
+        // once open, so it goes away with the process however that ends.
+        PagedGeometry(const char* filename, size_t budget);
+        ~PagedGeometry();
+
+        // Appends a page of count triangles while writing; returns its
+        // index. Pages can't be acquired before finish().
+        int add_page(const Triangle* triangles, int count);
+        void finish();
+
+        int get_page_count() const { return (int)pages.size(); }
+        int get_triangle_count() const { return triangle_count; }
+
+        // First triangle of page in file order, and how many it has.
+        int get_page_first(int page) const { return pages[page].first; }
+        int get_page_triangles(int page) const { return pages[page].count; }
+
+        // Page with the triangle at index i in file order.
+        int find_page(int i) const;
+
+        size_t get_budget() const { return budget; }
+        uint64_t get_file_size() const { return (uint64_t)triangle_count * sizeof(Triangle); }
+
+        // Triangles of page, resident until released.
+        const Triangle* acquire(int page);
+        void release(int page);
+
+        // Drops all unacquired pages.
+        void evict_all();
+
+        Stats get_stats() const;
+        void reset_stats();
+
+    private:
+        struct Page
+        {
+            int first;
+            int count;
+            Triangle* data;     // 0 unless resident
+            int pins;
+            bool loading;
+
+            // LRU list of resident pages, most recent first.
+            int prev;
+            int next;
+        };
+
+        PagedGeometry(const PagedGeometry&);
+        PagedGeometry& operator=(const PagedGeometry&);
+
+        size_t get_page_size(int page) const { return pages[page].count * sizeof(Triangle); }
+
+        // Evicts unacquired pages, least recently used first, until at
+        // most limit bytes are resident.
+        void shrink_to(size_t limit);
+        void unlink(int page);
+        void push_front(int page);
+
+    private:
+        std::string filename;
+        int fd;
+        size_t budget;
+        bool writing;
+
+        std::vector<Page> pages;
+        int triangle_count;
+
+        mutable std::mutex mutex;
+        std::condition_variable loaded;
+        int lru_head;
+        int lru_tail;
+        Stats stats;
+    };
+}
+
+#endif
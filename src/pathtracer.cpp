@@ -0,0 +1,415 @@
+#include "pathtracer.hpp"
+#include "pixelorder.hpp"
+#include "vector2.hpp"
+#include "sampling.hpp"
+#include "timer.hpp"
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+
+using namespace dn;
+
+#define ITEMS_PER_TASK 1024
+#define RESOLVE_ROWS 16
+
+// Russian roulette starts after this many bounces.
+#define RR_BOUNCES 2
+
+static const char* stage_names[] = { "generate", "extend", "shade", "connect" };
+
+static inline float luminance(const Vector3f& c)
+{
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+static inline float max_component(const Vector3f& c)
+{
+    return std::max(c.x, std::max(c.y, c.z));
+}
+
+PathTracer::PathTracer(const Scene* scene, FlatBVH* bvh, WorkerPool* pool, int width, int height)
+:   scene(scene), bvh(bvh), pool(pool), width(width), height(height), max_bounces(4),
+    pixel_order(PixelOrder::ORDER_MORTON, width, height),
+    queue_size(0), shadow_size(0), samples(0)
+{
+    init_materials();
+    init_lights();
+
+    int n = width * height;
+    ray_orig.resize(n);
+    ray_dir.resize(n);
+    throughput.resize(n);
+    rng.resize(n);
+    hits.resize(n);
+    shadow_orig.resize(n);
+    shadow_dir.resize(n);
+    shadow_contrib.resize(n);
+
+    queue.resize(n);
+    next_queue.resize(n);
+    shadow_queue.resize(n);
+    next_counts.resize((n + ITEMS_PER_TASK - 1) / ITEMS_PER_TASK);
+    shadow_counts.resize(next_counts.size());
+
+    accum.resize(n);
+    result.resize(n * 4);
+
+    memset(stats, 0, sizeof(stats));
+}
+
+PathTracer::~PathTracer()
+{
+}
+
+void PathTracer::init_materials()
+{
+    const std::vector<Scene::Material>& materials = scene->get_materials();
+    Scene::Material default_material;
+
+    int n = scene->get_primitive_count();
+    diffuse.resize(n);
+    emission.resize(n);
+
+    for (int i = 0; i < n; i++)
+    {
+        int m = scene->get_primitive_material(i);
+        const Scene::Material& mat = m >= 0 ? materials[m] : default_material;
+
+        diffuse[i] = Vector3f(mat.diffuse[0], mat.diffuse[1], mat.diffuse[2]);
+        emission[i] = Vector3f(mat.emission[0], mat.emission[1], mat.emission[2]);
+    }
+}
+
+//
+// Lights are picked in proportion to their power.
+//
+
+void PathTracer::init_lights()
+{
+    for (int i = 0; i < scene->get_primitive_count(); i++)
+    {
+        if (luminance(emission[i]) <= 0.f)
+            continue;
+
+        const Primitive& prim = scene->get_primitive(i);
+
+        Light l;
+        l.v0 = prim.v0;
+        l.e1 = prim.v1 - prim.v0;
+        l.e2 = prim.v2 - prim.v0;
+        l.radiance = emission[i];
+        l.area = cross(l.e1, l.e2).length() * 0.5f;
+        l.parallelogram = false;
+        lights.push_back(l);
+    }
+
+    if (lights.empty())
+    {
+        // Same place as the area light of the shadow shading mode, facing
+        // down. Radiance is set so that a surface half the scene away
+        // right below it gets irradiance of pi.
+        const AABBf& bounds = scene->get_aabb();
+        Vector3f diag = bounds.get_diagonal();
+        Vector3f center = bounds.min + scale(diag, Vector3f(0.75f, 0.9f, 0.75f));
+
+        Light l;
+        l.e1 = Vector3f(diag.x * 0.1f, 0.f, 0.f);
+        l.e2 = Vector3f(0.f, 0.f, diag.z * 0.1f);
+        l.v0 = center - (l.e1 + l.e2) * 0.5f;
+        l.area = cross(l.e1, l.e2).length();
+        l.parallelogram = true;
+
+        float r = diag.length() * 0.5f;
+        float le = 3.14159265f * r * r / l.area;
+        l.radiance = Vector3f(le, le, le);
+        lights.push_back(l);
+    }
+
+    float total = 0.f;
+    for (int i = 0; i < (int)lights.size(); i++)
+    {
+        total += luminance(lights[i].radiance) * lights[i].area;
+        light_cdf.push_back(total);
+    }
+    for (int i = 0; i < (int)light_cdf.size(); i++)
+        light_cdf[i] /= total;
+}
+
+const PathTracer::Light& PathTracer::sample_light(float u, float& pdf) const
+{
+    int i = std::lower_bound(light_cdf.begin(), light_cdf.end(), u) - light_cdf.begin();
+    i = std::min(i, (int)lights.size() - 1);
+
+    pdf = light_cdf[i] - (i > 0 ? light_cdf[i-1] : 0.f);
+    return lights[i];
+}
+
+void PathTracer::reset()
+{
+    samples = 0;
+    std::fill(accum.begin(), accum.end(), Vector3f(0.f, 0.f, 0.f));
+}
+
+void PathTracer::render(const Matrix4x4f& to_world)
+{
+    if (samples == 0 || to_world != this->to_world)
+    {
+        reset();
+        this->to_world = to_world;
+    }
+
+    run(STAGE_GENERATE, 0, width * height);
+    queue_size = width * height;
+
+    for (int bounce = 0; bounce < max_bounces && queue_size > 0; bounce++)
+    {
+        run(STAGE_EXTEND, bounce, queue_size);
+
+        int tasks = (queue_size + ITEMS_PER_TASK - 1) / ITEMS_PER_TASK;
+        run(STAGE_SHADE, bounce, queue_size);
+
+        compact(next_queue, next_counts, tasks, queue_size);
+        compact(shadow_queue, shadow_counts, tasks, shadow_size);
+        queue.swap(next_queue);
+
+        run(STAGE_CONNECT, bounce, shadow_size);
+    }
+
+    samples++;
+}
+
+void PathTracer::run(Stage stage, int bounce, int items)
+{
+    Timer timer;
+
+    StageJob job(this, stage, bounce);
+    pool->run(&job, (items + ITEMS_PER_TASK - 1) / ITEMS_PER_TASK);
+
+    stats[stage].time += timer.elapsed();
+    stats[stage].items += items;
+}
+
+void PathTracer::run_stage(Stage stage, int bounce, int task)
+{
+    int begin = task * ITEMS_PER_TASK;
+
+    switch (stage)
+    {
+    case STAGE_GENERATE:
+        generate(begin, std::min(begin + ITEMS_PER_TASK, width * height));
+        break;
+    case STAGE_EXTEND:
+        extend(begin, std::min(begin + ITEMS_PER_TASK, queue_size));
+        break;
+    case STAGE_SHADE:
+        shade(bounce, begin, std::min(begin + ITEMS_PER_TASK, queue_size), task);
+        break;
+    case STAGE_CONNECT:
+        connect(begin, std::min(begin + ITEMS_PER_TASK, shadow_size));
+        break;
+    default:
+        break;
+    }
+}
+
+//
+// Moves the parts written by shade tasks together. Each part starts at
+// the first queue index of its task, so parts only move towards the front.
+//
+
+void PathTracer::compact(std::vector<int>& q, std::vector<int>& counts, int tasks, int& size)
+{
+    size = 0;
+    for (int i = 0; i < tasks; i++)
+    {
+        if (size != i * ITEMS_PER_TASK)
+            memmove(&q[size], &q[i * ITEMS_PER_TASK], counts[i] * sizeof(int));
+        size += counts[i];
+    }
+}
+
+void PathTracer::generate(int begin, int end)
+{
+    for (int i = begin; i < end; i++)
+    {
+        Vector2i c = pixel_order.get_coord(i);
+        int x = c.x;
+        int y = c.y;
+        int p = y * width + x;
+
+        Random& rnd = rng[p];
+        rnd.seed_stream(samples, p);
+
+        // Jittered position inside the pixel.
+        float fx = (x + rnd.next_float()) / width * 2.f - 1.f;
+        float fy = (y + rnd.next_float()) / height * 2.f - 1.f;
+
+        Vector3f p0 = (to_world * Vector4f(fx, fy, -1.f, 1.f)).project();
+        Vector3f p1 = (to_world * Vector4f(fx, fy, 1.f, 1.f)).project();
+
+        ray_orig[p] = p0;
+        ray_dir[p] = p1 - p0;
+        throughput[p] = Vector3f(1.f, 1.f, 1.f);
+        queue[i] = p;
+    }
+}
+
+void PathTracer::extend(int begin, int end)
+{
+    for (int i = begin; i < end; i++)
+    {
+        int p = queue[i];
+        hits.set(p, bvh->intersect(ray_orig[p], ray_dir[p]));
+    }
+}
+
+//
+// Surviving paths and shadow rays are written to the task's own part of
+// next_queue and shadow_queue, starting from the same index as its input.
+//
+
+void PathTracer::shade(int bounce, int begin, int end, int task)
+{
+    const float inv_pi = 1.f / 3.14159265f;
+    float eps = scene->get_aabb().get_diagonal().length() * 1e-5f;
+
+    int next = begin;
+    int shadow = begin;
+
+    for (int i = begin; i < end; i++)
+    {
+        int p = queue[i];
+        int id = hits.id[p];
+
+        // Nothing is visible behind the scene.
+        if (id < 0)
+            continue;
+
+        Vector3f& t = throughput[p];
+        Random& rnd = rng[p];
+
+        // Emission is only added when seen directly, later bounces get it
+        // through light samples.
+        if (bounce == 0)
+            accum[p] += t * emission[id];
+
+        const Vector3f& d = ray_dir[p];
+        Vector3f n = normalize(scene->get_primitive(id).get_normal(0.f, 0.f));
+        if (dot(n, d) > 0.f)
+            n = -n;
+
+        Vector3f pos = ray_orig[p] + d * hits.t[p] + n * eps;
+        const Vector3f& kd = diffuse[id];
+
+        // Light sample.
+
+        float light_pdf;
+        const Light& l = sample_light(rnd.next_float(), light_pdf);
+
+        float u1 = rnd.next_float();
+        float u2 = rnd.next_float();
+        Vector3f q;
+        if (l.parallelogram)
+            q = l.v0 + l.e1 * u1 + l.e2 * u2;
+        else
+        {
+            float su = sqrtf(u1);
+            q = l.v0 + l.e1 * (su * (1.f - u2)) + l.e2 * (su * u2);
+        }
+
+        Vector3f to_light = q - pos;
+        float dist2 = dot(to_light, to_light);
+        Vector3f wl = to_light * (1.f / sqrtf(dist2));
+
+        float cos_s = dot(n, wl);
+        float cos_l = -dot(normalize(cross(l.e1, l.e2)), wl);
+        if (!l.parallelogram)
+            cos_l = fabsf(cos_l);
+
+        if (cos_s > 0.f && cos_l > 0.f)
+        {
+            float g = cos_s * cos_l * l.area / (dist2 * light_pdf);
+            shadow_orig[p] = pos;
+            shadow_dir[p] = to_light;
+            shadow_contrib[p] = t * kd * l.radiance * (g * inv_pi);
+            shadow_queue[shadow++] = p;
+        }
+
+        // Continue path. Cosine weighted sampling cancels the cosine and
+        // 1 / pi of the diffuse BRDF.
+
+        if (bounce + 1 >= max_bounces)
+            continue;
+
+        t = t * kd;
+
+        if (bounce >= RR_BOUNCES)
+        {
+            float survive = std::min(max_component(t), 0.95f);
+            if (rnd.next_float() >= survive)
+                continue;
+            t *= 1.f / survive;
+        }
+
+        if (max_component(t) <= 0.f)
+            continue;
+
+        ray_orig[p] = pos;
+        ray_dir[p] = sample_cosine_hemisphere(n, rnd.next_float(), rnd.next_float());
+        next_queue[next++] = p;
+    }
+
+    next_counts[task] = next - begin;
+    shadow_counts[task] = shadow - begin;
+}
+
+void PathTracer::connect(int begin, int end)
+{
+    for (int i = begin; i < end; i++)
+    {
+        int p = shadow_queue[i];
+
+        // Ray ends just before the light.
+        if (!bvh->occluded(shadow_orig[p], shadow_dir[p], 0.999f))
+            accum[p] += shadow_contrib[p];
+    }
+}
+
+const unsigned char* PathTracer::get_buffer()
+{
+    ResolveJob job(this);
+    pool->run(&job, (height + RESOLVE_ROWS - 1) / RESOLVE_ROWS);
+
+    return (const unsigned char*)result.get_ptr();
+}
+
+// Average, clamp and gamma 2.2.
+void PathTracer::resolve_rows(int task)
+{
+    int y0 = task * RESOLVE_ROWS;
+    int y1 = std::min(y0 + RESOLVE_ROWS, height);
+    float inv = samples ? 1.f / samples : 0.f;
+
+    unsigned char* out = (unsigned char*)result.get_ptr() + y0 * width * 4;
+
+    for (int p = y0 * width; p < y1 * width; p++)
+    {
+        Vector3f c = accum[p] * inv;
+        for (int k = 0; k < 3; k++)
+            *out++ = powf(std::min(std::max(c[k], 0.f), 1.f), 1.f / 2.2f) * 255.f + 0.5f;
+        *out++ = 0xFF;
+    }
+}
+
+void PathTracer::print_stats() const
+{
+    fprintf(stderr, "path tracer: %d samples, %d bounces, %d lights\n", samples, max_bounces, (int)lights.size());
+
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        fprintf(stderr, "  %-9s %10.2f ms %12lld items %8.2f M/s\n", stage_names[i],
+                stats[i].time * 1000.0, stats[i].items,
+                stats[i].time > 0.0 ? stats[i].items / stats[i].time * 1e-6 : 0.0);
+    }
+}
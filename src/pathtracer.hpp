@@ -0,0 +1,170 @@
+#ifndef _dn_pathtracer_hpp_
+#define _dn_pathtracer_hpp_
+
+#include "dndefs.hpp"
+#include "matrix4x4.hpp"
+#include "scene.hpp"
+#include "flatbvh.hpp"
+#include "workerpool.hpp"
+#include "hostmemory.hpp"
+#include "hitbuffer.hpp"
+#include "random.hpp"
+#include "pixelorder.hpp"
+#include <vector>
+
+namespace dn
+{
+    // Wavefront path tracer. Instead of following one path at a time, each
+    // step of all paths runs as a separate stage over a queue of path
+    // indices:
+    //
+    //   generate  camera rays for every pixel, in Z-order
+    //   extend    closest hit of every queued ray
+    //   shade     material lookup, light sample and next direction
+    //   connect   shadow rays of the light samples
+    //
+    // Extend, shade and connect repeat for each bounce. Paths that miss or
+    // are terminated are compacted out of the queue between bounces, so
+    // every stage works on full batches of live paths in the same order.
+    //
+    // Materials are diffuse with the Kd color of the .mtl file. Triangles
+    // with nonzero Ke are lights. If the scene has none, an area light is
+    // placed above it like in the shadow shading mode.
+    class PathTracer
+    {
+    public:
+        PathTracer(const Scene* scene, FlatBVH* bvh, WorkerPool* pool, int width, int height);
+        ~PathTracer();
+
+        void set_max_bounces(int n) { max_bounces = std::max(n, 1); }
+        int get_max_bounces() const { return max_bounces; }
+
+        // Adds one sample per pixel. Samples are accumulated until the
+        // camera changes or reset() is called.
+        void render(const Matrix4x4f& to_world);
+        void reset();
+
+        int get_sample_count() const { return samples; }
+        int get_width() const { return width; }
+        int get_height() const { return height; }
+
+        // Average of samples so far, RGBA with rows from bottom to top.
+        const unsigned char* get_buffer();
+
+        int get_light_count() const { return (int)lights.size(); }
+
+        // Totals since construction.
+        struct StageStats
+        {
+            double time;
+            long long items;
+        };
+
+        enum Stage
+        {
+            STAGE_GENERATE,
+            STAGE_EXTEND,
+            STAGE_SHADE,
+            STAGE_CONNECT,
+            STAGE_COUNT
+        };
+
+        const StageStats& get_stage_stats(Stage s) const { return stats[s]; }
+        void print_stats() const;
+
+    private:
+        struct Light
+        {
+            Vector3f v0;
+            Vector3f e1;
+            Vector3f e2;
+            Vector3f radiance;
+            float area;
+            bool parallelogram;
+        };
+
+        class StageJob : public WorkerPool::Job
+        {
+        public:
+            StageJob(PathTracer* t, Stage stage, int bounce) : t(t), stage(stage), bounce(bounce) {}
+            void run(int task, int thread) { t->run_stage(stage, bounce, task); }
+        private:
+            PathTracer* t;
+            Stage stage;
+            int bounce;
+        };
+
+        class ResolveJob : public WorkerPool::Job
+        {
+        public:
+            ResolveJob(PathTracer* t) : t(t) {}
+            void run(int task, int thread) { t->resolve_rows(task); }
+        private:
+            PathTracer* t;
+        };
+
+        void init_materials();
+        void init_lights();
+
+        void run(Stage stage, int bounce, int items);
+        void run_stage(Stage stage, int bounce, int task);
+        void compact(std::vector<int>& queue, std::vector<int>& counts, int tasks, int& size);
+
+        void generate(int begin, int end);
+        void extend(int begin, int end);
+        void shade(int bounce, int begin, int end, int task);
+        void connect(int begin, int end);
+        void resolve_rows(int task);
+
+        const Light& sample_light(float u, float& pdf) const;
+
+    private:
+        const Scene* scene;
+        FlatBVH* bvh;
+        WorkerPool* pool;
+        int width, height;
+        int max_bounces;
+
+        // Camera rays are generated in Z-order so that neighbouring rays in
+        // the queue stay close to each other.
+        PixelOrder pixel_order;
+
+        // Per primitive diffuse color and emitted radiance.
+        std::vector<Vector3f> diffuse;
+        std::vector<Vector3f> emission;
+
+        std::vector<Light> lights;
+        std::vector<float> light_cdf;
+
+        // Path state, indexed by pixel.
+        std::vector<Vector3f> ray_orig;
+        std::vector<Vector3f> ray_dir;
+        std::vector<Vector3f> throughput;
+        std::vector<Random> rng;
+        HitBuffer hits;
+
+        std::vector<Vector3f> shadow_orig;
+        std::vector<Vector3f> shadow_dir;
+        std::vector<Vector3f> shadow_contrib;
+
+        // Pixel indices of live paths and of pending shadow rays. During
+        // shade each task writes to its own part of the queue and the parts
+        // are moved together afterwards.
+        std::vector<int> queue;
+        std::vector<int> next_queue;
+        std::vector<int> shadow_queue;
+        int queue_size;
+        int shadow_size;
+        std::vector<int> next_counts;
+        std::vector<int> shadow_counts;
+
+        Matrix4x4f to_world;
+        std::vector<Vector3f> accum;
+        int samples;
+        HostMemory result;
+
+        StageStats stats[STAGE_COUNT];
+    };
+}
+
+#endif
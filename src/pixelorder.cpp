@@ -0,0 +1,209 @@
+#include "pixelorder.hpp"
+#include <stdexcept>
+#include <string>
+#include <algorithm>
+#include <string.h>
+#include <stdint.h>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+using namespace dn;
+
+// Orientation of a Hilbert sub-curve relative to the canonical one.
+// Both are their own inverse and they commute, so they compose by xor.
+#define HILBERT_SWAP 1      // mirrored about the diagonal
+#define HILBERT_FLIP 2      // rotated half a turn
+
+// Orientation change entering quadrant q of a Hilbert cell: the first
+// quadrant is mirrored, the last one mirrored and rotated.
+#define HILBERT_SUB(q) ((0x3001 >> ((q) * 4)) & 3)
+
+static const char* order_names[] = { "scanline", "tiled", "morton", "hilbert" };
+
+// Even bits of v packed to the low half.
+static inline int compact_bits(uint32_t v)
+{
+#ifdef __BMI2__
+    return _pext_u32(v, 0x55555555);
+#else
+    v &= 0x55555555;
+    v = (v | (v >> 1)) & 0x33333333;
+    v = (v | (v >> 2)) & 0x0F0F0F0F;
+    v = (v | (v >> 4)) & 0x00FF00FF;
+    v = (v | (v >> 8)) & 0x0000FFFF;
+    return v;
+#endif
+}
+
+// Position of quadrant q of a Hilbert cell with orientation orient.
+static inline void hilbert_quadrant(int q, int orient, int& rx, int& ry)
+{
+    rx = (q >> 1) & 1;
+    ry = (q ^ rx) & 1;
+
+    int swap = (rx ^ ry) & -(orient & HILBERT_SWAP);
+    int flip = orient >> 1;
+    rx ^= swap ^ flip;
+    ry ^= swap ^ flip;
+}
+
+// Xor of each bit with all bits above it.
+static inline uint32_t prefix_xor(uint32_t v)
+{
+    v ^= v >> 8;
+    v ^= v >> 4;
+    v ^= v >> 2;
+    v ^= v >> 1;
+    return v;
+}
+
+// Canonical Hilbert curve on a 2^bits square, starting at the origin and
+// ending at (2^bits - 1, 0). All levels are decoded at once: the
+// orientation at each level follows from prefix xors of the digits above.
+static inline void hilbert_decode(int bits, uint32_t d, int& x, int& y)
+{
+    if (!bits)
+    {
+        x = y = 0;
+        return;
+    }
+
+    d <<= 32 - 2 * bits;
+    uint32_t d0 = compact_bits(d);
+    uint32_t d1 = compact_bits(d >> 1);
+
+    uint32_t p0 = prefix_xor((d0 | d1) ^ 0xFFFF);
+    uint32_t p1 = prefix_xor(d0 & d1);
+    uint32_t a = ((d0 ^ 0xFFFF) & p1) | (d0 & p0);
+
+    x = (a ^ d1) >> (16 - bits);
+    y = (a ^ d0 ^ d1) >> (16 - bits);
+}
+
+// Pixels of a size long span starting at a that are below limit.
+static inline int overlap(int a, int size, int limit)
+{
+    return std::max(0, std::min(size, limit - a));
+}
+
+PixelOrder::PixelOrder(Type type, int width, int height, int tile)
+:   type(type), width(width), height(height), tile(tile), size(1)
+{
+    if (width <= 0 || height <= 0 || tile <= 0 || (unsigned)type >= ORDER_COUNT)
+        throw std::runtime_error("bad pixel order");
+
+    while (size < width || size < height)
+        size *= 2;
+}
+
+Vector2i PixelOrder::get_coord(int i) const
+{
+    assert(i >= 0 && i < get_count());
+
+    switch (type)
+    {
+    case ORDER_SCANLINE:
+        return Vector2i(i % width, i / width);
+    case ORDER_TILED:
+        return get_tiled(i);
+    default:
+        return get_curve(i);
+    }
+}
+
+Vector2i PixelOrder::get_tiled(int i) const
+{
+    // All bands but the top one are full height and all tiles of a band
+    // but the rightmost one are full width.
+    int band = i / (width * tile);
+    int band_height = std::min(tile, height - band * tile);
+    int r = i - band * width * tile;
+
+    int t = r / (tile * band_height);
+    int tile_width = std::min(tile, width - t * tile);
+    r -= t * tile * band_height;
+
+    return Vector2i(t * tile + r % tile_width, band * tile + r / tile_width);
+}
+
+//
+// Both curves visit the quadrants of a cell in a fixed order, recursively.
+// Descending from the covering square, the quadrants before the one with
+// pixel i are skipped by their count of pixels inside the grid. Once the
+// cell is entirely inside, the rest of the index is decoded directly, so
+// this takes at most one step per bit of the size, and only along the
+// top and right edge of the grid.
+//
+
+Vector2i PixelOrder::get_curve(int i) const
+{
+    int x0 = 0, y0 = 0;
+    int s = size;
+    int orient = 0;
+
+    while (x0 + s > width || y0 + s > height)
+    {
+        s >>= 1;
+
+        for (int q = 0; q < 4; q++)
+        {
+            int rx, ry;
+            if (type == ORDER_MORTON)
+            {
+                rx = q & 1;
+                ry = q >> 1;
+            }
+            else
+                hilbert_quadrant(q, orient, rx, ry);
+
+            int qx = x0 + rx * s;
+            int qy = y0 + ry * s;
+            int n = overlap(qx, s, width) * overlap(qy, s, height);
+            if (i < n)
+            {
+                x0 = qx;
+                y0 = qy;
+                if (type == ORDER_HILBERT)
+                    orient ^= HILBERT_SUB(q);
+                break;
+            }
+            i -= n;
+        }
+    }
+
+    int x, y;
+    if (type == ORDER_MORTON)
+    {
+        x = compact_bits(i);
+        y = compact_bits(i >> 1);
+    }
+    else
+    {
+        hilbert_decode(__builtin_ctz(s), i, x, y);
+        if (orient & HILBERT_SWAP)
+            std::swap(x, y);
+        if (orient & HILBERT_FLIP)
+        {
+            x = s - 1 - x;
+            y = s - 1 - y;
+        }
+    }
+
+    return Vector2i(x0 + x, y0 + y);
+}
+
+const char* PixelOrder::get_name(Type type)
+{
+    assert((unsigned)type < ORDER_COUNT);
+    return order_names[type];
+}
+
+PixelOrder::Type PixelOrder::parse(const char* name)
+{
+    for (int i = 0; i < ORDER_COUNT; i++)
+        if (!strcmp(name, order_names[i]))
+            return (Type)i;
+
+    throw std::runtime_error(std::string("unknown pixel order ") + name);
+}
@@ -0,0 +1,62 @@
+#ifndef _dn_pixelorder_hpp_
+#define _dn_pixelorder_hpp_
+
+#include "dndefs.hpp"
+#include "vector2.hpp"
+
+namespace dn
+{
+    // Order in which the pixels (or tiles) of a width x height grid are
+    // visited. Index i in 0..width*height-1 maps to a coordinate, computed
+    // on the fly without tables.
+    //
+    //   scanline  rows from bottom to top, left to right
+    //   tiled     tile x tile blocks in scanline order, scanline inside
+    //             each block; blocks at the right and top edge are smaller
+    //   morton    Z-order curve, x in the even bits of the curve index
+    //   hilbert   Hilbert curve, consecutive pixels are neighbours
+    //
+    // Curves are defined on the power of two square covering the grid and
+    // skip the pixels outside of it, so indices stay dense for any size.
+    // Where the curve leaves the grid and comes back, consecutive pixels
+    // are not neighbours: the Hilbert order always steps to a neighbour
+    // only on power of two square grids.
+    class PixelOrder
+    {
+    public:
+        enum Type
+        {
+            ORDER_SCANLINE,
+            ORDER_TILED,
+            ORDER_MORTON,
+            ORDER_HILBERT,
+            ORDER_COUNT
+        };
+
+        PixelOrder(Type type, int width, int height, int tile = 8);
+
+        Type get_type() const { return type; }
+        int get_width() const { return width; }
+        int get_height() const { return height; }
+        int get_count() const { return width * height; }
+
+        Vector2i get_coord(int i) const;
+
+        static const char* get_name(Type type);
+
+        // Type from its name, throws if there is no such order.
+        static Type parse(const char* name);
+
+    private:
+        Vector2i get_tiled(int i) const;
+        Vector2i get_curve(int i) const;
+
+    private:
+        Type type;
+        int width, height;
+        int tile;
+        int size;   // side of the covering power of two square
+    };
+}
+
+#endif
@@ -0,0 +1,412 @@
+#include "plyloader.hpp"
+#include "mappedfile.hpp"
+#include "numparse.hpp"
+#include <stdexcept>
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+using namespace dn;
+
+static const int type_sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+
+static const char* type_names[][2] =
+{
+    { "char", "int8" },
+    { "uchar", "uint8" },
+    { "short", "int16" },
+    { "ushort", "uint16" },
+    { "int", "int32" },
+    { "uint", "uint32" },
+    { "float", "float32" },
+    { "double", "float64" }
+};
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Splits the line at p into words and returns the start of the next line.
+static const char* split_line(const char* p, const char* end, std::vector<std::string>& words)
+{
+    const char* eol = (const char*)memchr(p, '\n', end - p);
+    if (!eol)
+        eol = end;
+
+    words.clear();
+    while (p < eol)
+    {
+        while (p < eol && is_space(*p))
+            p++;
+        const char* w = p;
+        while (p < eol && !is_space(*p))
+            p++;
+        if (p > w)
+            words.push_back(std::string(w, p));
+    }
+
+    return eol < end ? eol + 1 : end;
+}
+
+PlyLoader::PlyLoader(const char* filename, ObjLoader::Consumer* consumer)
+:   filename(filename), consumer(consumer), format(FORMAT_ASCII), vertex_count(0), face_count(0)
+{
+    MappedFile file(filename);
+    const char* p = file.get_data();
+    const char* end = p + file.get_size();
+
+    p = parse_header(p, end);
+    consumer->reserve(vertex_count, face_count);
+
+    for (size_t i = 0; i < elements.size(); i++)
+    {
+        const Element& e = elements[i];
+
+        if (format == FORMAT_ASCII)
+            p = read_ascii(e, p, end);
+        else if (e.name == "vertex" && is_fast_vertex(e))
+            p = read_fast_vertices(e, p, end);
+        else if (e.name == "face" && is_fast_face(e))
+            p = read_fast_faces(e, p, end);
+        else
+            p = read_binary(e, p, end);
+    }
+}
+
+bool PlyLoader::is_ply(const char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (!fp)
+        return false;
+
+    char magic[4];
+    bool ply = fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, "ply", 3) == 0 &&
+            (magic[3] == '\n' || magic[3] == '\r');
+    fclose(fp);
+
+    return ply;
+}
+
+PlyLoader::Type PlyLoader::parse_type(const std::string& name)
+{
+    for (int i = 0; i < (int)DN_ARRAY_LENGTH(type_names); i++)
+        if (name == type_names[i][0] || name == type_names[i][1])
+            return (Type)i;
+
+    throw std::runtime_error("unknown .ply property type " + name);
+}
+
+const char* PlyLoader::parse_header(const char* p, const char* end)
+{
+    std::vector<std::string> words;
+
+    p = split_line(p, end, words);
+    if (words.size() != 1 || words[0] != "ply")
+        throw std::runtime_error(filename + " is not a .ply file");
+
+    bool has_format = false;
+    for (;;)
+    {
+        if (p == end)
+            throw std::runtime_error(filename + ": .ply header has no end");
+
+        p = split_line(p, end, words);
+        if (words.empty() || words[0] == "comment" || words[0] == "obj_info")
+            continue;
+
+        if (words[0] == "end_header")
+            break;
+
+        if (words[0] == "format" && words.size() == 3)
+        {
+            if (words[1] == "ascii")
+                format = FORMAT_ASCII;
+            else if (words[1] == "binary_little_endian")
+                format = FORMAT_BINARY_LITTLE_ENDIAN;
+            else if (words[1] == "binary_big_endian")
+                format = FORMAT_BINARY_BIG_ENDIAN;
+            else
+                throw std::runtime_error(filename + ": unknown .ply format " + words[1]);
+            has_format = true;
+        }
+        else if (words[0] == "element" && words.size() == 3)
+        {
+            Element e;
+            e.name = words[1];
+            e.count = atoi(words[2].c_str());
+            if (e.count < 0)
+                throw std::runtime_error(filename + ": bad .ply element count");
+            elements.push_back(e);
+        }
+        else if (words[0] == "property" && !elements.empty() &&
+                (words.size() == 3 || (words.size() == 5 && words[1] == "list")))
+        {
+            Property prop;
+            prop.list = words.size() == 5;
+            prop.count_type = prop.list ? parse_type(words[2]) : TYPE_UINT8;
+            prop.type = parse_type(words[prop.list ? 3 : 1]);
+            prop.name = words.back();
+            elements.back().properties.push_back(prop);
+        }
+        else
+            throw std::runtime_error(filename + ": bad .ply header line " + words[0]);
+    }
+
+    if (!has_format)
+        throw std::runtime_error(filename + ": .ply header has no format");
+
+    // Positions must be there, faces may not (point clouds).
+    xyz[0] = xyz[1] = xyz[2] = -1;
+    for (size_t i = 0; i < elements.size(); i++)
+    {
+        const Element& e = elements[i];
+        if (e.name == "vertex")
+        {
+            vertex_count = e.count;
+            for (int j = 0; j < (int)e.properties.size(); j++)
+                for (int k = 0; k < 3; k++)
+                    if (!e.properties[j].list && e.properties[j].name == std::string(1, 'x' + k))
+                        xyz[k] = j;
+        }
+        else if (e.name == "face")
+            face_count = e.count;
+    }
+
+    if (xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0)
+        throw std::runtime_error(filename + ": .ply file has no vertex positions");
+
+    return p;
+}
+
+static bool is_vertex_list(const std::string& name)
+{
+    return name == "vertex_indices" || name == "vertex_index";
+}
+
+//
+// Fast paths for binary files in the byte order of this machine.
+//
+
+bool PlyLoader::is_fast_vertex(const Element& e) const
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    return false;
+#endif
+    if (format != FORMAT_BINARY_LITTLE_ENDIAN)
+        return false;
+
+    for (size_t i = 0; i < e.properties.size(); i++)
+        if (e.properties[i].list)
+            return false;
+
+    for (int k = 0; k < 3; k++)
+        if (e.properties[xyz[k]].type != TYPE_FLOAT32)
+            return false;
+
+    return true;
+}
+
+bool PlyLoader::is_fast_face(const Element& e) const
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    return false;
+#endif
+    if (format != FORMAT_BINARY_LITTLE_ENDIAN || e.properties.size() != 1)
+        return false;
+
+    const Property& prop = e.properties[0];
+    return prop.list && is_vertex_list(prop.name) && prop.count_type == TYPE_UINT8 &&
+            (prop.type == TYPE_INT32 || prop.type == TYPE_UINT32);
+}
+
+const char* PlyLoader::read_fast_vertices(const Element& e, const char* p, const char* end)
+{
+    int offset[3];
+    size_t stride = 0;
+    for (int i = 0; i < (int)e.properties.size(); i++)
+    {
+        for (int k = 0; k < 3; k++)
+            if (xyz[k] == i)
+                offset[k] = (int)stride;
+        stride += type_sizes[e.properties[i].type];
+    }
+
+    if ((size_t)(end - p) / stride < (size_t)e.count)
+        throw std::runtime_error(filename + ": .ply file is truncated");
+
+    for (int i = 0; i < e.count; i++, p += stride)
+    {
+        float v[3];
+        for (int k = 0; k < 3; k++)
+            memcpy(&v[k], p + offset[k], sizeof(float));
+        consumer->vertex(Vector3d(v[0], v[1], v[2]));
+    }
+
+    return p;
+}
+
+const char* PlyLoader::read_fast_faces(const Element& e, const char* p, const char* end)
+{
+    for (int i = 0; i < e.count; i++)
+    {
+        if (p == end)
+            throw std::runtime_error(filename + ": .ply file is truncated");
+
+        int n = (unsigned char)*p++;
+        if (end - p < n * 4)
+            throw std::runtime_error(filename + ": .ply file is truncated");
+
+        face.resize(n);
+        for (int j = 0; j < n; j++, p += 4)
+        {
+            int32_t v;
+            memcpy(&v, p, 4);
+            face[j].v = v;
+            face[j].t = -1;
+            face[j].n = -1;
+        }
+        consumer->polygon(face.data(), n, -1);
+    }
+
+    return p;
+}
+
+//
+// General binary and ASCII elements, one value at a time.
+//
+
+double PlyLoader::read_value(const char*& p, const char* end, Type type) const
+{
+    int size = type_sizes[type];
+    if (end - p < size)
+        throw std::runtime_error(filename + ": .ply file is truncated");
+
+    unsigned char b[8];
+    memcpy(b, p, size);
+    p += size;
+
+    bool big_endian = format == FORMAT_BINARY_BIG_ENDIAN;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (big_endian)
+#else
+    if (!big_endian)
+#endif
+        std::reverse(b, b + size);
+
+    switch (type)
+    {
+    case TYPE_INT8:     { int8_t v; memcpy(&v, b, 1); return v; }
+    case TYPE_UINT8:    { uint8_t v; memcpy(&v, b, 1); return v; }
+    case TYPE_INT16:    { int16_t v; memcpy(&v, b, 2); return v; }
+    case TYPE_UINT16:   { uint16_t v; memcpy(&v, b, 2); return v; }
+    case TYPE_INT32:    { int32_t v; memcpy(&v, b, 4); return v; }
+    case TYPE_UINT32:   { uint32_t v; memcpy(&v, b, 4); return v; }
+    case TYPE_FLOAT32:  { float v; memcpy(&v, b, 4); return v; }
+    case TYPE_FLOAT64:  { double v; memcpy(&v, b, 8); return v; }
+    }
+
+    return 0.0;
+}
+
+void PlyLoader::emit_face(const std::vector<double>& list)
+{
+    face.resize(list.size());
+    for (size_t j = 0; j < list.size(); j++)
+    {
+        face[j].v = list[j] >= 0.0 && list[j] <= INT32_MAX ? (int)list[j] : -1;
+        face[j].t = -1;
+        face[j].n = -1;
+    }
+    consumer->polygon(face.data(), (int)face.size(), -1);
+}
+
+const char* PlyLoader::read_binary(const Element& e, const char* p, const char* end)
+{
+    bool is_vertex = e.name == "vertex";
+    bool is_face = e.name == "face";
+
+    std::vector<double> values(e.properties.size());
+    std::vector<double> list;
+
+    for (int i = 0; i < e.count; i++)
+    {
+        for (size_t j = 0; j < e.properties.size(); j++)
+        {
+            const Property& prop = e.properties[j];
+            if (!prop.list)
+            {
+                values[j] = read_value(p, end, prop.type);
+                continue;
+            }
+
+            int n = (int)read_value(p, end, prop.count_type);
+            if (n < 0)
+                throw std::runtime_error(filename + ": bad .ply list length");
+
+            bool keep = is_face && is_vertex_list(prop.name);
+            if (keep)
+                list.resize(n);
+            for (int k = 0; k < n; k++)
+            {
+                double v = read_value(p, end, prop.type);
+                if (keep)
+                    list[k] = v;
+            }
+            if (keep)
+                emit_face(list);
+        }
+
+        if (is_vertex)
+            consumer->vertex(Vector3d(values[xyz[0]], values[xyz[1]], values[xyz[2]]));
+    }
+
+    return p;
+}
+
+const char* PlyLoader::read_ascii(const Element& e, const char* p, const char* end)
+{
+    bool is_vertex = e.name == "vertex";
+    bool is_face = e.name == "face";
+
+    std::vector<double> values(e.properties.size());
+    std::vector<double> list;
+
+    for (int i = 0; i < e.count; i++)
+    {
+        for (size_t j = 0; j < e.properties.size(); j++)
+        {
+            const Property& prop = e.properties[j];
+            int n = 1;
+            if (prop.list)
+            {
+                double count;
+                while (p < end && is_space(*p))
+                    p++;
+                if (!parse_double(p, end, count) || count < 0)
+                    throw std::runtime_error(filename + ": bad .ply list length");
+                n = (int)count;
+            }
+
+            list.resize(n);
+            for (int k = 0; k < n; k++)
+            {
+                while (p < end && is_space(*p))
+                    p++;
+                if (!parse_double(p, end, list[k]))
+                    throw std::runtime_error(filename + ": bad or missing .ply value");
+            }
+
+            if (!prop.list)
+                values[j] = list[0];
+            else if (is_face && is_vertex_list(prop.name))
+                emit_face(list);
+        }
+
+        if (is_vertex)
+            consumer->vertex(Vector3d(values[xyz[0]], values[xyz[1]], values[xyz[2]]));
+    }
+
+    return p;
+}
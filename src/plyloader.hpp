@@ -0,0 +1,95 @@
+#ifndef _dn_plyloader_hpp_
+#define _dn_plyloader_hpp_
+
+#include "dndefs.hpp"
+#include "objloader.hpp"
+#include <vector>
+#include <string>
+
+namespace dn
+{
+    // Stanford .ply reader. Vertex positions and face vertex lists are
+    // passed to an ObjLoader::Consumer, so scans go through the same
+    // triangulation as .obj files; other elements and properties are
+    // skipped. Faces have no material.
+    //
+    // The file is memory mapped. Binary files with little endian float
+    // positions and uchar counted int or uint vertex lists, which is what
+    // the Stanford datasets and most scanners write, are copied out of the
+    // mapping directly. Other types, big endian and ASCII files are
+    // converted value by value.
+    class PlyLoader
+    {
+    public:
+        enum Format
+        {
+            FORMAT_ASCII,
+            FORMAT_BINARY_LITTLE_ENDIAN,
+            FORMAT_BINARY_BIG_ENDIAN
+        };
+
+        // Throws if the file is not a .ply file, has no x, y and z vertex
+        // properties or is truncated.
+        PlyLoader(const char* filename, ObjLoader::Consumer* consumer);
+
+        Format get_format() const { return format; }
+        int get_vertex_count() const { return vertex_count; }
+        int get_face_count() const { return face_count; }
+
+        // True if the file starts like a .ply file.
+        static bool is_ply(const char* filename);
+
+    private:
+        enum Type
+        {
+            TYPE_INT8, TYPE_UINT8, TYPE_INT16, TYPE_UINT16,
+            TYPE_INT32, TYPE_UINT32, TYPE_FLOAT32, TYPE_FLOAT64
+        };
+
+        struct Property
+        {
+            std::string name;
+            Type type;
+            bool list;
+            Type count_type;    // of a list
+        };
+
+        struct Element
+        {
+            std::string name;
+            int count;
+            std::vector<Property> properties;
+        };
+
+        const char* parse_header(const char* p, const char* end);
+        static Type parse_type(const std::string& name);
+
+        const char* read_binary(const Element& e, const char* p, const char* end);
+        const char* read_ascii(const Element& e, const char* p, const char* end);
+        const char* read_fast_vertices(const Element& e, const char* p, const char* end);
+        const char* read_fast_faces(const Element& e, const char* p, const char* end);
+
+        double read_value(const char*& p, const char* end, Type type) const;
+
+        bool is_fast_vertex(const Element& e) const;
+        bool is_fast_face(const Element& e) const;
+
+        void emit_face(const std::vector<double>& list);
+
+    private:
+        std::string filename;
+        ObjLoader::Consumer* consumer;
+
+        Format format;
+        std::vector<Element> elements;
+        int vertex_count;
+        int face_count;
+
+        // Position of x, y and z among the vertex properties.
+        int xyz[3];
+
+        std::vector<ObjLoader::VertexIndices> face;
+    };
+}
+
+#endif
@@ -0,0 +1,308 @@
+#include "progressive.hpp"
+#include "pixelorder.hpp"
+#include "vector2.hpp"
+#include "timer.hpp"
+#include <stdio.h>
+#include <float.h>
+
+using namespace dn;
+
+#define PIXELS_PER_TASK 256
+
+// Rows per task when shading a finished image again.
+#define SHADE_ROWS 16
+
+ProgressiveRenderer::ProgressiveRenderer(FlatBVH* bvh, WorkerPool* pool, int width, int height, int levels)
+:   bvh(bvh), pool(pool), width(width), height(height), levels(levels), shader(bvh),
+    running(false), changed(false), reshade(false), complete(false),
+    shading(Shader::SHADE_NORMAL), samples(shader.get_samples()), area_light(true),
+    display_level(-1), generation(0)
+{
+    // Pass at level L works on a grid where each cell is a 2^L x 2^L block.
+    for (int level = 0; level <= levels; level++)
+    {
+        int s = 1 << level;
+        level_order.push_back(PixelOrder(PixelOrder::ORDER_MORTON, (width + s - 1) / s, (height + s - 1) / s));
+    }
+
+    hits.resize(width * height);
+    result.resize(width * height * 4);
+    display.resize(width * height * 4);
+    memset(display.get_ptr(), 0, display.get_size());
+}
+
+ProgressiveRenderer::~ProgressiveRenderer()
+{
+    stop();
+}
+
+void ProgressiveRenderer::start()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (running)
+        return;
+    running = true;
+    changed = true;
+    thread = std::thread(&ProgressiveRenderer::thread_main, this);
+}
+
+void ProgressiveRenderer::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running)
+            return;
+        running = false;
+        generation++;
+    }
+    cond.notify_all();
+    thread.join();
+}
+
+void ProgressiveRenderer::set_camera(const Matrix4x4f& m)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (to_world == m)
+            return;
+
+        to_world = m;
+        generation++;
+        changed = true;
+        complete = false;
+    }
+    cond.notify_all();
+}
+
+const unsigned char* ProgressiveRenderer::lock()
+{
+    display_mutex.lock();
+    return (const unsigned char*)display.get_ptr();
+}
+
+void ProgressiveRenderer::unlock()
+{
+    display_mutex.unlock();
+}
+
+int ProgressiveRenderer::get_level()
+{
+    std::lock_guard<std::mutex> lock(display_mutex);
+    return display_level;
+}
+
+void ProgressiveRenderer::set_shading(Shader::Mode mode)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (shading == mode)
+            return;
+        shading = mode;
+        request_reshade();
+    }
+    cond.notify_all();
+}
+
+void ProgressiveRenderer::set_samples(int n)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        samples = std::max(n, 1);
+        request_reshade();
+    }
+    cond.notify_all();
+}
+
+void ProgressiveRenderer::set_area_light(bool area)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        area_light = area;
+        request_reshade();
+    }
+    cond.notify_all();
+}
+
+// Called with mutex held.
+void ProgressiveRenderer::request_reshade()
+{
+    reshade = true;
+
+    // Unfinished image is refined from scratch with new settings.
+    if (!complete)
+    {
+        generation++;
+        changed = true;
+    }
+}
+
+Shader::Mode ProgressiveRenderer::get_shading()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return shading;
+}
+
+void ProgressiveRenderer::thread_main()
+{
+    for (;;)
+    {
+        int gen;
+        bool refine;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (running && !changed && !reshade)
+                cond.wait(lock);
+            if (!running)
+                return;
+            refine = changed;
+            changed = false;
+            reshade = false;
+            gen = generation;
+            pass_to_world = to_world;
+            shader.set_mode(shading);
+            shader.set_samples(samples);
+            shader.set_light(shader.get_default_light(area_light));
+            shader.set_camera(pass_to_world);
+        }
+
+        Timer timer;
+
+        if (!refine)
+        {
+            ShadeJob job(this);
+            pool->run(&job, (height + SHADE_ROWS - 1) / SHADE_ROWS);
+
+            std::lock_guard<std::mutex> lock(display_mutex);
+            memcpy(display.get_ptr(), result.get_ptr(), result.get_size());
+            continue;
+        }
+
+        for (int level = levels; level >= 0; level--)
+        {
+            if (!render_pass(level, gen))
+                break;
+
+            if (level == levels)
+                fit_depth_range(level);
+
+            {
+                std::lock_guard<std::mutex> lock(display_mutex);
+                memcpy(display.get_ptr(), result.get_ptr(), result.get_size());
+                display_level = level;
+            }
+
+            if (level == levels)
+                fprintf(stderr, "progressive: first pass took %.2f ms\n", timer.elapsed() * 1000.0);
+            if (level == 0)
+            {
+                fprintf(stderr, "progressive: full resolution took %.2f ms\n", timer.elapsed() * 1000.0);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                complete = generation == gen;
+            }
+        }
+    }
+}
+
+//
+// Depth range for the rest of the passes comes from the cells of the
+// first one. The first pass itself uses the range of the previous image.
+//
+
+void ProgressiveRenderer::fit_depth_range(int level)
+{
+    const PixelOrder& order = level_order[level];
+    float tmin = FLT_MAX;
+    float tmax = -FLT_MAX;
+
+    for (int i = 0; i < get_pass_size(level); i++)
+    {
+        Vector2i c = order.get_coord(i);
+        int p = (c.y << level) * width + (c.x << level);
+        if (hits.id[p] < 0)
+            continue;
+        tmin = std::min(tmin, hits.t[p]);
+        tmax = std::max(tmax, hits.t[p]);
+    }
+
+    if (tmin <= tmax)
+        shader.set_depth_range(tmin, tmax);
+}
+
+void ProgressiveRenderer::shade_rows(int task)
+{
+    int y0 = task * SHADE_ROWS;
+    int y1 = std::min(y0 + SHADE_ROWS, height);
+
+    shader.shade(hits, y0 * width, y1 * width, (unsigned char*)result.get_ptr());
+}
+
+int ProgressiveRenderer::get_pass_size(int level) const
+{
+    int s = 1 << level;
+    return ((width + s - 1) / s) * ((height + s - 1) / s);
+}
+
+bool ProgressiveRenderer::render_pass(int level, int gen)
+{
+    PassJob job(this, level, gen);
+    pool->run(&job, (get_pass_size(level) + PIXELS_PER_TASK - 1) / PIXELS_PER_TASK);
+    return generation == gen;
+}
+
+void ProgressiveRenderer::render_chunk(int level, int gen, int chunk)
+{
+    const PixelOrder& order = level_order[level];
+    int begin = chunk * PIXELS_PER_TASK;
+    int end = std::min(begin + PIXELS_PER_TASK, get_pass_size(level));
+    int s = 1 << level;
+
+    // Trace. Hits are stored in the top left pixel of each block.
+
+    for (int i = begin; i < end; i++)
+    {
+        if (generation.load(std::memory_order_relaxed) != gen)
+            return;
+
+        // Cells with both coordinates even were traced by the previous pass.
+        Vector2i c = order.get_coord(i);
+        if (level < levels && !(c.x & 1) && !(c.y & 1))
+            continue;
+
+        int x = c.x << level;
+        int y = c.y << level;
+
+        float fx = (x + 0.5f) / width * 2.f - 1.f;
+        float fy = (y + 0.5f) / height * 2.f - 1.f;
+
+        Vector3f p0 = (pass_to_world * Vector4f(fx, fy, -1.f, 1.f)).project();
+        Vector3f p1 = (pass_to_world * Vector4f(fx, fy, 1.f, 1.f)).project();
+
+        hits.set(y * width + x, bvh->intersect(p0, p1 - p0));
+    }
+
+    // Shade and fill the blocks to upsample.
+
+    for (int i = begin; i < end; i++)
+    {
+        Vector2i c = order.get_coord(i);
+        if (level < levels && !(c.x & 1) && !(c.y & 1))
+            continue;
+
+        int x = c.x << level;
+        int y = c.y << level;
+
+        uint32_t rgba = shader.shade(hits.get(y * width + x), y * width + x);
+
+        int x1 = std::min(x + s, width);
+        int y1 = std::min(y + s, height);
+        for (int yy = y; yy < y1; yy++)
+        {
+            uint32_t* p = (uint32_t*)result.get_ptr() + yy * width + x;
+            for (int xx = x; xx < x1; xx++)
+                *p++ = rgba;
+        }
+    }
+}
@@ -0,0 +1,119 @@
+#ifndef _dn_progressive_hpp_
+#define _dn_progressive_hpp_
+
+#include "dndefs.hpp"
+#include "matrix4x4.hpp"
+#include "flatbvh.hpp"
+#include "workerpool.hpp"
+#include "hostmemory.hpp"
+#include "hitbuffer.hpp"
+#include "shading.hpp"
+#include "pixelorder.hpp"
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace dn
+{
+    // Progressive CPU ray tracer. Rendering runs on a background thread
+    // in passes from coarse to fine. Pass at level L traces one pixel in
+    // every 2^L x 2^L block, in Z-order, and fills the whole block with it,
+    // so a blocky image is available almost immediately and refined until
+    // full resolution. Changing the camera cancels the passes in flight.
+    // Hits are kept, so changing shading mode of a finished image only
+    // shades it again.
+    class ProgressiveRenderer
+    {
+    public:
+        ProgressiveRenderer(FlatBVH* bvh, WorkerPool* pool, int width, int height, int levels = 4);
+        ~ProgressiveRenderer();
+
+        // Starts and stops the render thread. The worker pool must not be
+        // used by anyone else while started.
+        void start();
+        void stop();
+
+        // Restarts refinement if the camera differs from the current one.
+        void set_camera(const Matrix4x4f& to_world);
+
+        // Latest finished pass, RGBA with rows from bottom to top. Must be
+        // released with unlock().
+        const unsigned char* lock();
+        void unlock();
+
+        // Level of latest finished pass, 0 is full resolution, -1 if none.
+        int get_level();
+
+        void set_shading(Shader::Mode mode);
+        Shader::Mode get_shading();
+
+        // Samples per pixel and light of the shading modes that trace
+        // secondary rays.
+        void set_samples(int n);
+        void set_area_light(bool area);
+
+    private:
+        class PassJob : public WorkerPool::Job
+        {
+        public:
+            PassJob(ProgressiveRenderer* r, int level, int generation)
+            :   r(r), level(level), generation(generation) {}
+            void run(int task, int thread) { r->render_chunk(level, generation, task); }
+        private:
+            ProgressiveRenderer* r;
+            int level;
+            int generation;
+        };
+
+        class ShadeJob : public WorkerPool::Job
+        {
+        public:
+            ShadeJob(ProgressiveRenderer* r) : r(r) {}
+            void run(int task, int thread) { r->shade_rows(task); }
+        private:
+            ProgressiveRenderer* r;
+        };
+
+        void request_reshade();
+        void thread_main();
+        bool render_pass(int level, int generation);
+        void render_chunk(int level, int generation, int chunk);
+        void shade_rows(int task);
+        void fit_depth_range(int level);
+        int get_pass_size(int level) const;
+
+    private:
+        FlatBVH* bvh;
+        WorkerPool* pool;
+        int width, height;
+        int levels;
+
+        std::vector<PixelOrder> level_order;
+        Shader shader;
+        HitBuffer hits;
+        HostMemory result;
+        HostMemory display;
+
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::mutex display_mutex;
+        bool running;
+        bool changed;
+        bool reshade;
+        bool complete;
+        Shader::Mode shading;
+        int samples;
+        bool area_light;
+        int display_level;
+
+        // Bumped on every camera change. Passes of older generations stop.
+        std::atomic<int> generation;
+        Matrix4x4f to_world;
+        Matrix4x4f pass_to_world;
+    };
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _dn_random_hpp_
+#define _dn_random_hpp_
+
+#include "dndefs.hpp"
+#include <stdint.h>
+
+namespace dn
+{
+    // Small and fast PCG32 random number generator. Same seed gives the same
+    // sequence on every platform.
+    class Random
+    {
+    public:
+        Random(uint64_t seed = 0, uint64_t stream = 0)
+        {
+            seed_stream(seed, stream);
+        }
+
+        void seed_stream(uint64_t seed, uint64_t stream)
+        {
+            state = 0;
+            inc = (stream << 1) | 1;
+            next_uint();
+            state += seed;
+            next_uint();
+        }
+
+        uint32_t next_uint()
+        {
+            uint64_t old = state;
+            state = old * 6364136223846793005ULL + inc;
+            uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+            uint32_t rot = (uint32_t)(old >> 59);
+            return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+        }
+
+        // Uniform in [0, 1).
+        float next_float()
+        {
+            return (next_uint() >> 8) * (1.f / 16777216.f);
+        }
+
+    private:
+        uint64_t state;
+        uint64_t inc;
+    };
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef _dn_sampling_hpp_
+#define _dn_sampling_hpp_
+
+#include "dndefs.hpp"
+#include "vector3.hpp"
+#include <cmath>
+#include <stdint.h>
+
+namespace dn
+{
+    // Builds orthonormal basis around unit vector n.
+    inline void make_basis(const Vector3f& n, Vector3f& t, Vector3f& b)
+    {
+        if (std::fabs(n.x) > std::fabs(n.y))
+            t = Vector3f(-n.z, 0.f, n.x) * (1.f / std::sqrt(n.x * n.x + n.z * n.z));
+        else
+            t = Vector3f(0.f, n.z, -n.y) * (1.f / std::sqrt(n.y * n.y + n.z * n.z));
+        b = cross(n, t);
+    }
+
+    // Cosine weighted direction on hemisphere around z axis.
+    inline Vector3f sample_cosine_hemisphere(float u1, float u2)
+    {
+        float r = std::sqrt(u1);
+        float phi = 2.f * 3.14159265f * u2;
+        return Vector3f(r * std::cos(phi), r * std::sin(phi), std::sqrt(std::max(0.f, 1.f - u1)));
+    }
+
+    // Van der Corput sequence in base 2: bits of i mirrored around the
+    // binary point.
+    inline float radical_inverse_2(uint32_t i)
+    {
+        i = (i << 16) | (i >> 16);
+        i = ((i & 0x00FF00FF) << 8) | ((i & 0xFF00FF00) >> 8);
+        i = ((i & 0x0F0F0F0F) << 4) | ((i & 0xF0F0F0F0) >> 4);
+        i = ((i & 0x33333333) << 2) | ((i & 0xCCCCCCCC) >> 2);
+        i = ((i & 0x55555555) << 1) | ((i & 0xAAAAAAAA) >> 1);
+        return (i >> 8) * (1.f / 16777216.f);
+    }
+
+    // Radical inverse in any base, for Halton sequences.
+    inline float radical_inverse(uint32_t i, uint32_t base)
+    {
+        float inv_base = 1.f / base;
+        float f = inv_base;
+        float r = 0.f;
+        while (i)
+        {
+            r += (i % base) * f;
+            i /= base;
+            f *= inv_base;
+        }
+        return std::min(r, 0.99999994f);
+    }
+
+    // Point i of n point Hammersley set. Every one of n equal strips of
+    // the unit square in either direction gets exactly one point.
+    inline void hammersley(uint32_t i, uint32_t n, float& u1, float& u2)
+    {
+        u1 = (i + 0.5f) / n;
+        u2 = radical_inverse_2(i);
+    }
+
+    // Point i of the Halton sequence in bases 2 and 3, for when the
+    // number of samples is not known in advance.
+    inline void halton(uint32_t i, float& u1, float& u2)
+    {
+        u1 = radical_inverse_2(i);
+        u2 = radical_inverse(i, 3);
+    }
+
+    // Cranley-Patterson rotation: shifts a point set by offset modulo 1 so
+    // that neighbouring pixels don't use identical samples while keeping
+    // the stratification.
+    inline float rotate_sample(float u, float offset)
+    {
+        u += offset;
+        return u >= 1.f ? u - 1.f : u;
+    }
+
+    // Cosine weighted direction on hemisphere around unit vector n.
+    inline Vector3f sample_cosine_hemisphere(const Vector3f& n, float u1, float u2)
+    {
+        Vector3f t, b;
+        make_basis(n, t, b);
+        Vector3f s = sample_cosine_hemisphere(u1, u2);
+        return t * s.x + b * s.y + n * s.z;
+    }
+}
+
+#endif
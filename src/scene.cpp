@@ -0,0 +1,443 @@
+#include "scene.hpp"
+#include "objloader.hpp"
+#include "plyloader.hpp"
+#include <stdexcept>
+#include <string>
+#include <memory>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+
+using namespace dn;
+
+//
+// Compiled scene file. A header followed by four sections, each starting
+// on a SECTION_ALIGN boundary:
+//
+//   vertices             float[vertex_count][3]
+//   triangles            uint32_t[triangle_count][3], indices to vertices
+//   primitive materials  int32_t[triangle_count]
+//   materials            material_count records of strings (uint32_t
+//                        length and bytes) and numbers, in the order of
+//                        write_material()
+//
+// Everything is in the byte order of the machine that wrote it, a file
+// from the other order fails the magic check. The header and each section
+// have a checksum. The version changes whenever the layout does.
+//
+
+#define SCENE_MAGIC 0x6E656373u     // "scen"
+#define SCENE_VERSION 2
+
+#define SECTION_ALIGN 64
+
+enum
+{
+    SECTION_VERTICES,
+    SECTION_TRIANGLES,
+    SECTION_PRIMITIVE_MATERIALS,
+    SECTION_MATERIALS,
+    SECTION_COUNT
+};
+
+struct Section
+{
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum;
+};
+
+struct SceneHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vertex_count;
+    uint32_t triangle_count;
+    uint32_t material_count;
+    uint32_t pad;
+    float aabb_min[3];
+    float aabb_max[3];
+    Section sections[SECTION_COUNT];
+    uint64_t checksum;      // of the header up to here
+};
+
+static_assert(sizeof(Vector3f) == 12, "vertices are stored as three floats");
+
+//
+// 64-bit words are hashed in four independent lanes which are combined at
+// the end, fast enough that checking a file costs less than reading it.
+//
+
+#define CHECKSUM_PRIME 0x100000001B3ull
+
+static inline uint64_t mix(uint64_t h, uint64_t w)
+{
+    h = (h ^ w) * CHECKSUM_PRIME;
+    return h ^ (h >> 29);
+}
+
+static uint64_t checksum(const void* data, size_t size)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    uint64_t h[4] = { 0xCBF29CE484222325ull, 1, 2, 3 };
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        uint64_t w[4];
+        memcpy(w, p + i, 32);
+        for (int j = 0; j < 4; j++)
+            h[j] = mix(h[j], w[j]);
+    }
+
+    uint64_t last[4] = { 0, 0, 0, 0 };
+    if (size > i)
+        memcpy(last, p + i, size - i);
+    for (int j = 0; j < 4; j++)
+        h[j] = mix(h[j], last[j]);
+
+    return mix(mix(mix(mix(h[0], h[1]), h[2]), h[3]), size);
+}
+
+static size_t align_up(size_t n)
+{
+    return (n + SECTION_ALIGN - 1) / SECTION_ALIGN * SECTION_ALIGN;
+}
+
+static void write_string(std::string& out, const std::string& s)
+{
+    uint32_t n = (uint32_t)s.size();
+    out.append((const char*)&n, sizeof(n));
+    out.append(s);
+}
+
+template<typename T>
+static void write_value(std::string& out, const T& v)
+{
+    out.append((const char*)&v, sizeof(v));
+}
+
+static void write_material(std::string& out, const Scene::Material& m)
+{
+    write_string(out, m.name);
+    write_string(out, m.ambientMap);
+    write_string(out, m.diffuseMap);
+    write_string(out, m.specularMap);
+    write_string(out, m.emissionMap);
+    write_string(out, m.bumpMap);
+    write_value(out, (int32_t)m.illum);
+    write_value(out, m.ambient);
+    write_value(out, m.diffuse);
+    write_value(out, m.specular);
+    write_value(out, m.emission);
+    write_value(out, m.shininess);
+    write_value(out, m.d);
+}
+
+// Reads the materials section, throws if it runs out.
+class MaterialReader
+{
+public:
+    MaterialReader(const char* p, size_t size) : p(p), end(p + size) {}
+
+    void read(Scene::Material& m)
+    {
+        read_string(m.name);
+        read_string(m.ambientMap);
+        read_string(m.diffuseMap);
+        read_string(m.specularMap);
+        read_string(m.emissionMap);
+        read_string(m.bumpMap);
+        int32_t illum;
+        read_value(illum);
+        m.illum = illum;
+        read_value(m.ambient);
+        read_value(m.diffuse);
+        read_value(m.specular);
+        read_value(m.emission);
+        read_value(m.shininess);
+        read_value(m.d);
+    }
+
+private:
+    void need(size_t n)
+    {
+        if ((size_t)(end - p) < n)
+            throw std::runtime_error("corrupt scene file");
+    }
+
+    void read_string(std::string& s)
+    {
+        uint32_t n;
+        read_value(n);
+        need(n);
+        s.assign(p, n);
+        p += n;
+    }
+
+    template<typename T>
+    void read_value(T& v)
+    {
+        need(sizeof(v));
+        memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+    }
+
+private:
+    const char* p;
+    const char* end;
+};
+
+Scene::Scene(const char* filename)
+:   material_data(0), file(0)
+{
+    if (is_compiled(filename))
+    {
+        load_compiled(filename);
+        return;
+    }
+
+    if (PlyLoader::is_ply(filename))
+        load_ply(filename);
+    else
+        load_obj(filename);
+
+    mesh = TriangleMesh(vertices.data(), (int)vertices.size(), indices.data(), (int)indices.size() / 3);
+    material_data = primitive_materials.data();
+
+    for (int i = 0; i < mesh.get_triangle_count(); i++)
+        aabb.grow(mesh.get_aabb(i));
+}
+
+Scene::~Scene()
+{
+    delete file;
+}
+
+//
+// Polygons are triangulated as the file is parsed, so the whole .obj file
+// is never held as polygons. The double precision vertices are only kept
+// until the end for the degenerate triangle test.
+//
+
+class SceneBuilder : public ObjLoader::Consumer
+{
+public:
+    SceneBuilder(const char* filename, std::vector<Vector3f>& vertices,
+            std::vector<uint32_t>& indices, std::vector<int>& materials)
+    :   filename(filename), vertices(vertices), indices(indices), materials(materials)
+    {
+    }
+
+    // Polygons are mostly triangles.
+    void reserve(int vertex_count, int polygon_count)
+    {
+        obj_vertices.reserve(vertex_count);
+        vertices.reserve(vertex_count);
+        indices.reserve(polygon_count * (size_t)3);
+        materials.reserve(polygon_count);
+    }
+
+    void vertex(const Vector3d& v)
+    {
+        if (obj_vertices.size() == UINT32_MAX)
+            throw std::runtime_error(std::string("too many vertices in ") + filename);
+
+        obj_vertices.push_back(v);
+        vertices.push_back(convert_to<float>(v));
+    }
+
+    void polygon(const ObjLoader::VertexIndices* vi, int count, int material)
+    {
+        for (int i = 0; i < count; i++)
+            if (vi[i].v < 0 || vi[i].v >= (int)obj_vertices.size())
+                throw std::runtime_error(std::string("vertex index out of range in ") + filename);
+
+        for (int j = 2; j < count; j++)
+        {
+            Vector3i t;
+            t.x = vi[0].v;
+            t.y = vi[j-1].v;
+            t.z = vi[j].v;
+
+            Vector3d v0 = obj_vertices[t.x];
+            Vector3d v1 = obj_vertices[t.y];
+            Vector3d v2 = obj_vertices[t.z];
+
+            // Remove degenerate triangles.
+            if (cross(v1 - v0, v2 - v0).length() < 0.00001)
+                continue;
+
+            indices.push_back(t.x);
+            indices.push_back(t.y);
+            indices.push_back(t.z);
+            materials.push_back(material);
+        }
+    }
+
+private:
+    const char* filename;
+    std::vector<Vector3f>& vertices;
+    std::vector<uint32_t>& indices;
+    std::vector<int>& materials;
+    std::vector<Vector3d> obj_vertices;
+};
+
+void Scene::load_obj(const char* filename)
+{
+    SceneBuilder builder(filename, vertices, indices, primitive_materials);
+    ObjLoader obj(filename, &builder);
+    materials = obj.materials;
+}
+
+void Scene::load_ply(const char* filename)
+{
+    SceneBuilder builder(filename, vertices, indices, primitive_materials);
+    PlyLoader ply(filename, &builder);
+}
+
+bool Scene::is_compiled(const char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (!fp)
+        return false;
+
+    uint32_t magic = 0;
+    bool compiled = fread(&magic, sizeof(magic), 1, fp) == 1 && magic == SCENE_MAGIC;
+    fclose(fp);
+
+    return compiled;
+}
+
+void Scene::load_compiled(const char* filename)
+{
+    // Owned here until the file checks out, a throw unmaps it. The checks
+    // read it front to back while the prefetch thread maps it in ahead.
+    std::unique_ptr<MappedFile> mapped(new MappedFile(filename, MappedFile::ACCESS_SEQUENTIAL));
+    mapped->prefetch();
+    const char* data = mapped->get_data();
+    size_t size = mapped->get_size();
+
+    std::string what = std::string("scene file ") + filename;
+
+    SceneHeader h;
+    if (size < sizeof(h))
+        throw std::runtime_error(what + " is truncated");
+    memcpy(&h, data, sizeof(h));
+
+    if (h.magic != SCENE_MAGIC)
+        throw std::runtime_error(what + " is not a compiled scene");
+    if (h.version != SCENE_VERSION)
+        throw std::runtime_error(what + " is of another version, convert it again");
+    if (h.checksum != checksum(&h, offsetof(SceneHeader, checksum)))
+        throw std::runtime_error(what + " has a bad header checksum");
+
+    for (int i = 0; i < SECTION_COUNT; i++)
+    {
+        const Section& s = h.sections[i];
+        if (s.offset % SECTION_ALIGN || s.offset > size || s.size > size - s.offset)
+            throw std::runtime_error(what + " is truncated");
+        if (s.checksum != checksum(data + s.offset, s.size))
+            throw std::runtime_error(what + " has a bad checksum");
+    }
+
+    if (h.sections[SECTION_VERTICES].size != (uint64_t)h.vertex_count * sizeof(Vector3f) ||
+            h.sections[SECTION_TRIANGLES].size != (uint64_t)h.triangle_count * 3 * sizeof(uint32_t) ||
+            h.sections[SECTION_PRIMITIVE_MATERIALS].size != (uint64_t)h.triangle_count * sizeof(int32_t) ||
+            h.vertex_count > INT_MAX || h.triangle_count > INT_MAX / 3)
+        throw std::runtime_error(what + " is corrupt");
+
+    mesh = TriangleMesh((const Vector3f*)(data + h.sections[SECTION_VERTICES].offset), h.vertex_count,
+            (const uint32_t*)(data + h.sections[SECTION_TRIANGLES].offset), h.triangle_count);
+    material_data = (const int*)(data + h.sections[SECTION_PRIMITIVE_MATERIALS].offset);
+
+    const uint32_t* tri = mesh.get_indices();
+    for (size_t i = 0; i < (size_t)h.triangle_count * 3; i++)
+        if (tri[i] >= h.vertex_count)
+            throw std::runtime_error(what + " is corrupt");
+
+    const Section& ms = h.sections[SECTION_MATERIALS];
+    MaterialReader reader(data + ms.offset, ms.size);
+    materials.resize(h.material_count);
+    for (uint32_t i = 0; i < h.material_count; i++)
+        reader.read(materials[i]);
+
+    for (int i = 0; i < mesh.get_triangle_count(); i++)
+        if (material_data[i] < -1 || material_data[i] >= (int)materials.size())
+            throw std::runtime_error(what + " is corrupt");
+
+    aabb = AABBf(Vector3f(h.aabb_min[0], h.aabb_min[1], h.aabb_min[2]),
+            Vector3f(h.aabb_max[0], h.aabb_max[1], h.aabb_max[2]));
+
+    // Traversal reads it at random, read-ahead would only waste memory.
+    mapped->advise(MappedFile::ACCESS_RANDOM);
+    file = mapped.release();
+}
+
+void Scene::save(const char* filename) const
+{
+    std::string material_bytes;
+    for (size_t i = 0; i < materials.size(); i++)
+        write_material(material_bytes, materials[i]);
+
+    int triangles = mesh.get_triangle_count();
+    const void* section_data[SECTION_COUNT] = {
+        mesh.get_vertices(), mesh.get_indices(), material_data, material_bytes.data()
+    };
+    size_t section_size[SECTION_COUNT] = {
+        mesh.get_vertex_count() * sizeof(Vector3f),
+        triangles * 3 * sizeof(uint32_t),
+        triangles * sizeof(int32_t),
+        material_bytes.size()
+    };
+
+    SceneHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = SCENE_MAGIC;
+    h.version = SCENE_VERSION;
+    h.vertex_count = mesh.get_vertex_count();
+    h.triangle_count = triangles;
+    h.material_count = (uint32_t)materials.size();
+    for (int i = 0; i < 3; i++)
+    {
+        h.aabb_min[i] = aabb.min[i];
+        h.aabb_max[i] = aabb.max[i];
+    }
+
+    size_t offset = align_up(sizeof(h));
+    for (int i = 0; i < SECTION_COUNT; i++)
+    {
+        h.sections[i].offset = offset;
+        h.sections[i].size = section_size[i];
+        h.sections[i].checksum = checksum(section_data[i], section_size[i]);
+        offset = align_up(offset + section_size[i]);
+    }
+    h.checksum = checksum(&h, offsetof(SceneHeader, checksum));
+
+    // Written under a temporary name and renamed, so that a failed write
+    // never leaves a file that looks like a scene.
+    std::string tmp = std::string(filename) + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+        throw std::runtime_error(std::string("can't create ") + tmp);
+
+    static const char zeros[SECTION_ALIGN] = { 0 };
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    size_t pos = sizeof(h);
+    for (int i = 0; i < SECTION_COUNT && ok; i++)
+    {
+        size_t pad = h.sections[i].offset - pos;
+        ok = fwrite(zeros, 1, pad, fp) == pad &&
+                fwrite(section_data[i], 1, section_size[i], fp) == section_size[i];
+        pos = h.sections[i].offset + section_size[i];
+    }
+
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), filename) < 0)
+    {
+        remove(tmp.c_str());
+        throw std::runtime_error(std::string("can't write ") + filename);
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef _dn_scene_hpp_
+#define _dn_scene_hpp_
+
+#include "dndefs.hpp"
+#include "primitive.hpp"
+#include "trianglemesh.hpp"
+#include "objloader.hpp"
+#include "mappedfile.hpp"
+#include <vector>
+
+namespace dn
+{
+    // Triangulated scene ready for BVH build. Polygons are fan
+    // triangulated and degenerate triangles removed. Triangles are kept as
+    // an indexed mesh sharing the vertices of the file.
+    //
+    // The scene is read from an .obj or .ply file or from a compiled
+    // scene file written by save(), which are recognized by their
+    // contents. A compiled scene is memory mapped and its vertices,
+    // triangles and material ids are used in place, so loading it costs
+    // little more than faulting in the pages.
+    class Scene
+    {
+    public:
+        typedef ObjLoader::Material Material;
+
+        // Throws if the file can't be read, or if a compiled scene is of
+        // another version or fails its checksums.
+        Scene(const char* filename);
+        ~Scene();
+
+        const TriangleMesh& get_mesh() const { return mesh; }
+
+        int get_primitive_count() const { return mesh.get_triangle_count(); }
+        Primitive get_primitive(int i) const { return mesh.get_primitive(i); }
+
+        // Index to materials or -1.
+        int get_primitive_material(int i) const { return material_data[i]; }
+        const std::vector<Material>& get_materials() const { return materials; }
+
+        const AABBf& get_aabb() const { return aabb; }
+
+        // True if loaded from a compiled scene.
+        bool is_compiled() const { return file != 0; }
+
+        // Writes a compiled scene.
+        void save(const char* filename) const;
+
+        // True if the file starts like a compiled scene.
+        static bool is_compiled(const char* filename);
+
+    private:
+        Scene(const Scene&);
+        Scene& operator=(const Scene&);
+
+        void load_obj(const char* filename);
+        void load_ply(const char* filename);
+        void load_compiled(const char* filename);
+
+    private:
+        std::vector<Vector3f> vertices;
+        std::vector<uint32_t> indices;
+        std::vector<int> primitive_materials;
+        std::vector<Material> materials;
+        AABBf aabb;
+
+        // Point to the vectors, or into the mapped file.
+        TriangleMesh mesh;
+        const int* material_data;
+
+        MappedFile* file;
+    };
+}
+
+#endif
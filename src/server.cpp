@@ -0,0 +1,851 @@
+//
+// Render server. Keeps scenes and their BVHs resident and answers render
+// and ray queries over a local socket, so a request costs the trace and
+// not the scene load, triangulation and BVH build.
+//
+// Each connection has a reader thread that queues requests as they come
+// in, so a client may send any number of requests without waiting for
+// the answers. A single render thread serves the queue in order with the
+// worker pool and sends each answer back on its connection. Queue wait,
+// service and send time of every request are recorded and printed per
+// connection when it closes and for the whole server every few seconds.
+//
+// Protocol (messages as in net.hpp, host byte order):
+//
+//   LOAD    scene path                 -> LOADED  LoadedMessage
+//   RENDER  RenderRequest              -> FRAME   FrameMessage, pixels
+//   RAYS    RayRequest, rays           -> HITS    FrameMessage, hits
+//   any request that fails             -> ERROR   request id, text
+//
+// Pixels are RGBA with rows from bottom to top. Hits are arrays of
+// primitive id (-1 for miss), t, u and v, one entry per pixel or ray.
+// A ray is origin, direction and tmax as 7 floats.
+//
+// The same program works as a client for testing and measurements:
+// it sends requests for the cameras with a given number in flight and
+// reports request latency and rate.
+//
+
+#include "net.hpp"
+#include "scene.hpp"
+#include "bvhrt.hpp"
+#include "flatbvh.hpp"
+#include "camera.hpp"
+#include "image.hpp"
+#include "workerpool.hpp"
+#include "tilerenderer.hpp"
+#include "stats.hpp"
+#include "timer.hpp"
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+using namespace dn;
+
+#define DEFAULT_ADDRESS "unix:/tmp/gpurt-server.sock"
+
+// Seconds between server wide statistics.
+#define STATS_INTERVAL 5.0
+
+#define MAX_PIXELS (1 << 24)
+#define MAX_RAYS (1 << 24)
+
+#define RAYS_PER_TASK 1024
+
+// Renderers kept for the most recently used scene and frame sizes. Each
+// holds the buffers of a frame, 44 bytes per pixel.
+#define MAX_RENDERERS 4
+
+enum MessageType
+{
+    MSG_LOAD = 1,
+    MSG_LOADED,
+    MSG_RENDER,
+    MSG_FRAME,
+    MSG_RAYS,
+    MSG_HITS,
+    MSG_ERROR,
+
+    // Queued by a reader thread when its connection closes.
+    MSG_CLOSED = 100
+};
+
+enum Output
+{
+    OUTPUT_RGBA,
+    OUTPUT_HITS
+};
+
+struct LoadedMessage
+{
+    int32_t scene;
+    int32_t triangles;
+    float load_time;    // zero if the scene was already resident
+    float build_time;
+};
+
+struct RenderRequest
+{
+    uint32_t id;
+    int32_t scene;
+    int32_t width;
+    int32_t height;
+    int32_t output;
+    int32_t mode;       // Shader::Mode for OUTPUT_RGBA
+    int32_t samples;    // for ao and shadow, 0 for default
+    float to_world[16];
+};
+
+struct RayRequest
+{
+    uint32_t id;
+    int32_t scene;
+    int32_t count;
+    int32_t any_hit;    // only id is meaningful, 0 if occluded
+};
+
+// Times are seconds spent in the server queue and rendering.
+struct FrameMessage
+{
+    uint32_t id;
+    int32_t width;
+    int32_t height;
+    int32_t output;
+    float queue_time;
+    float render_time;
+};
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: gpurt-server [options]\n"
+        "       gpurt-server -C [options] scene.obj camera.txt...\n"
+        "  -a address   host:port or unix:path (" DEFAULT_ADDRESS ")\n"
+        "  -t threads   worker threads of the server (one per core)\n"
+        "client options:\n"
+        "  -C           run as a client of the server at address\n"
+        "  -w width     image width (1024)\n"
+        "  -h height    image height (768)\n"
+        "  -s mode      shading mode, hits for hit arrays or rays for a ray query of\n"
+        "               the primary rays (normal)\n"
+        "  -n samples   samples per pixel for ao and shadow (4)\n"
+        "  -r requests  requests to send, cycling through the cameras (one per camera)\n"
+        "  -d depth     requests in flight (1)\n"
+        "  -o prefix    write frames as <prefix>NNNN.ppm\n");
+    exit(1);
+}
+
+static void send_error(Socket* s, uint32_t id, const std::string& text)
+{
+    send_message(s, MSG_ERROR, &id, sizeof(id), text.c_str(), text.size());
+}
+
+//
+// Server
+//
+
+struct Latency
+{
+    Samples queue;      // received to start of service
+    Samples service;    // load, render or trace
+    Samples send;       // answer written to socket
+    Samples total;      // received to answer sent
+
+    void add(double q, double s, double w)
+    {
+        queue.add(q);
+        service.add(s);
+        send.add(w);
+        total.add(q + s + w);
+    }
+
+    void clear()
+    {
+        queue.clear();
+        service.clear();
+        send.clear();
+        total.clear();
+    }
+
+    void print(const char* what) const;
+};
+
+void Latency::print(const char* what) const
+{
+    if (total.empty())
+        return;
+
+    fprintf(stderr, "%s: %d requests, ms p50/p95/p99\n", what, total.count());
+
+    const Samples* s[] = { &queue, &service, &send, &total };
+    const char* names[] = { "queue", "service", "send", "total" };
+    for (int i = 0; i < 4; i++)
+        fprintf(stderr, "  %-8s %8.2f %8.2f %8.2f\n", names[i], s[i]->median() * 1000.0,
+                s[i]->percentile(95.0) * 1000.0, s[i]->percentile(99.0) * 1000.0);
+}
+
+class Server
+{
+public:
+    Server(const char* address, int threads);
+    ~Server();
+
+    // Accepts connections until the process is killed.
+    void run();
+
+private:
+    struct Connection
+    {
+        Socket* socket;
+        int id;
+        Latency latency;
+
+        ~Connection() { delete socket; }
+    };
+
+    struct Request
+    {
+        std::shared_ptr<Connection> conn;
+        uint32_t type;
+        std::vector<char> data;
+        double recv_time;
+    };
+
+    struct RendererEntry
+    {
+        int scene;
+        int width;
+        int height;
+        TileRenderer* renderer;
+    };
+
+    struct SceneData
+    {
+        std::string path;
+        Scene* scene;
+        BVHRT* bvhrt;
+        FlatBVH* flatbvh;
+    };
+
+    class RayJob : public WorkerPool::Job
+    {
+    public:
+        RayJob(FlatBVH* bvh, const float* rays, int count, bool any_hit, char* out)
+        :   bvh(bvh), rays(rays), count(count), any_hit(any_hit), out(out) {}
+        void run(int task, int thread);
+    private:
+        FlatBVH* bvh;
+        const float* rays;
+        int count;
+        bool any_hit;
+        char* out;
+    };
+
+    void read_loop(std::shared_ptr<Connection> conn);
+    void render_loop();
+    void serve(Request* r);
+
+    void load(Request* r);
+    void render(Request* r);
+    void trace(Request* r);
+    void reply(Request* r, uint32_t type, const void* head, uint32_t head_size, const void* data, uint32_t size);
+
+    SceneData* get_scene(int id);
+    TileRenderer* get_renderer(int scene, int width, int height);
+
+private:
+    Socket* listener;
+    WorkerPool pool;
+    std::thread render_thread;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Request*> queue;
+
+    // Render thread only.
+    std::vector<SceneData> scenes;
+    std::list<RendererEntry> renderers;     // most recently used first
+    double start_time;
+    std::vector<char> result;
+    Latency latency;
+    double last_stats;
+
+    int connections;
+};
+
+Server::Server(const char* address, int threads)
+:   listener(Socket::listen(address)), pool(threads), last_stats(get_time()), connections(0)
+{
+    fprintf(stderr, "listening on %s, %d threads\n", address, pool.get_thread_count());
+    render_thread = std::thread(&Server::render_loop, this);
+}
+
+Server::~Server()
+{
+    // run() doesn't return, this is only reached on errors.
+    render_thread.detach();
+    delete listener;
+}
+
+void Server::run()
+{
+    while (true)
+    {
+        std::shared_ptr<Connection> conn(new Connection);
+        conn->socket = listener->accept();
+        conn->id = connections++;
+
+        fprintf(stderr, "connection %d opened\n", conn->id);
+        std::thread(&Server::read_loop, this, conn).detach();
+    }
+}
+
+void Server::read_loop(std::shared_ptr<Connection> conn)
+{
+    while (true)
+    {
+        Request* r = new Request;
+        r->conn = conn;
+
+        bool ok;
+        try
+        {
+            ok = recv_message(conn->socket, r->type, r->data);
+        }
+        catch (const std::exception& e)
+        {
+            fprintf(stderr, "connection %d: %s\n", conn->id, e.what());
+            ok = false;
+        }
+
+        if (!ok)
+        {
+            r->type = MSG_CLOSED;
+            r->data.clear();
+        }
+        r->recv_time = get_time();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(r);
+        }
+        cond.notify_one();
+
+        if (!ok)
+            return;
+    }
+}
+
+void Server::render_loop()
+{
+    while (true)
+    {
+        Request* r;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (queue.empty())
+                cond.wait(lock);
+            r = queue.front();
+            queue.pop_front();
+        }
+
+        serve(r);
+        delete r;
+
+        if (get_time() - last_stats > STATS_INTERVAL)
+        {
+            latency.print("server");
+            latency.clear();
+            last_stats = get_time();
+        }
+    }
+}
+
+void Server::serve(Request* r)
+{
+    start_time = get_time();
+
+    uint32_t id = 0;
+    if ((r->type == MSG_RENDER || r->type == MSG_RAYS) && r->data.size() >= sizeof(id))
+        memcpy(&id, &r->data[0], sizeof(id));
+
+    try
+    {
+        switch (r->type)
+        {
+        case MSG_LOAD: load(r); break;
+        case MSG_RENDER: render(r); break;
+        case MSG_RAYS: trace(r); break;
+        case MSG_CLOSED:
+            fprintf(stderr, "connection %d closed\n", r->conn->id);
+            r->conn->latency.print("  connection");
+            break;
+        default: throw std::runtime_error("unknown request");
+        }
+    }
+    catch (const std::exception& e)
+    {
+        // A closed connection shows up as an error on send, the reader
+        // thread queues the close.
+        try
+        {
+            send_error(r->conn->socket, id, e.what());
+        }
+        catch (const std::exception&)
+        {
+        }
+    }
+}
+
+void Server::reply(Request* r, uint32_t type, const void* head, uint32_t head_size, const void* data, uint32_t size)
+{
+    double end = get_time();
+    send_message(r->conn->socket, type, head, head_size, data, size);
+    double sent = get_time();
+
+    r->conn->latency.add(start_time - r->recv_time, end - start_time, sent - end);
+    latency.add(start_time - r->recv_time, end - start_time, sent - end);
+}
+
+Server::SceneData* Server::get_scene(int id)
+{
+    if (id < 0 || id >= (int)scenes.size())
+        throw std::runtime_error("no such scene");
+    return &scenes[id];
+}
+
+TileRenderer* Server::get_renderer(int scene, int width, int height)
+{
+    for (std::list<RendererEntry>::iterator i = renderers.begin(); i != renderers.end(); ++i)
+        if (i->scene == scene && i->width == width && i->height == height)
+        {
+            renderers.splice(renderers.begin(), renderers, i);
+            return i->renderer;
+        }
+
+    RendererEntry e;
+    e.scene = scene;
+    e.width = width;
+    e.height = height;
+    e.renderer = new TileRenderer(get_scene(scene)->flatbvh, &pool, width, height);
+    renderers.push_front(e);
+
+    if ((int)renderers.size() > MAX_RENDERERS)
+    {
+        delete renderers.back().renderer;
+        renderers.pop_back();
+
+        // Frame buffers come from the heap, give the freed ones back.
+        malloc_trim(0);
+    }
+
+    return e.renderer;
+}
+
+void Server::load(Request* r)
+{
+    std::string name(r->data.begin(), r->data.end());
+
+    char path[PATH_MAX];
+    if (!realpath(name.c_str(), path))
+        throw std::runtime_error("can't find " + name);
+
+    LoadedMessage loaded;
+    loaded.load_time = 0.f;
+    loaded.build_time = 0.f;
+    loaded.scene = -1;
+
+    for (int i = 0; i < (int)scenes.size(); i++)
+        if (scenes[i].path == path)
+            loaded.scene = i;
+
+    if (loaded.scene < 0)
+    {
+        SceneData s;
+        s.path = path;
+
+        Timer timer;
+        s.scene = new Scene(path);
+        loaded.load_time = timer.elapsed();
+
+        timer.start();
+        s.bvhrt = new BVHRT(s.scene->get_mesh());
+        s.flatbvh = new FlatBVH(s.bvhrt);
+        loaded.build_time = timer.elapsed();
+
+        loaded.scene = (int)scenes.size();
+        scenes.push_back(s);
+
+        fprintf(stderr, "scene %d: %s, load %.2f ms, build %.2f ms\n", loaded.scene, path,
+                loaded.load_time * 1000.0, loaded.build_time * 1000.0);
+    }
+
+    loaded.triangles = scenes[loaded.scene].scene->get_primitive_count();
+    reply(r, MSG_LOADED, &loaded, sizeof(loaded), 0, 0);
+}
+
+void Server::render(Request* r)
+{
+    if (r->data.size() != sizeof(RenderRequest))
+        throw std::runtime_error("bad render request");
+
+    RenderRequest req;
+    memcpy(&req, &r->data[0], sizeof(req));
+
+    if (req.width <= 0 || req.height <= 0 || req.width * (int64_t)req.height > MAX_PIXELS)
+        throw std::runtime_error("bad resolution");
+    if (req.output != OUTPUT_RGBA && req.output != OUTPUT_HITS)
+        throw std::runtime_error("bad output");
+    if (req.output == OUTPUT_RGBA && (req.mode < 0 || req.mode >= Shader::SHADE_MODE_COUNT))
+        throw std::runtime_error("bad shading mode");
+
+    TileRenderer* renderer = get_renderer(req.scene, req.width, req.height);
+    int n = req.width * req.height;
+
+    FrameMessage frame;
+    frame.id = req.id;
+    frame.width = req.width;
+    frame.height = req.height;
+    frame.output = req.output;
+    frame.queue_time = start_time - r->recv_time;
+
+    if (req.output == OUTPUT_RGBA)
+    {
+        Shader& shader = renderer->get_shader();
+        shader.set_mode((Shader::Mode)req.mode);
+        shader.set_samples(req.samples > 0 ? req.samples : 4);
+
+        renderer->render(Matrix4x4f(req.to_world));
+
+        frame.render_time = get_time() - start_time;
+        reply(r, MSG_FRAME, &frame, sizeof(frame), renderer->get_buffer(), n * 4);
+        return;
+    }
+
+    // Hits only, id is the cheapest mode to shade.
+    renderer->set_shading(Shader::SHADE_ID);
+    renderer->render(Matrix4x4f(req.to_world));
+
+    const HitBuffer& hits = renderer->get_hits();
+    result.resize(n * 16);
+    memcpy(&result[0], &hits.id[0], n * 4);
+    memcpy(&result[n * 4], &hits.t[0], n * 4);
+    memcpy(&result[n * 8], &hits.u[0], n * 4);
+    memcpy(&result[n * 12], &hits.v[0], n * 4);
+
+    frame.render_time = get_time() - start_time;
+    reply(r, MSG_FRAME, &frame, sizeof(frame), &result[0], n * 16);
+}
+
+void Server::RayJob::run(int task, int thread)
+{
+    int begin = task * RAYS_PER_TASK;
+    int end = std::min(begin + RAYS_PER_TASK, count);
+
+    int* id = (int*)out;
+    float* t = (float*)(out + count * 4);
+    float* u = (float*)(out + count * 8);
+    float* v = (float*)(out + count * 12);
+
+    for (int i = begin; i < end; i++)
+    {
+        const float* r = rays + i * 7;
+        Vector3f o(r[0], r[1], r[2]);
+        Vector3f d(r[3], r[4], r[5]);
+
+        if (any_hit)
+        {
+            id[i] = bvh->occluded(o, d, r[6]) ? 0 : -1;
+            t[i] = u[i] = v[i] = 0.f;
+            continue;
+        }
+
+        BVHRT::Intersection is = bvh->intersect(o, d);
+        if (is.id >= 0 && is.t > r[6])
+            is.id = -1;
+
+        id[i] = is.id;
+        t[i] = is.t;
+        u[i] = is.u;
+        v[i] = is.v;
+    }
+}
+
+void Server::trace(Request* r)
+{
+    if (r->data.size() < sizeof(RayRequest))
+        throw std::runtime_error("bad ray request");
+
+    RayRequest req;
+    memcpy(&req, &r->data[0], sizeof(req));
+
+    if (req.count < 0 || req.count > MAX_RAYS ||
+            r->data.size() != sizeof(req) + req.count * 7 * sizeof(float))
+        throw std::runtime_error("bad ray count");
+
+    SceneData* scene = get_scene(req.scene);
+    int n = req.count;
+
+    result.resize(n * 16 + 1);
+
+    RayJob job(scene->flatbvh, (const float*)&r->data[sizeof(req)], n, req.any_hit != 0, &result[0]);
+    pool.run(&job, (n + RAYS_PER_TASK - 1) / RAYS_PER_TASK);
+
+    FrameMessage hits;
+    hits.id = req.id;
+    hits.width = n;
+    hits.height = 1;
+    hits.output = OUTPUT_HITS;
+    hits.queue_time = start_time - r->recv_time;
+    hits.render_time = get_time() - start_time;
+    reply(r, MSG_HITS, &hits, sizeof(hits), &result[0], n * 16);
+}
+
+static int run_server(const char* address, int threads)
+{
+    Server server(address, threads);
+    server.run();
+    return 0;
+}
+
+//
+// Client
+//
+
+struct ClientOptions
+{
+    const char* address;
+    int width;
+    int height;
+    int output;
+    Shader::Mode mode;
+    bool rays;
+    int samples;
+    int requests;
+    int depth;
+    const char* prefix;
+};
+
+static void expect(Socket* s, uint32_t want, std::vector<char>& msg)
+{
+    uint32_t type;
+    if (!recv_message(s, type, msg))
+        throw std::runtime_error("server closed the connection");
+    if (type == MSG_ERROR)
+        throw std::runtime_error("server: " + std::string(msg.begin() + 4, msg.end()));
+    if (type != want)
+        throw std::runtime_error("unexpected answer from server");
+}
+
+// Primary rays of a frame as sent in a ray query.
+static void make_rays(const Matrix4x4f& to_world, int width, int height, std::vector<float>& rays)
+{
+    rays.resize(width * height * 7);
+    float* r = &rays[0];
+
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++, r += 7)
+        {
+            float fx = (x + 0.5f) / width * 2.f - 1.f;
+            float fy = (y + 0.5f) / height * 2.f - 1.f;
+
+            Vector3f p0 = (to_world * Vector4f(fx, fy, -1.f, 1.f)).project();
+            Vector3f p1 = (to_world * Vector4f(fx, fy, 1.f, 1.f)).project();
+            Vector3f d = p1 - p0;
+
+            r[0] = p0.x; r[1] = p0.y; r[2] = p0.z;
+            r[3] = d.x;  r[4] = d.y;  r[5] = d.z;
+            r[6] = 1e30f;
+        }
+}
+
+static void send_request(Socket* s, const ClientOptions& options, int scene, uint32_t id,
+        const Camera& camera, std::vector<float>& rays)
+{
+    if (options.rays)
+    {
+        RayRequest req;
+        req.id = id;
+        req.scene = scene;
+        req.count = options.width * options.height;
+        req.any_hit = 0;
+
+        make_rays(camera.get_to_world(), options.width, options.height, rays);
+        send_message(s, MSG_RAYS, &req, sizeof(req), &rays[0], rays.size() * sizeof(float));
+        return;
+    }
+
+    RenderRequest req;
+    req.id = id;
+    req.scene = scene;
+    req.width = options.width;
+    req.height = options.height;
+    req.output = options.output;
+    req.mode = options.mode;
+    req.samples = options.samples;
+
+    Matrix4x4f to_world = camera.get_to_world();
+    for (int i = 0; i < 16; i++)
+        req.to_world[i] = to_world[i];
+
+    send_message(s, MSG_RENDER, &req, sizeof(req));
+}
+
+static int run_client(const ClientOptions& options, const char* scene_file, const std::vector<Camera>& cameras)
+{
+    Socket* s = Socket::connect(options.address);
+    std::vector<char> msg;
+
+    // Server may have a different working directory.
+    char path[PATH_MAX];
+    if (!realpath(scene_file, path))
+        throw std::runtime_error(std::string("can't find ") + scene_file);
+
+    Timer timer;
+    send_message(s, MSG_LOAD, path, strlen(path));
+    expect(s, MSG_LOADED, msg);
+
+    LoadedMessage loaded;
+    memcpy(&loaded, &msg[0], sizeof(loaded));
+    fprintf(stderr, "scene %d: %d triangles, %.2f ms (server load %.2f ms, build %.2f ms)\n",
+            loaded.scene, loaded.triangles, timer.elapsed() * 1000.0,
+            loaded.load_time * 1000.0, loaded.build_time * 1000.0);
+
+    int requests = options.requests > 0 ? options.requests : (int)cameras.size();
+
+    std::vector<double> send_times(requests);
+    std::vector<float> rays;
+    Samples latency;
+    Samples server_time;
+    int sent = 0;
+    int received = 0;
+
+    timer.start();
+    while (received < requests)
+    {
+        while (sent < requests && sent - received < options.depth)
+        {
+            send_times[sent] = get_time();
+            send_request(s, options, loaded.scene, sent, cameras[sent % cameras.size()], rays);
+            sent++;
+        }
+
+        expect(s, options.rays ? MSG_HITS : MSG_FRAME, msg);
+
+        FrameMessage frame;
+        memcpy(&frame, &msg[0], sizeof(frame));
+        if ((int)frame.id != received)
+            throw std::runtime_error("answers out of order");
+
+        latency.add(get_time() - send_times[frame.id]);
+        server_time.add(frame.queue_time + frame.render_time);
+
+        if (options.prefix && frame.output == OUTPUT_RGBA)
+        {
+            char filename[1024];
+            snprintf(filename, sizeof(filename), "%s%04d.ppm", options.prefix, received);
+            write_ppm(filename, frame.width, frame.height, (const unsigned char*)&msg[sizeof(frame)]);
+        }
+
+        received++;
+    }
+    double time = timer.elapsed();
+
+    fprintf(stderr, "%d requests in %.2f ms, %.2f requests/s, depth %d\n", requests, time * 1000.0,
+            requests / time, options.depth);
+    fprintf(stderr, "latency ms   p50 %.2f  p95 %.2f  p99 %.2f  max %.2f\n",
+            latency.median() * 1000.0, latency.percentile(95.0) * 1000.0,
+            latency.percentile(99.0) * 1000.0, latency.max() * 1000.0);
+    fprintf(stderr, "in server ms p50 %.2f  p95 %.2f  p99 %.2f  max %.2f\n",
+            server_time.median() * 1000.0, server_time.percentile(95.0) * 1000.0,
+            server_time.percentile(99.0) * 1000.0, server_time.max() * 1000.0);
+
+    delete s;
+    return 0;
+}
+
+static int run(int argc, char** argv)
+{
+    ClientOptions options;
+    options.address = DEFAULT_ADDRESS;
+    options.width = 1024;
+    options.height = 768;
+    options.output = OUTPUT_RGBA;
+    options.mode = Shader::SHADE_NORMAL;
+    options.rays = false;
+    options.samples = 0;
+    options.requests = 0;
+    options.depth = 1;
+    options.prefix = 0;
+
+    bool client = false;
+    int threads = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "a:t:Cw:h:s:n:r:d:o:")) != -1)
+    {
+        switch (c)
+        {
+        case 'a': options.address = optarg; break;
+        case 't': threads = atoi(optarg); break;
+        case 'C': client = true; break;
+        case 'w': options.width = atoi(optarg); break;
+        case 'h': options.height = atoi(optarg); break;
+        case 's':
+            if (!strcmp(optarg, "hits"))
+                options.output = OUTPUT_HITS;
+            else if (!strcmp(optarg, "rays"))
+                options.rays = true;
+            else if (!Shader::parse_mode(optarg, options.mode))
+                usage();
+            break;
+        case 'n': options.samples = atoi(optarg); break;
+        case 'r': options.requests = atoi(optarg); break;
+        case 'd': options.depth = std::max(atoi(optarg), 1); break;
+        case 'o': options.prefix = optarg; break;
+        default: usage();
+        }
+    }
+
+    if (!client)
+        return run_server(options.address, threads);
+
+    if (argc - optind < 2 || options.width <= 0 || options.height <= 0)
+        usage();
+
+    std::vector<Camera> cameras;
+    for (int i = optind + 1; i < argc; i++)
+    {
+        std::vector<Camera> c = Camera::load_all(argv[i]);
+        cameras.insert(cameras.end(), c.begin(), c.end());
+    }
+    if (cameras.empty())
+        usage();
+
+    return run_client(options, argv[optind], cameras);
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        return run(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+}
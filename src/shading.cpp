@@ -0,0 +1,371 @@
+#include "shading.hpp"
+#include "sampling.hpp"
+#include "random.hpp"
+#include <string.h>
+#include <float.h>
+
+using namespace dn;
+
+#define MISS_COLOR 0xFFFF00FFu
+
+#define DEFAULT_SAMPLES 4
+
+// Light not reaching a point in shadow mode.
+#define AMBIENT 0.15f
+
+static const char* mode_names[] =
+{
+    "normal",
+    "depth",
+    "barycentric",
+    "id",
+    "ao",
+    "shadow"
+};
+
+static inline uint32_t pack(unsigned char r, unsigned char g, unsigned char b)
+{
+    return r | g << 8 | b << 16 | 0xFFu << 24;
+}
+
+static inline unsigned char to_byte(float f)
+{
+    return 0x00 + std::min(std::max(f, 0.f), 1.f) * 255.f;
+}
+
+// Spreads consecutive ids to distinct colors.
+static inline uint32_t id_color(int id)
+{
+    uint32_t h = (uint32_t)id * 2654435761u;
+    h ^= h >> 15;
+    return (h & 0x00FFFFFF) | 0xFF000000;
+}
+
+static inline Vector3f face_normal(const Primitive& prim)
+{
+    return normalize(prim.get_normal(0.f, 0.f));
+}
+
+static inline uint32_t normal_color(Vector3f n)
+{
+    n = n * 0.5f + Vector3f(0.5f, 0.5f, 0.5f);
+    return pack(0x00 + n.x * 255.f, 0x00 + n.y * 255.f, 0x00 + n.z * 255.f);
+}
+
+Shader::Shader(FlatBVH* bvh)
+:   bvh(bvh), mode(SHADE_NORMAL), depth_near(0.f), depth_far(1.f), samples(DEFAULT_SAMPLES)
+{
+    bounds = bvh->get_bounds();
+
+    // Paged out geometry doesn't fit in memory, nor would tables of it.
+    if (!bvh->get_paged_geometry())
+    {
+        int n = bvh->get_primitive_count();
+        normals.resize(n);
+        normal_colors.resize(n);
+
+        FlatBVH::TriangleReader tris(bvh);
+        for (int i = 0; i < n; i++)
+        {
+            Vector3f nn = face_normal(tris.get(i));
+            normals[i] = Vector4f(nn, 0.f);
+            normal_colors[i] = normal_color(nn);
+        }
+    }
+
+    // Same scale as the secondary rays of gpurt-bench.
+    float size = bounds.get_diagonal().length();
+    eps = size * 1e-5f;
+    ao_radius = size * 0.05f;
+    light = get_default_light(true);
+}
+
+const char* Shader::get_mode_name(Mode mode)
+{
+    return mode_names[mode];
+}
+
+bool Shader::parse_mode(const char* name, Mode& mode)
+{
+    for (int i = 0; i < SHADE_MODE_COUNT; i++)
+    {
+        if (!strcmp(name, mode_names[i]))
+        {
+            mode = (Mode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Shader::set_camera(const Matrix4x4f& to_world)
+{
+    // Projection maps the eye to infinity, so direction (0, 0, 1) in clip
+    // space maps back to it.
+    eye = (to_world * Vector4f(0.f, 0.f, 1.f, 0.f)).project();
+}
+
+//
+// Light near the top of the scene, off the center so that it doesn't end
+// up inside a single centered object. Area light is a tenth of the scene
+// across.
+//
+
+Shader::Light Shader::get_default_light(bool area) const
+{
+    Vector3f diag = bounds.get_diagonal();
+    Vector3f center = bounds.min + scale(diag, Vector3f(0.75f, 0.9f, 0.75f));
+
+    Light l;
+    if (area)
+    {
+        l.edge1 = Vector3f(diag.x * 0.1f, 0.f, 0.f);
+        l.edge2 = Vector3f(0.f, 0.f, diag.z * 0.1f);
+    }
+    else
+    {
+        l.edge1 = Vector3f(0.f, 0.f, 0.f);
+        l.edge2 = Vector3f(0.f, 0.f, 0.f);
+    }
+    l.corner = center - (l.edge1 + l.edge2) * 0.5f;
+    return l;
+}
+
+void Shader::set_depth_range(float near, float far)
+{
+    depth_near = near;
+    depth_far = far > near ? far : near + 1e-6f;
+}
+
+void Shader::fit_depth_range(const HitBuffer& hits)
+{
+    float tmin = FLT_MAX;
+    float tmax = -FLT_MAX;
+
+    for (int i = 0; i < hits.size(); i++)
+    {
+        if (hits.id[i] < 0)
+            continue;
+        tmin = std::min(tmin, hits.t[i]);
+        tmax = std::max(tmax, hits.t[i]);
+    }
+
+    if (tmin <= tmax)
+        set_depth_range(tmin, tmax);
+}
+
+//
+// Each mode has its own loop over the hit arrays so there is no branching
+// on the mode per pixel. Misses are skipped as their t, u and v are not
+// meaningful.
+//
+
+int Shader::shade(const HitBuffer& hits, int begin, int end, unsigned char* rgba) const
+{
+    const int* id = &hits.id[0];
+    const float* t = &hits.t[0];
+    const float* u = &hits.u[0];
+    const float* v = &hits.v[0];
+    uint32_t* out = (uint32_t*)rgba;
+    FlatBVH::TriangleReader tris(bvh);
+
+    switch (mode)
+    {
+    case SHADE_NORMAL:
+        if (normal_colors.empty())
+        {
+            for (int i = begin; i < end; i++)
+                out[i] = id[i] < 0 ? MISS_COLOR : normal_color(face_normal(tris.get(id[i])));
+        }
+        else
+        {
+            const uint32_t* colors = &normal_colors[0];
+            for (int i = begin; i < end; i++)
+                out[i] = id[i] < 0 ? MISS_COLOR : colors[id[i]];
+        }
+        break;
+
+    case SHADE_DEPTH:
+        {
+            float scale = 1.f / (depth_far - depth_near);
+            for (int i = begin; i < end; i++)
+            {
+                if (id[i] < 0)
+                {
+                    out[i] = MISS_COLOR;
+                    continue;
+                }
+                unsigned char c = to_byte(1.f - (t[i] - depth_near) * scale);
+                out[i] = pack(c, c, c);
+            }
+        }
+        break;
+
+    case SHADE_BARYCENTRIC:
+        for (int i = begin; i < end; i++)
+        {
+            if (id[i] < 0)
+            {
+                out[i] = MISS_COLOR;
+                continue;
+            }
+            out[i] = pack(to_byte(u[i]), to_byte(v[i]), to_byte(1.f - u[i] - v[i]));
+        }
+        break;
+
+    case SHADE_ID:
+        for (int i = begin; i < end; i++)
+            out[i] = id[i] < 0 ? MISS_COLOR : id_color(id[i]);
+        break;
+
+    case SHADE_AO:
+        {
+            int rays = 0;
+            for (int i = begin; i < end; i++)
+                out[i] = id[i] < 0 ? MISS_COLOR : shade_ao(hits.get(i), i, tris, rays);
+            return rays;
+        }
+
+    case SHADE_SHADOW:
+        {
+            int rays = 0;
+            for (int i = begin; i < end; i++)
+                out[i] = id[i] < 0 ? MISS_COLOR : shade_shadow(hits.get(i), i, tris, rays);
+            return rays;
+        }
+
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+uint32_t Shader::shade(const BVHRT::Intersection& is, int pixel) const
+{
+    if (is.id < 0)
+        return MISS_COLOR;
+
+    int rays = 0;
+    FlatBVH::TriangleReader tris(bvh);
+
+    switch (mode)
+    {
+    case SHADE_NORMAL:
+        return normal_colors.empty() ? normal_color(face_normal(tris.get(is.id))) : normal_colors[is.id];
+
+    case SHADE_DEPTH:
+        {
+            unsigned char c = to_byte(1.f - (is.t - depth_near) / (depth_far - depth_near));
+            return pack(c, c, c);
+        }
+
+    case SHADE_BARYCENTRIC:
+        return pack(to_byte(is.u), to_byte(is.v), to_byte(1.f - is.u - is.v));
+
+    case SHADE_ID:
+        return id_color(is.id);
+
+    case SHADE_AO:
+        return shade_ao(is, pixel, tris, rays);
+
+    case SHADE_SHADOW:
+        return shade_shadow(is, pixel, tris, rays);
+
+    default:
+        return MISS_COLOR;
+    }
+}
+
+//
+// Secondary rays start from the hit point moved slightly off the surface,
+// on the side facing the camera.
+//
+
+Vector3f Shader::get_position(const BVHRT::Intersection& is, FlatBVH::TriangleReader& tris,
+        Vector3f& n) const
+{
+    Primitive prim = tris.get(is.id);
+    Vector3f p = prim.v0 + (prim.v1 - prim.v0) * is.u + (prim.v2 - prim.v0) * is.v;
+
+    if (normals.empty())
+        n = face_normal(prim);
+    else
+        n = Vector3f(normals[is.id].x, normals[is.id].y, normals[is.id].z);
+    if (dot(n, eye - p) < 0.f)
+        n = -n;
+
+    return p + n * eps;
+}
+
+// Per pixel offset for Cranley-Patterson rotation.
+static inline void pixel_offset(int pixel, float& r1, float& r2)
+{
+    Random rnd(pixel);
+    r1 = rnd.next_float();
+    r2 = rnd.next_float();
+}
+
+uint32_t Shader::shade_ao(const BVHRT::Intersection& is, int pixel, FlatBVH::TriangleReader& tris,
+        int& rays) const
+{
+    Vector3f n;
+    Vector3f p = get_position(is, tris, n);
+
+    Vector3f t, b;
+    make_basis(n, t, b);
+
+    float r1, r2;
+    pixel_offset(pixel, r1, r2);
+
+    int open = 0;
+    for (int i = 0; i < samples; i++)
+    {
+        float u1, u2;
+        hammersley(i, samples, u1, u2);
+
+        Vector3f s = sample_cosine_hemisphere(rotate_sample(u1, r1), rotate_sample(u2, r2));
+        Vector3f d = t * s.x + b * s.y + n * s.z;
+
+        open += !bvh->occluded(p, d, ao_radius);
+    }
+    rays += samples;
+
+    unsigned char c = to_byte(open / (float)samples);
+    return pack(c, c, c);
+}
+
+uint32_t Shader::shade_shadow(const BVHRT::Intersection& is, int pixel, FlatBVH::TriangleReader& tris,
+        int& rays) const
+{
+    Vector3f n;
+    Vector3f p = get_position(is, tris, n);
+
+    // Every sample of a point light would be the same.
+    int count = light.is_point() ? 1 : samples;
+
+    float r1, r2;
+    pixel_offset(pixel, r1, r2);
+
+    float lit = 0.f;
+    for (int i = 0; i < count; i++)
+    {
+        float u1, u2;
+        hammersley(i, count, u1, u2);
+
+        Vector3f l = light.corner + light.edge1 * rotate_sample(u1, r1) + light.edge2 * rotate_sample(u2, r2);
+        Vector3f d = l - p;
+
+        float cos_theta = dot(n, d);
+        if (cos_theta <= 0.f)
+            continue;
+
+        // Ray ends just before the light.
+        rays++;
+        if (!bvh->occluded(p, d, 0.999f))
+            lit += cos_theta / d.length();
+    }
+
+    unsigned char c = to_byte(AMBIENT + (1.f - AMBIENT) * lit / count);
+    return pack(c, c, c);
+}
@@ -0,0 +1,123 @@
+#ifndef _dn_shading_hpp_
+#define _dn_shading_hpp_
+
+#include "dndefs.hpp"
+#include "bvhrt.hpp"
+#include "flatbvh.hpp"
+#include "hitbuffer.hpp"
+#include "vector4.hpp"
+#include "matrix4x4.hpp"
+#include "aabb.hpp"
+#include <vector>
+#include <stdint.h>
+
+namespace dn
+{
+    // Turns primary hits into colors. Runs after visibility so the cost is
+    // per pixel rather than per candidate hit, and the mode can be changed
+    // without tracing again. Per-primitive data is computed once up front,
+    // shading a pixel is a table lookup or a few multiplies. Geometry paged
+    // out before the shader is made gets no tables, normals are computed
+    // from the triangles of the hits instead.
+    //
+    // Ambient occlusion and shadow modes trace secondary rays from the hit
+    // points, get_samples() rays per pixel. Sample directions come from a
+    // Hammersley set rotated per pixel, so they are stratified within a
+    // pixel and vary between pixels but not between frames.
+    class Shader
+    {
+    public:
+        // Values are shared with the bvh_shade kernel, which shades modes
+        // that trace secondary rays as SHADE_NORMAL.
+        enum Mode
+        {
+            SHADE_NORMAL,
+            SHADE_DEPTH,
+            SHADE_BARYCENTRIC,
+            SHADE_ID,
+            SHADE_AO,
+            SHADE_SHADOW,
+            SHADE_MODE_COUNT
+        };
+
+        // Parallelogram light, a point light if both edges are zero.
+        struct Light
+        {
+            Vector3f corner;
+            Vector3f edge1;
+            Vector3f edge2;
+
+            bool is_point() const { return edge1 == Vector3f(0.f, 0.f, 0.f) && edge2 == Vector3f(0.f, 0.f, 0.f); }
+        };
+
+        Shader(FlatBVH* bvh);
+
+        void set_mode(Mode mode) { this->mode = mode; }
+        Mode get_mode() const { return mode; }
+
+        static const char* get_mode_name(Mode mode);
+
+        // Returns false if name doesn't match any mode.
+        static bool parse_mode(const char* name, Mode& mode);
+
+        // Hit distances mapped from white to black in depth mode.
+        void set_depth_range(float near, float far);
+        float get_depth_near() const { return depth_near; }
+        float get_depth_far() const { return depth_far; }
+
+        // Sets depth range to cover the hits.
+        void fit_depth_range(const HitBuffer& hits);
+
+        // Camera the hits were traced from, needed to orient normals.
+        void set_camera(const Matrix4x4f& to_world);
+
+        void set_samples(int n) { samples = std::max(n, 1); }
+        int get_samples() const { return samples; }
+
+        // Length of ambient occlusion rays.
+        void set_ao_radius(float r) { ao_radius = r; }
+        float get_ao_radius() const { return ao_radius; }
+
+        // By default an area light above the scene.
+        void set_light(const Light& l) { light = l; }
+        const Light& get_light() const { return light; }
+        Light get_default_light(bool area) const;
+
+        // Shades hits [begin, end) to the same pixels of rgba, 4 bytes
+        // per pixel. Returns the number of secondary rays traced.
+        int shade(const HitBuffer& hits, int begin, int end, unsigned char* rgba) const;
+
+        // Single hit of given pixel as RGBA packed to memory order.
+        uint32_t shade(const BVHRT::Intersection& is, int pixel) const;
+
+        // Unit face normal of each primitive, w unused. Empty if the
+        // geometry was paged out.
+        const std::vector<Vector4f>& get_normals() const { return normals; }
+
+    private:
+        Vector3f get_position(const BVHRT::Intersection& is, FlatBVH::TriangleReader& tris,
+                Vector3f& n) const;
+        uint32_t shade_ao(const BVHRT::Intersection& is, int pixel, FlatBVH::TriangleReader& tris,
+                int& rays) const;
+        uint32_t shade_shadow(const BVHRT::Intersection& is, int pixel, FlatBVH::TriangleReader& tris,
+                int& rays) const;
+
+    private:
+        FlatBVH* bvh;
+        Mode mode;
+        float depth_near;
+        float depth_far;
+
+        Vector3f eye;
+        int samples;
+        AABBf bounds;
+        float eps;
+        float ao_radius;
+        Light light;
+
+        std::vector<Vector4f> normals;
+        std::vector<uint32_t> normal_colors;
+    };
+}
+
+#endif
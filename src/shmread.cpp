@@ -0,0 +1,300 @@
+//
+// Reader of the shared memory frame ring. Follows the newest frames of a
+// ring published by gpurt or gpurt-headless, prints their latency and
+// optionally writes them to PPM files.
+//
+// With -B it benchmarks the ring instead: a producer fills frames as fast
+// as it can while reader processes follow it, and each reports frames and
+// bytes per second, frames lost to overwrites and torn reads caught by the
+// sequence check.
+//
+
+#include "shmring.hpp"
+#include "image.hpp"
+#include "stats.hpp"
+#include "timer.hpp"
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace dn;
+
+#define DEFAULT_NAME "/gpurt"
+
+// Wait between looks at the ring when no new frame is there.
+#define POLL_USEC 200
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: gpurt-shmread [options] [name]\n"
+        "       gpurt-shmread -B [options]\n"
+        "  name         shared memory name (" DEFAULT_NAME ")\n"
+        "  -n frames    stop after this many frames (run until interrupted)\n"
+        "  -o prefix    write frames as <prefix>NNNN.ppm\n"
+        "  -z           use frames in place instead of copying them\n"
+        "benchmark:\n"
+        "  -B           run the throughput benchmark\n"
+        "  -w width     frame width (1024)\n"
+        "  -h height    frame height (768)\n"
+        "  -s slots     slots in the ring (4)\n"
+        "  -j readers   reader processes (2)\n"
+        "  -t seconds   duration (3)\n");
+    exit(1);
+}
+
+struct ReaderStats
+{
+    ReaderStats() : frames(0), lost(0), torn(0), corrupt(0), bytes(0.0) {}
+
+    int frames;
+    int lost;       // overwritten before they were read
+    int torn;       // changed while read
+    int corrupt;    // torn but not caught, should stay zero
+    double bytes;
+    Samples latency;
+};
+
+// Stand-in for using a frame, touches every cache line.
+static uint32_t consume(const unsigned char* p, size_t size)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < size; i += 64)
+        sum += *(const uint32_t*)(p + i);
+    return sum;
+}
+
+//
+// Follows the ring, reading each new frame until stop_time or max_frames.
+// In the benchmark every pixel of frame f holds f, which is checked.
+//
+
+static void follow(ShmRing* ring, bool zero_copy, int max_frames, double stop_time,
+        const char* prefix, bool verify, ReaderStats& stats)
+{
+    std::vector<unsigned char> buffer(ring->get_frame_size());
+    uint64_t last = 0;
+    volatile uint32_t sink = 0;
+
+    while ((max_frames <= 0 || stats.frames < max_frames) && get_time() < stop_time)
+    {
+        uint64_t f = ring->get_latest();
+        if (f == last)
+        {
+            usleep(POLL_USEC);
+            continue;
+        }
+
+        ShmRing::FrameInfo info;
+        const unsigned char* pixels;
+
+        if (zero_copy)
+        {
+            pixels = ring->peek(f, &info);
+            if (pixels)
+            {
+                sink += consume(pixels, ring->get_frame_size());
+                if (verify && (*(const uint32_t*)pixels != (uint32_t)f ||
+                            *(const uint32_t*)(pixels + ring->get_frame_size() - 4) != (uint32_t)f))
+                    stats.corrupt += ring->check(f);
+                if (!ring->check(f))
+                    pixels = 0;
+            }
+        }
+        else
+        {
+            pixels = ring->read(f, &buffer[0], &info) ? &buffer[0] : 0;
+            if (pixels && verify && (*(const uint32_t*)pixels != (uint32_t)f ||
+                        *(const uint32_t*)(pixels + buffer.size() - 4) != (uint32_t)f))
+                stats.corrupt++;
+        }
+
+        if (!pixels)
+        {
+            // Try the newest frame again.
+            stats.torn++;
+            continue;
+        }
+
+        double now = get_time();
+        if (last)
+            stats.lost += (int)(f - last - 1);
+        last = f;
+        stats.frames++;
+        stats.bytes += ring->get_frame_size();
+        stats.latency.add(now - info.time);
+
+        if (prefix)
+        {
+            char filename[1024];
+            snprintf(filename, sizeof(filename), "%s%04d.ppm", prefix, (int)f);
+
+            // In place frames may change while written, write a copy.
+            if (zero_copy && !ring->read(f, &buffer[0]))
+                continue;
+            write_ppm(filename, ring->get_width(), ring->get_height(), &buffer[0]);
+        }
+
+        if (!verify)
+            fprintf(stderr, "frame %llu, %.2f ms old\n", (unsigned long long)f, (now - info.time) * 1000.0);
+    }
+}
+
+// Readers print from their own processes, each line goes out in one
+// write so that they don't interleave.
+static void print_stats(const char* who, const ReaderStats& s, double time)
+{
+    char line[256];
+    int n = snprintf(line, sizeof(line), "%-10s %8d frames %8.1f fps %7.2f GB/s  lost %d  torn %d  corrupt %d",
+            who, s.frames, s.frames / time, s.bytes / time * 1e-9, s.lost, s.torn, s.corrupt);
+    if (!s.latency.empty() && n < (int)sizeof(line))
+        n += snprintf(line + n, sizeof(line) - n, "  latency ms p50 %.3f p99 %.3f", s.latency.median() * 1000.0,
+                s.latency.percentile(99.0) * 1000.0);
+    fprintf(stderr, "%s\n", line);
+}
+
+static int run_benchmark(int width, int height, int slots, int readers, double seconds, bool zero_copy)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/gpurt-bench-%d", (int)getpid());
+
+    ShmRing* ring = ShmRing::create(name, width, height, slots);
+    size_t words = ring->get_frame_size() / 4;
+
+    fprintf(stderr, "%d x %d frames (%.2f MB), %d slots, %d readers, %s\n", width, height,
+            ring->get_frame_size() / 1e6, slots, readers, zero_copy ? "in place" : "copy");
+
+    // All start at the same time, the producer goes on a little longer so
+    // that readers have frames until they stop.
+    double start = get_time() + 0.2;
+    double stop = start + seconds;
+
+    std::vector<pid_t> children;
+    for (int i = 0; i < readers; i++)
+    {
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid < 0)
+            throw std::runtime_error("fork failed");
+        if (pid == 0)
+        {
+            int status = 0;
+            try
+            {
+                ShmRing* r = ShmRing::open(name);
+                while (get_time() < start)
+                    usleep(POLL_USEC);
+
+                ReaderStats s;
+                follow(r, zero_copy, 0, stop, 0, true, s);
+
+                char who[32];
+                snprintf(who, sizeof(who), "reader %d", i);
+                print_stats(who, s, seconds);
+                delete r;
+            }
+            catch (const std::exception& e)
+            {
+                fprintf(stderr, "reader error: %s\n", e.what());
+                status = 1;
+            }
+            _exit(status);
+        }
+        children.push_back(pid);
+    }
+
+    ReaderStats s;
+    Matrix4x4f to_world;
+    while (get_time() < start)
+        usleep(POLL_USEC);
+    while (get_time() < stop + 0.1)
+    {
+        uint32_t* p = (uint32_t*)ring->begin_write();
+        uint32_t f = (uint32_t)(ring->get_latest() + 1);
+        for (size_t i = 0; i < words; i++)
+            p[i] = f;
+        ring->end_write(to_world);
+
+        s.frames++;
+        s.bytes += ring->get_frame_size();
+    }
+    print_stats("producer", s, seconds + 0.1);
+
+    int failed = 0;
+    for (int i = 0; i < (int)children.size(); i++)
+    {
+        int status;
+        waitpid(children[i], &status, 0);
+        failed += !WIFEXITED(status) || WEXITSTATUS(status);
+    }
+
+    delete ring;
+    return failed ? 1 : 0;
+}
+
+static int run(int argc, char** argv)
+{
+    int max_frames = 0;
+    const char* prefix = 0;
+    bool zero_copy = false;
+    bool benchmark = false;
+    int width = 1024;
+    int height = 768;
+    int slots = 4;
+    int readers = 2;
+    double seconds = 3.0;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:o:zBw:h:s:j:t:")) != -1)
+    {
+        switch (c)
+        {
+        case 'n': max_frames = atoi(optarg); break;
+        case 'o': prefix = optarg; break;
+        case 'z': zero_copy = true; break;
+        case 'B': benchmark = true; break;
+        case 'w': width = atoi(optarg); break;
+        case 'h': height = atoi(optarg); break;
+        case 's': slots = atoi(optarg); break;
+        case 'j': readers = atoi(optarg); break;
+        case 't': seconds = atof(optarg); break;
+        default: usage();
+        }
+    }
+
+    if (benchmark)
+        return run_benchmark(width, height, slots, readers, seconds, zero_copy);
+
+    if (argc - optind > 1)
+        usage();
+
+    const char* name = optind < argc ? argv[optind] : DEFAULT_NAME;
+    ShmRing* ring = ShmRing::open(name);
+    fprintf(stderr, "%s: %d x %d, %d slots\n", name, ring->get_width(), ring->get_height(), ring->get_slot_count());
+
+    ReaderStats s;
+    Timer timer;
+    follow(ring, zero_copy, max_frames, 1e300, prefix, false, s);
+    print_stats("reader", s, timer.elapsed());
+
+    delete ring;
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        return run(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,254 @@
+#include "shmring.hpp"
+#include "timer.hpp"
+#include <stdexcept>
+#include <new>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace dn;
+
+#define RING_MAGIC 0x676E6972u  // "ring"
+#define RING_VERSION 1
+
+#define PAGE_SIZE 4096
+
+// Counters are shared between processes, which only works if they don't
+// need a lock.
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "64-bit atomics must be lock free");
+
+struct ShmRing::Header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t slots;
+    uint32_t pad;
+    uint64_t frame_size;
+    uint64_t slot_stride;
+
+    // Own cache line, written on every frame.
+    alignas(64) std::atomic<uint64_t> latest;
+};
+
+struct ShmRing::Slot
+{
+    std::atomic<uint64_t> seq;
+    FrameInfo info;
+};
+
+static size_t round_up(size_t n, size_t a)
+{
+    return (n + a - 1) / a * a;
+}
+
+// Slot header and pixels of a slot. Pixels start on a page boundary.
+static size_t get_slot_stride(size_t frame_size)
+{
+    return PAGE_SIZE + round_up(frame_size, PAGE_SIZE);
+}
+
+ShmRing::ShmRing(const std::string& name, void* base, size_t size, bool owner)
+:   name(name), base(base), size(size), owner(owner), header((Header*)base), writing(0)
+{
+}
+
+ShmRing::~ShmRing()
+{
+    munmap(base, size);
+    if (owner)
+        shm_unlink(name.c_str());
+}
+
+ShmRing* ShmRing::create(const char* name, int width, int height, int slots)
+{
+    if (width <= 0 || height <= 0 || slots < 2)
+        throw std::runtime_error("bad shared memory ring size");
+
+    size_t frame_size = (size_t)width * height * 4;
+    size_t stride = get_slot_stride(frame_size);
+    size_t size = PAGE_SIZE + stride * slots;
+
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        throw std::runtime_error(std::string("can't create shared memory ") + name + ": " + strerror(errno));
+
+    if (ftruncate(fd, size) < 0)
+    {
+        ::close(fd);
+        shm_unlink(name);
+        throw std::runtime_error(std::string("can't resize shared memory ") + name + ": " + strerror(errno));
+    }
+
+    void* base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED)
+    {
+        shm_unlink(name);
+        throw std::runtime_error(std::string("can't map shared memory ") + name + ": " + strerror(errno));
+    }
+
+    // New pages are zero, so every slot starts with sequence 0 (empty).
+    Header* h = new (base) Header;
+    h->width = width;
+    h->height = height;
+    h->slots = slots;
+    h->pad = 0;
+    h->frame_size = frame_size;
+    h->slot_stride = stride;
+    h->latest.store(0);
+
+    for (int i = 0; i < slots; i++)
+        new ((char*)base + PAGE_SIZE + stride * i) Slot;
+
+    // Readers check the magic last.
+    h->version = RING_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    h->magic = RING_MAGIC;
+
+    return new ShmRing(name, base, size, true);
+}
+
+ShmRing* ShmRing::open(const char* name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        throw std::runtime_error(std::string("can't open shared memory ") + name + ": " + strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < PAGE_SIZE)
+    {
+        ::close(fd);
+        throw std::runtime_error(std::string("shared memory ") + name + " is not a frame ring");
+    }
+
+    void* base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED)
+        throw std::runtime_error(std::string("can't map shared memory ") + name + ": " + strerror(errno));
+
+    ShmRing* ring = new ShmRing(name, base, st.st_size, false);
+
+    const Header* h = ring->header;
+    if (h->magic != RING_MAGIC || h->version != RING_VERSION ||
+            PAGE_SIZE + h->slot_stride * h->slots > (size_t)st.st_size)
+    {
+        delete ring;
+        throw std::runtime_error(std::string("shared memory ") + name + " is not a frame ring");
+    }
+
+    return ring;
+}
+
+int ShmRing::get_width() const
+{
+    return header->width;
+}
+
+int ShmRing::get_height() const
+{
+    return header->height;
+}
+
+int ShmRing::get_slot_count() const
+{
+    return header->slots;
+}
+
+size_t ShmRing::get_frame_size() const
+{
+    return header->frame_size;
+}
+
+ShmRing::Slot* ShmRing::get_slot(uint64_t frame) const
+{
+    return (Slot*)((char*)base + PAGE_SIZE + header->slot_stride * (frame % header->slots));
+}
+
+unsigned char* ShmRing::get_pixels(uint64_t frame) const
+{
+    return (unsigned char*)get_slot(frame) + PAGE_SIZE;
+}
+
+unsigned char* ShmRing::begin_write()
+{
+    assert(owner && !writing);
+
+    writing = header->latest.load(std::memory_order_relaxed) + 1;
+
+    // Mark the slot as being written before any pixel changes.
+    get_slot(writing)->seq.store(writing * 2 - 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    return get_pixels(writing);
+}
+
+void ShmRing::end_write(const Matrix4x4f& to_world)
+{
+    assert(writing);
+
+    Slot* s = get_slot(writing);
+    s->info.frame = writing;
+    s->info.time = get_time();
+    for (int i = 0; i < 16; i++)
+        s->info.to_world[i] = to_world[i];
+
+    s->seq.store(writing * 2, std::memory_order_release);
+    header->latest.store(writing, std::memory_order_release);
+    writing = 0;
+}
+
+void ShmRing::cancel_write()
+{
+    assert(writing);
+
+    // The slot held an older frame which is now partly overwritten.
+    get_slot(writing)->seq.store(0, std::memory_order_release);
+    writing = 0;
+}
+
+uint64_t ShmRing::get_latest() const
+{
+    return header->latest.load(std::memory_order_acquire);
+}
+
+const unsigned char* ShmRing::peek(uint64_t frame, FrameInfo* info) const
+{
+    if (!frame)
+        return 0;
+
+    const Slot* s = get_slot(frame);
+    if (s->seq.load(std::memory_order_acquire) != frame * 2)
+        return 0;
+
+    if (info)
+    {
+        *info = s->info;
+        if (!check(frame))
+            return 0;
+    }
+
+    return get_pixels(frame);
+}
+
+bool ShmRing::check(uint64_t frame) const
+{
+    // Reads of the frame must be done before the sequence is read again.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return get_slot(frame)->seq.load(std::memory_order_relaxed) == frame * 2;
+}
+
+bool ShmRing::read(uint64_t frame, unsigned char* rgba, FrameInfo* info) const
+{
+    const unsigned char* p = peek(frame, info);
+    if (!p)
+        return false;
+
+    memcpy(rgba, p, header->frame_size);
+    return check(frame);
+}
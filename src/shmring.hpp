@@ -0,0 +1,99 @@
+#ifndef _dn_shmring_hpp_
+#define _dn_shmring_hpp_
+
+#include "dndefs.hpp"
+#include "matrix4x4.hpp"
+#include <atomic>
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace dn
+{
+    // Ring of RGBA frames in POSIX shared memory, written by one producer
+    // and read by any number of consumer processes without locks.
+    //
+    // Frames are numbered from 1 and frame f goes to slot f % slots. Each
+    // slot has a sequence number used as a seqlock: it is odd while the
+    // producer writes the slot and 2 * f once frame f is complete. A reader
+    // checks the sequence before and after using the pixels and retries
+    // if it changed, so readers never block the producer and a slow
+    // reader only loses frames, it never sees a torn one. Readers map the
+    // memory read only and can use the pixels in place.
+    class ShmRing
+    {
+    public:
+        struct FrameInfo
+        {
+            uint64_t frame;
+            double time;            // get_time() when published
+            float to_world[16];     // camera of the frame
+        };
+
+        // Creates the shared memory object, replacing an existing one of
+        // the same name. Name is as for shm_open, e.g. "/gpurt".
+        static ShmRing* create(const char* name, int width, int height, int slots = 4);
+
+        // Maps an existing ring for reading.
+        static ShmRing* open(const char* name);
+
+        // Producer unlinks the name.
+        ~ShmRing();
+
+        int get_width() const;
+        int get_height() const;
+        int get_slot_count() const;
+        size_t get_frame_size() const;
+
+        //
+        // Producer
+        //
+
+        // Pixels of the slot of the next frame, rows from bottom to top.
+        unsigned char* begin_write();
+
+        // Publishes the frame started by begin_write().
+        void end_write(const Matrix4x4f& to_world);
+
+        // Gives up the frame started by begin_write(). The slot is empty
+        // until written again.
+        void cancel_write();
+
+        //
+        // Consumer
+        //
+
+        // Newest published frame, 0 if none.
+        uint64_t get_latest() const;
+
+        // Pixels of frame in place, or 0 if it is no longer in the ring.
+        // They are only valid if check(frame) still returns true after
+        // they have been used.
+        const unsigned char* peek(uint64_t frame, FrameInfo* info = 0) const;
+        bool check(uint64_t frame) const;
+
+        // Copies frame to rgba. Returns false if it was overwritten.
+        bool read(uint64_t frame, unsigned char* rgba, FrameInfo* info = 0) const;
+
+    private:
+        struct Header;
+        struct Slot;
+
+        ShmRing(const std::string& name, void* base, size_t size, bool owner);
+
+        Slot* get_slot(uint64_t frame) const;
+        unsigned char* get_pixels(uint64_t frame) const;
+
+    private:
+        std::string name;
+        void* base;
+        size_t size;
+        bool owner;
+        Header* header;
+
+        // Producer only.
+        uint64_t writing;
+    };
+}
+
+#endif
@@ -0,0 +1,53 @@
+#include "stats.hpp"
+#include <algorithm>
+
+using namespace dn;
+
+void Samples::sort() const
+{
+    if (!sorted)
+    {
+        std::sort(values.begin(), values.end());
+        sorted = true;
+    }
+}
+
+double Samples::min() const
+{
+    if (values.empty())
+        return 0.0;
+    sort();
+    return values.front();
+}
+
+double Samples::max() const
+{
+    if (values.empty())
+        return 0.0;
+    sort();
+    return values.back();
+}
+
+double Samples::mean() const
+{
+    if (values.empty())
+        return 0.0;
+    double s = 0.0;
+    for (int i = 0; i < (int)values.size(); i++)
+        s += values[i];
+    return s / values.size();
+}
+
+double Samples::percentile(double p) const
+{
+    if (values.empty())
+        return 0.0;
+    sort();
+
+    double r = p / 100.0 * (values.size() - 1);
+    int i = (int)r;
+    if (i >= (int)values.size() - 1)
+        return values.back();
+    double f = r - i;
+    return values[i] * (1.0 - f) + values[i+1] * f;
+}
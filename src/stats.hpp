@@ -0,0 +1,37 @@
+#ifndef _dn_stats_hpp_
+#define _dn_stats_hpp_
+
+#include "dndefs.hpp"
+#include <vector>
+
+namespace dn
+{
+    // Collects measurements and computes order statistics.
+    class Samples
+    {
+    public:
+        Samples() : sorted(true) {}
+
+        void add(double v) { values.push_back(v); sorted = false; }
+        void clear() { values.clear(); sorted = true; }
+
+        int count() const { return (int)values.size(); }
+        bool empty() const { return values.empty(); }
+
+        double min() const;
+        double max() const;
+        double mean() const;
+        double median() const { return percentile(50.0); }
+
+        // p in [0, 100], linear interpolation between closest ranks.
+        double percentile(double p) const;
+
+    private:
+        void sort() const;
+
+        mutable std::vector<double> values;
+        mutable bool sorted;
+    };
+}
+
+#endif
@@ -0,0 +1,232 @@
+#include "tilerenderer.hpp"
+#include "timer.hpp"
+#include <string.h>
+#include <math.h>
+
+using namespace dn;
+
+#define NO_CANDIDATE 0xFFFFFFFFFFFFFFFFULL
+
+// A reprojected hit is kept only if nothing is hit before this fraction
+// of its distance, which leaves the candidate triangle itself out.
+#define OCCLUSION_EPS 1e-4f
+
+// Rows per task in shading pass.
+#define SHADE_ROWS 16
+
+TileRenderer::TileRenderer(FlatBVH* bvh, WorkerPool* pool, int width, int height, int tile_size)
+:   bvh(bvh), pool(pool), width(width), height(height), tile_size(tile_size),
+    tiles_x((width + tile_size - 1) / tile_size), tiles_y((height + tile_size - 1) / tile_size),
+    tile_order(PixelOrder::ORDER_MORTON, tiles_x, tiles_y),
+    shader(bvh), trace_time(0.0), shade_time(0.0), trace_utilization(0.0), secondary_rays(0),
+    reprojection(false), reproject(false), has_prev(false), cur(0), reuse_ratio(0.0)
+{
+    scratch.resize(pool->get_thread_count());
+
+    result.resize(width * height * 4);
+    output = (unsigned char*)result.get_ptr();
+
+    hits[0].resize(width * height);
+    hits[1].resize(width * height);
+
+    candidates = new std::atomic<uint64_t>[width * height];
+    for (int i = 0; i < width * height; i++)
+        candidates[i] = NO_CANDIDATE;
+}
+
+TileRenderer::~TileRenderer()
+{
+    delete [] candidates;
+}
+
+void TileRenderer::set_reprojection(bool enable)
+{
+    reprojection = enable;
+    has_prev = false;
+}
+
+bool TileRenderer::render(const Matrix4x4f& to_world)
+{
+    if (reprojection && has_prev && to_world == this->to_world)
+    {
+        reuse_ratio = 1.0;
+        return false;
+    }
+
+    reproject = reprojection && has_prev;
+    has_prev = true;
+
+    prev_to_world = this->to_world;
+    this->to_world = to_world;
+    cur ^= 1;
+
+    if (reproject)
+    {
+        from_world = invert(to_world);
+
+        ScatterJob job(this);
+        pool->run(&job, tiles_x * tiles_y);
+    }
+
+    for (int i = 0; i < (int)scratch.size(); i++)
+        scratch[i].reused = 0;
+
+    Timer timer;
+
+    TileJob job(this);
+    pool->run(&job, tiles_x * tiles_y);
+
+    trace_time = timer.elapsed();
+    trace_utilization = 0.0;
+    for (int i = 0; i < pool->get_thread_count(); i++)
+        trace_utilization += pool->get_utilization(i) / pool->get_thread_count();
+
+    int reused = 0;
+    for (int i = 0; i < (int)scratch.size(); i++)
+        reused += scratch[i].reused;
+    reuse_ratio = reused / (double)(width * height);
+
+    shade();
+
+    return true;
+}
+
+void TileRenderer::shade()
+{
+    Timer timer;
+
+    if (shader.get_mode() == Shader::SHADE_DEPTH)
+        shader.fit_depth_range(hits[cur]);
+    shader.set_camera(to_world);
+
+    for (int i = 0; i < (int)scratch.size(); i++)
+        scratch[i].secondary_rays = 0;
+
+    ShadeJob job(this);
+    pool->run(&job, (height + SHADE_ROWS - 1) / SHADE_ROWS);
+
+    shade_time = timer.elapsed();
+
+    secondary_rays = 0;
+    for (int i = 0; i < (int)scratch.size(); i++)
+        secondary_rays += scratch[i].secondary_rays;
+}
+
+void TileRenderer::get_tile(int tile, int& x0, int& y0, int& x1, int& y1) const
+{
+    Vector2i tc = tile_order.get_coord(tile);
+
+    x0 = tc.x * tile_size;
+    y0 = tc.y * tile_size;
+    x1 = std::min(x0 + tile_size, width);
+    y1 = std::min(y0 + tile_size, height);
+}
+
+Vector3f TileRenderer::get_ray(const Matrix4x4f& m, int x, int y, Vector3f& dir) const
+{
+    float fx = (x + 0.5f) / width * 2.f - 1.f;
+    float fy = (y + 0.5f) / height * 2.f - 1.f;
+
+    Vector3f p0 = (m * Vector4f(fx, fy, -1.f, 1.f)).project();
+    Vector3f p1 = (m * Vector4f(fx, fy, 1.f, 1.f)).project();
+
+    dir = p1 - p0;
+    return p0;
+}
+
+//
+// Projects previous hits of a tile to the new view. Depth test between
+// hits landing on the same pixel is done with atomic min.
+//
+
+void TileRenderer::scatter_tile(int tile)
+{
+    int x0, y0, x1, y1;
+    get_tile(tile, x0, y0, x1, y1);
+
+    const HitBuffer& prev = hits[cur ^ 1];
+
+    for (int y = y0; y < y1; y++)
+        for (int x = x0; x < x1; x++)
+        {
+            int i = y * width + x;
+            if (prev.id[i] < 0)
+                continue;
+
+            Vector3f dir;
+            Vector3f o = get_ray(prev_to_world, x, y, dir);
+            Vector3f p = o + dir * prev.t[i];
+
+            Vector4f c = from_world * Vector4f(p, 1.f);
+            if (c.w <= 0.f)
+                continue;
+
+            float nx = (c.x / c.w + 1.f) * 0.5f;
+            float ny = (c.y / c.w + 1.f) * 0.5f;
+            float depth = (c.z / c.w + 1.f) * 0.5f;
+            if (nx < 0.f || nx >= 1.f || ny < 0.f || ny >= 1.f || depth < 0.f || depth > 1.f)
+                continue;
+
+            int px = std::min((int)(nx * width), width - 1);
+            int py = std::min((int)(ny * height), height - 1);
+
+            // Non-negative floats compare like their bit patterns.
+            uint32_t bits;
+            memcpy(&bits, &depth, 4);
+            uint64_t key = ((uint64_t)bits << 32) | (uint32_t)prev.id[i];
+
+            std::atomic<uint64_t>& cand = candidates[py * width + px];
+            uint64_t old = cand.load(std::memory_order_relaxed);
+            while (key < old && !cand.compare_exchange_weak(old, key, std::memory_order_relaxed))
+                ;
+        }
+}
+
+void TileRenderer::trace_tile(int tile, int thread)
+{
+    int x0, y0, x1, y1;
+    get_tile(tile, x0, y0, x1, y1);
+
+    HitBuffer& h = hits[cur];
+    Scratch& s = scratch[thread];
+    FlatBVH::TriangleReader tris(bvh);
+
+    for (int y = y0; y < y1; y++)
+        for (int x = x0; x < x1; x++)
+        {
+            int i = y * width + x;
+
+            Vector3f dir;
+            Vector3f o = get_ray(to_world, x, y, dir);
+
+            if (reproject)
+            {
+                uint64_t c = candidates[i].exchange(NO_CANDIDATE, std::memory_order_relaxed);
+                if (c != NO_CANDIDATE)
+                {
+                    BVHRT::Intersection is;
+                    is.id = (int)(uint32_t)c;
+                    // Surfaces that weren't visible in the previous frame
+                    // may lie in front of the candidate.
+                    if (tris.get(is.id).intersect(o, dir, is.t, is.u, is.v) &&
+                        !bvh->occluded(o, dir, is.t * (1.f - OCCLUSION_EPS)))
+                    {
+                        h.set(i, is);
+                        s.reused++;
+                        continue;
+                    }
+                }
+            }
+
+            h.set(i, bvh->intersect(o, dir));
+        }
+}
+
+void TileRenderer::shade_rows(int task, int thread)
+{
+    int y0 = task * SHADE_ROWS;
+    int y1 = std::min(y0 + SHADE_ROWS, height);
+
+    scratch[thread].secondary_rays +=
+        shader.shade(hits[cur], y0 * width, y1 * width, output);
+}
@@ -0,0 +1,162 @@
+#ifndef _dn_tilerenderer_hpp_
+#define _dn_tilerenderer_hpp_
+
+#include "dndefs.hpp"
+#include "matrix4x4.hpp"
+#include "vector2.hpp"
+#include "flatbvh.hpp"
+#include "workerpool.hpp"
+#include "hostmemory.hpp"
+#include "hitbuffer.hpp"
+#include "shading.hpp"
+#include "pixelorder.hpp"
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+
+namespace dn
+{
+    // Multi-threaded CPU ray tracer. The frame is split into square tiles
+    // which are handed to the worker pool in Z-order, or another pixel
+    // order. Visibility pass only writes primary hits, colors are computed
+    // from them by a separate shading pass over rows of the frame. Output
+    // buffer and per-thread scratch memory are kept between frames.
+    //
+    // With reprojection enabled the primary hits of the previous frame are
+    // kept. If the camera hasn't moved nothing is traced. Otherwise the
+    // previous hit points are projected to the new view and each pixel
+    // that receives one tests the new ray against that triangle, then
+    // checks with a shadow ray that nothing lies in front of it. Pixels
+    // with no candidate or a failed test are traced normally.
+    class TileRenderer
+    {
+    public:
+        TileRenderer(FlatBVH* bvh, WorkerPool* pool, int width, int height, int tile_size = 16);
+        ~TileRenderer();
+
+        // Returns false if nothing had to be rendered.
+        bool render(const Matrix4x4f& to_world);
+
+        // Shades hits of the last frame again, e.g. after changing mode.
+        void shade();
+
+        void set_shading(Shader::Mode mode) { shader.set_mode(mode); }
+        Shader::Mode get_shading() const { return shader.get_mode(); }
+        Shader& get_shader() { return shader; }
+
+        int get_width() const { return width; }
+        int get_height() const { return height; }
+
+        // RGBA, 4 bytes per pixel, rows from bottom to top.
+        const unsigned char* get_buffer() { return output; }
+
+        // Frames are shaded to rgba instead of the renderer's own buffer,
+        // e.g. straight to shared memory. 0 goes back to own buffer. The
+        // whole frame is written on every render() and shade().
+        void set_output(unsigned char* rgba) { output = rgba ? rgba : (unsigned char*)result.get_ptr(); }
+
+        // Primary hits of the last frame.
+        const HitBuffer& get_hits() const { return hits[cur]; }
+
+        WorkerPool* get_pool() { return pool; }
+
+        // Order the tiles are handed out in.
+        void set_tile_order(PixelOrder::Type type) { tile_order = PixelOrder(type, tiles_x, tiles_y); }
+        PixelOrder::Type get_tile_order() const { return tile_order.get_type(); }
+
+        void set_reprojection(bool enable);
+        bool get_reprojection() const { return reprojection; }
+
+        // Fraction of pixels of the last frame that were not traced.
+        double get_reuse_ratio() const { return reuse_ratio; }
+
+        // Seconds spent in the passes of the last frame.
+        double get_trace_time() const { return trace_time; }
+        double get_shade_time() const { return shade_time; }
+
+        // Average thread utilization of the last visibility pass.
+        double get_trace_utilization() const { return trace_utilization; }
+
+        // Rays traced by the passes of the last frame. Primary rays
+        // include the ones resolved by reprojection.
+        int get_primary_rays() const { return width * height; }
+        int get_secondary_rays() const { return secondary_rays; }
+
+    private:
+        class TileJob : public WorkerPool::Job
+        {
+        public:
+            TileJob(TileRenderer* r) : r(r) {}
+            void run(int task, int thread) { r->trace_tile(task, thread); }
+        private:
+            TileRenderer* r;
+        };
+
+        class ShadeJob : public WorkerPool::Job
+        {
+        public:
+            ShadeJob(TileRenderer* r) : r(r) {}
+            void run(int task, int thread) { r->shade_rows(task, thread); }
+        private:
+            TileRenderer* r;
+        };
+
+        class ScatterJob : public WorkerPool::Job
+        {
+        public:
+            ScatterJob(TileRenderer* r) : r(r) {}
+            void run(int task, int thread) { r->scatter_tile(task); }
+        private:
+            TileRenderer* r;
+        };
+
+        struct Scratch
+        {
+            int reused;
+            int secondary_rays;
+        };
+
+        void get_tile(int tile, int& x0, int& y0, int& x1, int& y1) const;
+        Vector3f get_ray(const Matrix4x4f& m, int x, int y, Vector3f& dir) const;
+
+        void trace_tile(int tile, int thread);
+        void scatter_tile(int tile);
+        void shade_rows(int task, int thread);
+
+    private:
+        FlatBVH* bvh;
+        WorkerPool* pool;
+        int width, height;
+        int tile_size;
+        int tiles_x, tiles_y;
+
+        PixelOrder tile_order;
+        std::vector<Scratch> scratch;
+        HostMemory result;
+        unsigned char* output;
+        Matrix4x4f to_world;
+        Shader shader;
+
+        double trace_time;
+        double shade_time;
+        double trace_utilization;
+        int secondary_rays;
+
+        // Reprojection state. hits[cur] belongs to the frame rendered with
+        // to_world, the other one to the frame before it.
+        bool reprojection;
+        bool reproject;
+        bool has_prev;
+        HitBuffer hits[2];
+        int cur;
+        Matrix4x4f prev_to_world;
+        Matrix4x4f from_world;
+        double reuse_ratio;
+
+        // Closest reprojected candidate per pixel, depth in high bits and
+        // primitive id in low bits.
+        std::atomic<uint64_t>* candidates;
+    };
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef _dn_timer_hpp_
+#define _dn_timer_hpp_
+
+#include "dndefs.hpp"
+#include <time.h>
+
+namespace dn
+{
+    // Monotonic wall clock time in seconds.
+    inline double get_time()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+
+    class Timer
+    {
+    public:
+        Timer()
+        {
+            start();
+        }
+
+        void start()
+        {
+            start_time = get_time();
+        }
+
+        // Seconds since start().
+        double elapsed() const
+        {
+            return get_time() - start_time;
+        }
+
+    private:
+        double start_time;
+    };
+}
+
+#endif
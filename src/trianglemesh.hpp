@@ -0,0 +1,71 @@
+#ifndef _dn_trianglemesh_hpp_
+#define _dn_trianglemesh_hpp_
+
+#include "dndefs.hpp"
+#include "vector3.hpp"
+#include "aabb.hpp"
+#include "primitive.hpp"
+#include <stdint.h>
+#include <stddef.h>
+
+namespace dn
+{
+    // Triangles as index triples into a shared vertex array, 12 bytes per
+    // triangle plus the vertices instead of 48 bytes for a Primitive.
+    //
+    // The mesh only refers to the arrays; whoever made it keeps them
+    // alive (e.g. Scene) and copying it is cheap.
+    class TriangleMesh
+    {
+    public:
+        TriangleMesh()
+        :   vertices(0), vertex_count(0), indices(0), triangle_count(0)
+        {
+        }
+
+        TriangleMesh(const Vector3f* vertices, int vertex_count, const uint32_t* indices, int triangle_count)
+        :   vertices(vertices), vertex_count(vertex_count), indices(indices), triangle_count(triangle_count)
+        {
+        }
+
+        int get_vertex_count() const { return vertex_count; }
+        int get_triangle_count() const { return triangle_count; }
+
+        const Vector3f* get_vertices() const { return vertices; }
+        const uint32_t* get_indices() const { return indices; }
+
+        // Vertex k (0, 1 or 2) of triangle.
+        uint32_t get_index(int triangle, int k) const { return indices[triangle * 3 + k]; }
+        const Vector3f& get_vertex(int triangle, int k) const { return vertices[get_index(triangle, k)]; }
+
+        AABBf get_aabb(int triangle) const
+        {
+            AABBf aabb;
+            aabb.grow(get_vertex(triangle, 0));
+            aabb.grow(get_vertex(triangle, 1));
+            aabb.grow(get_vertex(triangle, 2));
+            return aabb;
+        }
+
+        // Triangle as a stand alone primitive.
+        Primitive get_primitive(int triangle) const
+        {
+            return Primitive(Primitive::TRIANGLE, get_vertex(triangle, 0),
+                    get_vertex(triangle, 1), get_vertex(triangle, 2));
+        }
+
+        // Bytes in the vertex and index arrays.
+        size_t get_memory_size() const
+        {
+            return vertex_count * sizeof(Vector3f) + triangle_count * 3 * sizeof(uint32_t);
+        }
+
+    private:
+        const Vector3f* vertices;
+        int vertex_count;
+        const uint32_t* indices;
+        int triangle_count;
+    };
+}
+
+#endif
@@ -0,0 +1,185 @@
+#include "workerpool.hpp"
+#include "timer.hpp"
+#include <stdio.h>
+#include <utility>
+
+using namespace dn;
+
+WorkerPool::WorkerPool(int n)
+:   generation(0), running(0), quit(false), job(0), run_time(0.0), failed(false)
+{
+    if (n <= 0)
+        n = std::thread::hardware_concurrency();
+    if (n <= 0)
+        n = 1;
+
+    for (int i = 0; i < n; i++)
+        queues.push_back(new Queue());
+
+    ThreadStats zero = { 0.0, 0, 0 };
+    stats.resize(n, zero);
+
+    // Thread 0 is the one calling run().
+    for (int i = 1; i < n; i++)
+        threads.push_back(std::thread(&WorkerPool::thread_main, this, i));
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    start_cond.notify_all();
+
+    for (int i = 0; i < (int)threads.size(); i++)
+        threads[i].join();
+
+    for (int i = 0; i < (int)queues.size(); i++)
+        delete queues[i];
+}
+
+void WorkerPool::run(Job* job, int n)
+{
+    Timer timer;
+    int count = get_thread_count();
+
+    for (int i = 0; i < count; i++)
+    {
+        ThreadStats zero = { 0.0, 0, 0 };
+        stats[i] = zero;
+
+        std::lock_guard<std::mutex> lock(queues[i]->mutex);
+        queues[i]->tasks.clear();
+        for (int j = i * n / count; j < (i + 1) * n / count; j++)
+            queues[i]->tasks.push_back(j);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->job = job;
+        running = count;
+        failed = false;
+        generation++;
+    }
+    start_cond.notify_all();
+
+    work(0);
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running)
+            done_cond.wait(lock);
+        this->job = 0;
+    }
+
+    run_time = timer.elapsed();
+
+    if (error)
+    {
+        std::exception_ptr e;
+        std::swap(e, error);
+        std::rethrow_exception(e);
+    }
+}
+
+double WorkerPool::get_utilization(int thread) const
+{
+    if (run_time <= 0.0)
+        return 0.0;
+    return stats[thread].busy_time / run_time;
+}
+
+void WorkerPool::print_stats(const char* what) const
+{
+    fprintf(stderr, "%s took %.2f ms, utilization:", what, run_time * 1000.0);
+    for (int i = 0; i < get_thread_count(); i++)
+        fprintf(stderr, " %.0f%%", get_utilization(i) * 100.0);
+    fprintf(stderr, "\n");
+}
+
+void WorkerPool::thread_main(int thread)
+{
+    int seen = 0;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!quit && generation == seen)
+                start_cond.wait(lock);
+            if (quit)
+                return;
+            seen = generation;
+        }
+
+        work(thread);
+    }
+}
+
+void WorkerPool::work(int thread)
+{
+    ThreadStats& st = stats[thread];
+    int task;
+
+    while (!failed)
+    {
+        if (!pop(thread, task))
+        {
+            if (!steal(thread, task))
+                break;
+            st.steals++;
+        }
+
+        Timer timer;
+        try
+        {
+            job->run(task, thread);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error)
+                error = std::current_exception();
+            failed = true;
+        }
+        st.busy_time += timer.elapsed();
+        st.tasks++;
+    }
+
+    // No task is added during a run so once every queue has been seen
+    // empty this thread is done.
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--running == 0)
+        done_cond.notify_all();
+}
+
+bool WorkerPool::pop(int thread, int& task)
+{
+    Queue* q = queues[thread];
+    std::lock_guard<std::mutex> lock(q->mutex);
+    if (q->tasks.empty())
+        return false;
+    task = q->tasks.front();
+    q->tasks.pop_front();
+    return true;
+}
+
+bool WorkerPool::steal(int thread, int& task)
+{
+    int count = get_thread_count();
+
+    for (int i = 1; i < count; i++)
+    {
+        Queue* q = queues[(thread + i) % count];
+        std::lock_guard<std::mutex> lock(q->mutex);
+        if (q->tasks.empty())
+            continue;
+        task = q->tasks.back();
+        q->tasks.pop_back();
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,89 @@
+#ifndef _dn_workerpool_hpp_
+#define _dn_workerpool_hpp_
+
+#include "dndefs.hpp"
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <atomic>
+
+namespace dn
+{
+    // Persistent worker threads with work stealing.
+    //
+    // run() executes tasks 0..n-1. Each thread gets a contiguous range of
+    // task indices and works through it front to back, so tasks that are
+    // close in index (e.g. tiles in Z-order) stay on the same thread. A
+    // thread that runs out of work steals from the back of another
+    // thread's queue. The calling thread works as thread 0.
+    //
+    // If a task throws, no more tasks are started and run() rethrows the
+    // first exception on the calling thread once the others are done.
+    class WorkerPool
+    {
+    public:
+        class Job
+        {
+        public:
+            virtual ~Job() {}
+            virtual void run(int task, int thread) = 0;
+        };
+
+        struct ThreadStats
+        {
+            double busy_time;   // seconds spent inside Job::run
+            int tasks;
+            int steals;
+        };
+
+        // Zero threads means one per hardware thread.
+        WorkerPool(int threads = 0);
+        ~WorkerPool();
+
+        int get_thread_count() const { return (int)queues.size(); }
+
+        void run(Job* job, int n);
+
+        // Statistics of the last run().
+        double get_run_time() const { return run_time; }
+        const ThreadStats& get_thread_stats(int thread) const { return stats[thread]; }
+        double get_utilization(int thread) const;
+
+        void print_stats(const char* what) const;
+
+    private:
+        struct Queue
+        {
+            std::mutex mutex;
+            std::deque<int> tasks;
+        };
+
+        void thread_main(int thread);
+        void work(int thread);
+        bool pop(int thread, int& task);
+        bool steal(int thread, int& task);
+
+    private:
+        std::vector<Queue*> queues;
+        std::vector<std::thread> threads;
+        std::vector<ThreadStats> stats;
+
+        std::mutex mutex;
+        std::condition_variable start_cond;
+        std::condition_variable done_cond;
+        int generation;
+        int running;
+        bool quit;
+
+        Job* job;
+        double run_time;
+
+        std::atomic<bool> failed;
+        std::exception_ptr error;
+    };
+}
+
+#endif